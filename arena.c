@@ -0,0 +1,257 @@
+#include "interpreter.h"
+#include <pthread.h>
+
+/*
+** Bump-pointer arenas. Small requests are carved from ARENA_CHUNK_SIZE
+** chunks; anything over a quarter of that gets a chunk of its own, which
+** arenaGrow resizes with realloc and arenaRelease can give back early.
+** Chunks are taken from and given back to a process-wide pool, so once a
+** few programs have been compiled, compiling the next one reuses their
+** memory instead of calling malloc. The pool keeps at most ARENA_POOL_LIMIT
+** bytes and no chunk over ARENA_POOL_CHUNK: malloc maps those afresh anyway,
+** so pooling them would only pin memory a large program has finished with.
+*/
+
+#define ARENA_CHUNK_SIZE ((size_t)64 << 10)
+#define ARENA_POOL_LIMIT ((size_t)64 << 20)
+#define ARENA_POOL_CHUNK ((size_t)1 << 20)
+#define ARENA_ALIGN      8
+
+struct ArenaChunk
+{
+    ArenaChunk* next;
+    size_t      size;
+    size_t      used;
+    size_t      pad;
+    char        data[];
+};
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static ArenaChunk*     poolSmall;
+static ArenaChunk*     poolLarge;
+static size_t          poolBytes;
+
+static size_t alignUp(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/* A chunk with room for size bytes: the smallest pooled one that fits, else a new one. */
+static ArenaChunk* takeChunk(Arena* arena, size_t size)
+{
+    ArenaChunk*  chunk = NULL;
+    ArenaChunk** best  = NULL;
+
+    pthread_mutex_lock(&poolLock);
+    if (size == ARENA_CHUNK_SIZE && poolSmall)
+    {
+        chunk     = poolSmall;
+        poolSmall = chunk->next;
+    }
+    else if (size != ARENA_CHUNK_SIZE && size <= ARENA_POOL_CHUNK)
+    {
+        for (ArenaChunk** link = &poolLarge; *link; link = &(*link)->next)
+            if ((*link)->size >= size && (!best || (*link)->size < (*best)->size))
+                best = link;
+        if (best && (*best)->size <= size * 2)
+        {
+            chunk = *best;
+            *best = chunk->next;
+        }
+    }
+    if (chunk)
+        poolBytes -= chunk->size;
+    pthread_mutex_unlock(&poolLock);
+
+    if (!chunk)
+    {
+        chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + size);
+        if (!chunk)
+            reportError(ERR_NO_MEMORY, "Out of memory");
+        chunk->size = size;
+        arena->stats.fresh++;
+    }
+    chunk->used = 0;
+    arena->stats.chunks++;
+    return chunk;
+}
+
+static void giveChunks(ArenaChunk* chunk)
+{
+    pthread_mutex_lock(&poolLock);
+    while (chunk)
+    {
+        ArenaChunk* next = chunk->next;
+        if (chunk->size > ARENA_POOL_CHUNK || poolBytes + chunk->size > ARENA_POOL_LIMIT)
+            free(chunk);
+        else if (chunk->size == ARENA_CHUNK_SIZE)
+        {
+            chunk->next = poolSmall;
+            poolSmall   = chunk;
+            poolBytes += chunk->size;
+        }
+        else
+        {
+            chunk->next = poolLarge;
+            poolLarge   = chunk;
+            poolBytes += chunk->size;
+        }
+        chunk = next;
+    }
+    pthread_mutex_unlock(&poolLock);
+}
+
+void arenaInit(Arena* arena)
+{
+    ft_memset(arena, 0, sizeof(Arena));
+}
+
+/* size bytes aligned for any Value or pointer; running out of memory reports an error. */
+void* arenaAlloc(Arena* arena, size_t size)
+{
+    ArenaChunk* chunk = arena->small;
+
+    size = alignUp(size ? size : 1);
+    arena->stats.allocs++;
+    arena->stats.bytes += size;
+    if (size > ARENA_CHUNK_SIZE / 4)
+    {
+        chunk        = takeChunk(arena, size);
+        chunk->used  = size;
+        chunk->next  = arena->large;
+        arena->large = chunk;
+        return chunk->data;
+    }
+    if (!chunk || chunk->size - chunk->used < size)
+    {
+        chunk        = takeChunk(arena, ARENA_CHUNK_SIZE);
+        chunk->next  = arena->small;
+        arena->small = chunk;
+    }
+    void* block = chunk->data + chunk->used;
+    chunk->used += size;
+    return block;
+}
+
+/* Hands a block's chunk back to the pool early when the block has one to itself. */
+void arenaRelease(Arena* arena, void* block)
+{
+    for (ArenaChunk** link = &arena->large; *link; link = &(*link)->next)
+        if ((*link)->data == (char*)block)
+        {
+            ArenaChunk* chunk = *link;
+            *link       = chunk->next;
+            chunk->next = NULL;
+            giveChunks(chunk);
+            return;
+        }
+}
+
+/*
+** Moves a block out of the arena into malloc'd memory of newSize bytes that
+** the caller frees. A block with a chunk of its own takes the chunk along
+** instead of being copied, so a large block never exists twice.
+*/
+void* arenaDetach(Arena* arena, void* block, size_t oldSize, size_t newSize)
+{
+    void* owned;
+
+    if (oldSize > newSize)
+        oldSize = newSize;
+    for (ArenaChunk** link = &arena->large; *link; link = &(*link)->next)
+        if ((*link)->data == (char*)block)
+        {
+            ArenaChunk* chunk = *link;
+            *link = chunk->next;
+            memmove(chunk, chunk->data, oldSize);
+            owned = realloc(chunk, newSize ? newSize : 1);
+            if (!owned)
+            {
+                free(chunk);
+                reportError(ERR_NO_MEMORY, "Out of memory");
+            }
+            return owned;
+        }
+    owned = malloc(newSize ? newSize : 1);
+    if (!owned)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    memcpy(owned, block, oldSize);
+    return owned;
+}
+
+/*
+** Resizes a block from arenaAlloc, keeping its contents. The newest small
+** block grows in place and a block with a chunk of its own is realloc'd
+** with it; any other block is copied to a new one.
+*/
+void* arenaGrow(Arena* arena, void* block, size_t oldSize, size_t newSize)
+{
+    ArenaChunk* chunk = arena->small;
+
+    if (!block)
+        return arenaAlloc(arena, newSize);
+    oldSize = alignUp(oldSize);
+    newSize = alignUp(newSize);
+    if (chunk && (char*)block + oldSize == chunk->data + chunk->used
+        && newSize <= ARENA_CHUNK_SIZE / 4 && chunk->size - chunk->used + oldSize >= newSize)
+    {
+        chunk->used += newSize - oldSize;
+        arena->stats.allocs++;
+        arena->stats.bytes += newSize - oldSize;
+        return block;
+    }
+    if (oldSize > ARENA_CHUNK_SIZE / 4)
+        for (ArenaChunk** link = &arena->large; *link; link = &(*link)->next)
+            if ((*link)->data == (char*)block && newSize > oldSize)
+            {
+                chunk = (ArenaChunk*)realloc(*link, sizeof(ArenaChunk) + newSize);
+                if (!chunk)
+                    reportError(ERR_NO_MEMORY, "Out of memory");
+                chunk->size = newSize;
+                chunk->used = newSize;
+                *link       = chunk;
+                arena->stats.allocs++;
+                arena->stats.bytes += newSize - oldSize;
+                return chunk->data;
+            }
+
+    void* grown = arenaAlloc(arena, newSize);
+    memcpy(grown, block, oldSize < newSize ? oldSize : newSize);
+    return grown;
+}
+
+/* Drops every block but keeps one chunk for the next round of allocations. */
+void arenaReset(Arena* arena)
+{
+    ArenaChunk* keep = arena->small;
+
+    if (keep)
+    {
+        giveChunks(keep->next);
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    giveChunks(arena->large);
+    arena->small = keep;
+    arena->large = NULL;
+}
+
+void arenaFree(Arena* arena)
+{
+    giveChunks(arena->small);
+    giveChunks(arena->large);
+    arena->small = NULL;
+    arena->large = NULL;
+}
+
+/* Bytes of chunk memory the arena holds. */
+size_t arenaReserved(const Arena* arena)
+{
+    size_t size = 0;
+
+    for (const ArenaChunk* c = arena->small; c; c = c->next)
+        size += sizeof(ArenaChunk) + c->size;
+    for (const ArenaChunk* c = arena->large; c; c = c->next)
+        size += sizeof(ArenaChunk) + c->size;
+    return size;
+}
@@ -0,0 +1,492 @@
+#include "array.h"
+#include "numeric.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(ARRAY_NO_SIMD)
+# include <immintrin.h>
+# define ARRAY_SIMD 1
+# define AVX2       __attribute__((target("avx2")))
+# define INLINE     static inline __attribute__((always_inline))
+#endif
+
+/*
+** Array storage and the whole-array operations. Elements are Values like
+** variables, so in the int32 modes they hold sign-extended 32-bit numbers.
+** + - * and the reductions run on kernels chosen once per process from
+** what the CPU supports: AVX2 (four lanes), SSE2 (two, the x86-64
+** baseline) or plain C. The vector kernels compute every lane in 64 bits
+** and wrap it to 32 afterwards in the int32 modes; under NUM_CHECKED a lane
+** that does not survive the wrap is an overflow, reported when the kernel
+** is done. 64-bit products are put together from 32-bit ones. Checked
+** products need AVX2's signed multiply and min/max of int64 values its
+** 64-bit compare, so under SSE2 those stay scalar. x86 has no vector
+** integer division, so / and % are scalar everywhere. sum adds exactly and
+** then wraps, so under NUM_CHECKED it overflows only when the total does
+** not fit.
+*/
+
+enum
+{
+    SHAPE_VV,
+    SHAPE_VS,
+    SHAPE_SV
+};
+
+typedef struct
+{
+    const char* name;
+    int         (*arith)(int op, NumMode mode, int shape, Value* dst, const Value* a, const Value* b, size_t n);
+    Value       (*sum)(const Value* v, size_t n);
+    Value       (*extreme)(const Value* v, size_t n, int max, int narrow);
+} ArrayKernels;
+
+/* dst = a op b for op 0..2 (+ - *); nonzero on a checked overflow. */
+static int arithScalar(int op, NumMode mode, int shape, Value* dst, const Value* a, const Value* b, size_t n)
+{
+    size_t as = shape != SHAPE_SV;
+    size_t bs = shape != SHAPE_VS;
+
+    for (size_t i = 0; i < n; i++)
+        if (numApply(mode, op, a[i * as], b[i * bs], &dst[i]) != NUM_OK)
+            return 1;
+    return 0;
+}
+
+/* Exact for int32 elements (an array has at most 2^31 of them), wrapping for int64. */
+static Value sumScalar(const Value* v, size_t n)
+{
+    uint64_t s = 0;
+
+    for (size_t i = 0; i < n; i++)
+        s += (uint64_t)v[i];
+    return (Value)s;
+}
+
+static Value extremeScalar(const Value* v, size_t n, int max, int narrow)
+{
+    Value best = v[0];
+
+    (void)narrow;
+    for (size_t i = 1; i < n; i++)
+        if (max ? v[i] > best : v[i] < best)
+            best = v[i];
+    return best;
+}
+
+static const ArrayKernels scalarKernels = { "scalar", arithScalar, sumScalar, extremeScalar };
+
+#ifdef ARRAY_SIMD
+
+/* The scalar kernel for the last elements, which fill less than a vector. */
+static int arithTail(int op, NumMode mode, int as, int bs, Value* dst, const Value* a, const Value* b, size_t i, size_t n)
+{
+    int shape = !as ? SHAPE_SV : !bs ? SHAPE_VS : SHAPE_VV;
+
+    return arithScalar(op, mode, shape, dst + i, a + (as ? i : 0), b + (bs ? i : 0), n - i);
+}
+
+/*
+** One instance of body per operator and mode, with the operand strides as
+** constants: 1 for an array, 0 for a number broadcast to every lane.
+*/
+# define ARITH_CASE(body, op, mode)                                  \
+    case op * 3 + mode:                                              \
+        if (shape == SHAPE_VS)                                       \
+            return body(op, mode, 1, 0, dst, a, b, n);               \
+        if (shape == SHAPE_SV)                                       \
+            return body(op, mode, 0, 1, dst, a, b, n);               \
+        return body(op, mode, 1, 1, dst, a, b, n);
+# define ARITH_CASES(body)                                           \
+    ARITH_CASE(body, 0, NUM_INT32) ARITH_CASE(body, 0, NUM_INT64)    \
+    ARITH_CASE(body, 0, NUM_CHECKED) ARITH_CASE(body, 1, NUM_INT32)  \
+    ARITH_CASE(body, 1, NUM_INT64) ARITH_CASE(body, 1, NUM_CHECKED)  \
+    ARITH_CASE(body, 2, NUM_INT32) ARITH_CASE(body, 2, NUM_INT64)
+
+/* Sign-extends the low half of each 64-bit lane. */
+INLINE __m128i wrap32x2(__m128i r)
+{
+    __m128i lo = _mm_shuffle_epi32(r, _MM_SHUFFLE(2, 0, 2, 0));
+    return _mm_unpacklo_epi32(lo, _mm_srai_epi32(lo, 31));
+}
+
+INLINE __m128i mul64x2(__m128i x, __m128i y)
+{
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), y),
+        _mm_mul_epu32(x, _mm_srli_epi64(y, 32)));
+    return _mm_add_epi64(_mm_mul_epu32(x, y), _mm_slli_epi64(cross, 32));
+}
+
+INLINE int sse2Arith(int op, NumMode mode, int as, int bs, Value* dst, const Value* a, const Value* b, size_t n)
+{
+    __m128i va  = _mm_set1_epi64x(a[0]);
+    __m128i vb  = _mm_set1_epi64x(b[0]);
+    __m128i bad = _mm_setzero_si128();
+    size_t  i   = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i x = as ? _mm_loadu_si128((const __m128i*)(a + i)) : va;
+        __m128i y = bs ? _mm_loadu_si128((const __m128i*)(b + i)) : vb;
+        __m128i r;
+        if (op == 0)
+            r = _mm_add_epi64(x, y);
+        else if (op == 1)
+            r = _mm_sub_epi64(x, y);
+        else if (mode == NUM_INT64)
+            r = mul64x2(x, y);
+        else
+            r = _mm_mul_epu32(x, y);
+        if (mode != NUM_INT64)
+        {
+            __m128i w = wrap32x2(r);
+            if (mode == NUM_CHECKED)
+                bad = _mm_or_si128(bad, _mm_xor_si128(r, w));
+            r = w;
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), r);
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xFFFF)
+        return 1;
+    return arithTail(op, mode, as, bs, dst, a, b, i, n);
+}
+
+static int arithSse2(int op, NumMode mode, int shape, Value* dst, const Value* a, const Value* b, size_t n)
+{
+    switch (op * 3 + (int)mode)
+    {
+        ARITH_CASES(sse2Arith)
+        default:
+            return arithScalar(op, mode, shape, dst, a, b, n);
+    }
+}
+
+static Value sumSse2(const Value* v, size_t n)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t  i   = 0;
+    Value   lanes[2];
+
+    for (; i + 2 <= n; i += 2)
+        acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i*)(v + i)));
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return (Value)((uint64_t)lanes[0] + (uint64_t)lanes[1] + (uint64_t)sumScalar(v + i, n - i));
+}
+
+/* Values that fit 32 bits compare like their low halves, which SSE2 can compare. */
+INLINE Value sse2Extreme(const Value* v, size_t n, int max)
+{
+    __m128i best = _mm_loadu_si128((const __m128i*)v);
+    size_t  i    = 2;
+    Value   lanes[2];
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i x    = _mm_loadu_si128((const __m128i*)(v + i));
+        __m128i take = max ? _mm_cmpgt_epi32(x, best) : _mm_cmpgt_epi32(best, x);
+        take = _mm_shuffle_epi32(take, _MM_SHUFFLE(2, 2, 0, 0));
+        best = _mm_or_si128(_mm_and_si128(take, x), _mm_andnot_si128(take, best));
+    }
+    _mm_storeu_si128((__m128i*)lanes, best);
+    Value r = max ? (lanes[0] > lanes[1] ? lanes[0] : lanes[1]) : (lanes[0] < lanes[1] ? lanes[0] : lanes[1]);
+    if (i < n)
+    {
+        Value t = extremeScalar(v + i, n - i, max, 1);
+        r = (max ? t > r : t < r) ? t : r;
+    }
+    return r;
+}
+
+static Value extremeSse2(const Value* v, size_t n, int max, int narrow)
+{
+    if (!narrow || n < 2)
+        return extremeScalar(v, n, max, narrow);
+    return max ? sse2Extreme(v, n, 1) : sse2Extreme(v, n, 0);
+}
+
+INLINE AVX2 __m256i wrap32x4(__m256i r)
+{
+    __m256i lo = _mm256_shuffle_epi32(r, _MM_SHUFFLE(2, 0, 2, 0));
+    return _mm256_unpacklo_epi32(lo, _mm256_srai_epi32(lo, 31));
+}
+
+INLINE AVX2 __m256i mul64x4(__m256i x, __m256i y)
+{
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), y),
+        _mm256_mul_epu32(x, _mm256_srli_epi64(y, 32)));
+    return _mm256_add_epi64(_mm256_mul_epu32(x, y), _mm256_slli_epi64(cross, 32));
+}
+
+INLINE AVX2 int avx2Arith(int op, NumMode mode, int as, int bs, Value* dst, const Value* a, const Value* b, size_t n)
+{
+    __m256i va  = _mm256_set1_epi64x(a[0]);
+    __m256i vb  = _mm256_set1_epi64x(b[0]);
+    __m256i bad = _mm256_setzero_si256();
+    size_t  i   = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = as ? _mm256_loadu_si256((const __m256i*)(a + i)) : va;
+        __m256i y = bs ? _mm256_loadu_si256((const __m256i*)(b + i)) : vb;
+        __m256i r;
+        if (op == 0)
+            r = _mm256_add_epi64(x, y);
+        else if (op == 1)
+            r = _mm256_sub_epi64(x, y);
+        else if (mode == NUM_INT64)
+            r = mul64x4(x, y);
+        else
+            r = _mm256_mul_epi32(x, y);
+        if (mode != NUM_INT64)
+        {
+            __m256i w = wrap32x4(r);
+            if (mode == NUM_CHECKED)
+                bad = _mm256_or_si256(bad, _mm256_xor_si256(r, w));
+            r = w;
+        }
+        _mm256_storeu_si256((__m256i*)(dst + i), r);
+    }
+    if (!_mm256_testz_si256(bad, bad))
+        return 1;
+    return arithTail(op, mode, as, bs, dst, a, b, i, n);
+}
+
+static AVX2 int arithAvx2(int op, NumMode mode, int shape, Value* dst, const Value* a, const Value* b, size_t n)
+{
+    switch (op * 3 + (int)mode)
+    {
+        ARITH_CASES(avx2Arith)
+        ARITH_CASE(avx2Arith, 2, NUM_CHECKED)
+        default:
+            return arithScalar(op, mode, shape, dst, a, b, n);
+    }
+}
+
+static AVX2 Value sumAvx2(const Value* v, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t  i   = 0;
+    Value   lanes[4];
+
+    for (; i + 4 <= n; i += 4)
+        acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i*)(v + i)));
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return (Value)((uint64_t)lanes[0] + (uint64_t)lanes[1] + (uint64_t)lanes[2] + (uint64_t)lanes[3]
+        + (uint64_t)sumScalar(v + i, n - i));
+}
+
+INLINE AVX2 Value avx2Extreme(const Value* v, size_t n, int max)
+{
+    __m256i best = _mm256_loadu_si256((const __m256i*)v);
+    size_t  i    = 4;
+    Value   lanes[4];
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x    = _mm256_loadu_si256((const __m256i*)(v + i));
+        __m256i take = max ? _mm256_cmpgt_epi64(x, best) : _mm256_cmpgt_epi64(best, x);
+        best = _mm256_blendv_epi8(best, x, take);
+    }
+    _mm256_storeu_si256((__m256i*)lanes, best);
+    Value r = extremeScalar(lanes, 4, max, 0);
+    if (i < n)
+    {
+        Value t = extremeScalar(v + i, n - i, max, 0);
+        r = (max ? t > r : t < r) ? t : r;
+    }
+    return r;
+}
+
+static AVX2 Value extremeAvx2(const Value* v, size_t n, int max, int narrow)
+{
+    if (n < 4)
+        return extremeScalar(v, n, max, narrow);
+    return max ? avx2Extreme(v, n, 1) : avx2Extreme(v, n, 0);
+}
+
+static const ArrayKernels sse2Kernels = { "sse2", arithSse2, sumSse2, extremeSse2 };
+static const ArrayKernels avx2Kernels = { "avx2", arithAvx2, sumAvx2, extremeAvx2 };
+
+static int hasAvx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static const ArrayKernels* selected;
+
+static const ArrayKernels* bestKernels(void)
+{
+#ifdef ARRAY_SIMD
+    return hasAvx2() ? &avx2Kernels : &sse2Kernels;
+#else
+    return &scalarKernels;
+#endif
+}
+
+/* Chosen on first use; threads racing to choose all store the same pointer. */
+static const ArrayKernels* kernels(void)
+{
+    const ArrayKernels* k = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+
+    if (!k)
+    {
+        k = bestKernels();
+        __atomic_store_n(&selected, k, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+/* auto, avx2, sse2 or scalar; 0 when the name is unknown or the CPU lacks it. */
+int arraySelectKernels(const char* name)
+{
+    const ArrayKernels* k = NULL;
+
+    if (strcmp(name, "auto") == 0)
+        k = bestKernels();
+    else if (strcmp(name, "scalar") == 0)
+        k = &scalarKernels;
+#ifdef ARRAY_SIMD
+    else if (strcmp(name, "sse2") == 0)
+        k = &sse2Kernels;
+    else if (strcmp(name, "avx2") == 0 && hasAvx2())
+        k = &avx2Kernels;
+#endif
+    if (!k)
+        return 0;
+    __atomic_store_n(&selected, k, __ATOMIC_RELEASE);
+    return 1;
+}
+
+const char* arrayKernelName(void)
+{
+    return kernels()->name;
+}
+
+void arraysInit(ArrayTable* t, int slots)
+{
+    t->items = (Array*)calloc((size_t)slots + 1, sizeof(Array));
+    t->first = slots;
+    t->end   = 0;
+    if (!t->items)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+}
+
+/* Takes the table as void* so that it can be a cleanup. */
+void arraysFree(void* arg)
+{
+    ArrayTable* t = (ArrayTable*)arg;
+
+    if (!t->items)
+        return;
+    for (int slot = t->first; slot < t->end; slot++)
+        free(t->items[slot].data);
+    free(t->items);
+    t->items = NULL;
+}
+
+/* A declaration replaces whatever the slot held with length zeros. */
+void arrayDeclare(ArrayTable* t, int slot, Value length)
+{
+    Array* a = &t->items[slot];
+
+    if (length < 0 || length > ARRAY_MAX_LENGTH)
+        reportError(ERR_ARRAY, "Invalid array length");
+    Value* data = (Value*)calloc(length ? (size_t)length : 1, sizeof(Value));
+    if (!data)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    free(a->data);
+    a->data   = data;
+    a->length = (size_t)length;
+    if (slot < t->first)
+        t->first = slot;
+    if (slot >= t->end)
+        t->end = slot + 1;
+}
+
+/* The elements of an operand, which must be as long as the destination; a number stands for itself. */
+static const Value* operand(const ArrayTable* t, int slot, const Value* number, size_t n)
+{
+    if (slot < 0)
+        return number;
+    if (t->items[slot].length != n)
+        reportError(ERR_ARRAY, "Array lengths differ");
+    return t->items[slot].data;
+}
+
+/*
+** dst = a op b element by element, op 0..4 for + - * / % or -1 to copy or
+** fill with a. An operand slot of -1 stands for the number x (or y).
+*/
+void arrayApply(ArrayTable* t, NumMode mode, int dst, int op, int a, Value x, int b, Value y)
+{
+    Array*       d  = &t->items[dst];
+    size_t       n  = d->length;
+    const Value* pa = operand(t, a, &x, n);
+    const Value* pb = op < 0 ? NULL : operand(t, b, &y, n);
+
+    if (n == 0)
+        return;
+    if (op >= 0 && a < 0 && b < 0)
+    {
+        x  = numEval(mode, op, x, y);
+        op = -1;
+    }
+    if (op < 0)
+    {
+        if (a >= 0)
+            memmove(d->data, pa, sizeof(Value) * n);
+        else
+            for (size_t i = 0; i < n; i++)
+                d->data[i] = x;
+        return;
+    }
+    if (op <= 2)
+    {
+        int shape = a < 0 ? SHAPE_SV : b < 0 ? SHAPE_VS : SHAPE_VV;
+        if (kernels()->arith(op, mode, shape, d->data, pa, pb, n))
+            numFail(NUM_OVERFLOW);
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        NumStatus st = numDivide(mode, a < 0 ? x : pa[i], b < 0 ? y : pb[i], op == 4, &d->data[i]);
+        if (st != NUM_OK)
+            numFail(st);
+    }
+}
+
+/* sum, min or max (kind N_SUM, N_MIN, N_MAX) of a whole array. */
+Value arrayReduce(const ArrayTable* t, NumMode mode, NodeKind kind, int slot)
+{
+    const Array* a = &t->items[slot];
+
+    if (kind == N_SUM)
+    {
+        Value s = a->length ? kernels()->sum(a->data, a->length) : 0;
+        if (mode == NUM_INT32)
+            return numWrap32((uint64_t)s);
+        if (mode == NUM_CHECKED && (s < INT32_MIN || s > INT32_MAX))
+            numFail(NUM_OVERFLOW);
+        return s;
+    }
+    if (a->length == 0)
+        reportError(ERR_ARRAY, "Empty array");
+    return kernels()->extreme(a->data, a->length, kind == N_MAX, mode != NUM_INT64);
+}
+
+/*
+** A bounds guard, computed exactly: whether low + lowOffset and
+** high + highOffset are both indices of the array, or for slot -1 whether
+** the first is at most the second.
+*/
+int arrayCovers(const ArrayTable* t, int slot, Value low, int lowOffset, Value high, int highOffset)
+{
+    Value lo;
+    Value hi;
+
+    if (__builtin_add_overflow(low, (Value)lowOffset, &lo) || __builtin_add_overflow(high, (Value)highOffset, &hi))
+        return 0;
+    if (slot < 0)
+        return lo <= hi;
+    return lo >= 0 && hi < (Value)t->items[slot].length;
+}
@@ -0,0 +1,18 @@
+#ifndef ARRAY_H
+# define ARRAY_H
+
+# include "interpreter.h"
+
+# define ARRAY_MAX_LENGTH INT32_MAX
+
+/* The element at index, stopping the program when it is outside the array. */
+static inline Value* arrayElement(const ArrayTable* t, int slot, Value index)
+{
+    const Array* a = &t->items[slot];
+
+    if ((uint64_t)index >= a->length)
+        reportError(ERR_ARRAY, "Array index out of bounds");
+    return &a->data[index];
+}
+
+#endif
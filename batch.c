@@ -0,0 +1,436 @@
+#include "interpreter.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+** Batch runner. A manifest lists one job per line, "program [input]", with
+** '#' starting a comment and "-" or a missing input meaning no input at
+** all. Every distinct program is loaded once, found by path through a
+** chained hash table while the manifest is read, and compiled once through a
+** shared ProgramCache, whose handles the workers run read-only. Jobs
+** are split into one contiguous range per worker; a worker takes jobs from
+** the front of its own range and, once that is empty, steals the back half
+** of another worker's range. Each job's output is captured by its worker's
+** instance and written by the calling thread in manifest order, so the
+** output does not depend on the thread count. A job that fails does not
+** stop the batch: its diagnostic follows whatever output it produced.
+*/
+
+/* Compiled programs the batch keeps around; beyond this the least recently used go. */
+#define BATCH_CACHE_BYTES ((size_t)256 << 20)
+
+typedef struct
+{
+    char*    path;
+    uint64_t hash;
+    int      chain;
+    Source   src;
+} BatchProgram;
+
+typedef struct
+{
+    int        program;
+    char*      input;
+    char*      out;
+    size_t     outLen;
+    Diagnostic error;
+    int        done;
+} BatchJob;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    int             head;
+    int             tail;
+} BatchRange;
+
+typedef struct
+{
+    BatchProgram*        programs;
+    int                  programCount;
+    int*                 buckets;
+    int                  bucketCount;
+    BatchJob*            jobs;
+    int                  jobCount;
+    BatchRange*          ranges;
+    int                  threads;
+    const InterpOptions* opts;
+    ProgramCache*        cache;
+    pthread_mutex_t      doneLock;
+    pthread_cond_t       doneCond;
+} Batch;
+
+typedef struct
+{
+    Batch* batch;
+    int    id;
+} BatchWorker;
+
+static char* copyWord(const char* start, const char* end)
+{
+    char* word = (char*)malloc((size_t)(end - start) + 1);
+
+    if (!word)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    memcpy(word, start, (size_t)(end - start));
+    word[end - start] = '\0';
+    return word;
+}
+
+/* Doubles the path table, kept at most half full, and rechains the programs into it. */
+static void growBuckets(Batch* b)
+{
+    int  count   = b->bucketCount ? b->bucketCount * 2 : 64;
+    int* buckets = (int*)malloc(sizeof(int) * (size_t)count);
+
+    if (!buckets)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    for (int i = 0; i < count; i++)
+        buckets[i] = -1;
+    for (int i = 0; i < b->programCount; i++)
+    {
+        int at               = (int)(b->programs[i].hash & (uint64_t)(count - 1));
+        b->programs[i].chain = buckets[at];
+        buckets[at]          = i;
+    }
+    free(b->buckets);
+    b->buckets     = buckets;
+    b->bucketCount = count;
+}
+
+/* Index of the program loaded from path, loading it on first use; -1 when it cannot be read. */
+static int internProgram(Batch* b, char* path)
+{
+    uint64_t hash = hashBytes(path, strlen(path));
+
+    if (b->programCount * 2 >= b->bucketCount)
+        growBuckets(b);
+    int at = (int)(hash & (uint64_t)(b->bucketCount - 1));
+    for (int i = b->buckets[at]; i >= 0; i = b->programs[i].chain)
+        if (b->programs[i].hash == hash && strcmp(b->programs[i].path, path) == 0)
+        {
+            free(path);
+            return i;
+        }
+    if ((b->programCount & (b->programCount - 1)) == 0)
+    {
+        size_t        cap   = b->programCount ? (size_t)b->programCount * 2 : 1;
+        BatchProgram* grown = (BatchProgram*)realloc(b->programs, sizeof(BatchProgram) * cap);
+        if (!grown)
+            reportError(ERR_NO_MEMORY, "Out of memory");
+        b->programs = grown;
+    }
+    BatchProgram* prog = &b->programs[b->programCount];
+    if (!loadSource(path, &prog->src))
+    {
+        fprintf(stderr, "batch: cannot read %s\n", path);
+        free(path);
+        return -1;
+    }
+    prog->path     = path;
+    prog->hash     = hash;
+    prog->chain    = b->buckets[at];
+    b->buckets[at] = b->programCount;
+    return b->programCount++;
+}
+
+static void addJob(Batch* b, int program, char* input)
+{
+    if ((b->jobCount & (b->jobCount - 1)) == 0)
+    {
+        size_t    cap   = b->jobCount ? (size_t)b->jobCount * 2 : 16;
+        BatchJob* grown = (BatchJob*)realloc(b->jobs, sizeof(BatchJob) * cap);
+        if (!grown)
+            reportError(ERR_NO_MEMORY, "Out of memory");
+        b->jobs = grown;
+    }
+    BatchJob* job = &b->jobs[b->jobCount++];
+    ft_memset(job, 0, sizeof(BatchJob));
+    job->program = program;
+    job->input   = input;
+}
+
+/* Adds a job per manifest line; 0 after reporting a line that cannot be run. */
+static int parseManifest(Batch* b, const char* text, size_t length)
+{
+    const char* p   = text;
+    const char* end = text + length;
+
+    while (p < end)
+    {
+        const char* line = p;
+        while (p < end && *p != '\n')
+            p++;
+        const char* stop = line;
+        while (stop < p && *stop != '#')
+            stop++;
+
+        char* words[2] = {NULL, NULL};
+        int   count    = 0;
+        const char* w  = line;
+        while (w < stop)
+        {
+            while (w < stop && ft_isspace(*w))
+                w++;
+            const char* wordEnd = w;
+            while (wordEnd < stop && !ft_isspace(*wordEnd))
+                wordEnd++;
+            if (wordEnd == w)
+                break;
+            if (count == 2)
+            {
+                fprintf(stderr, "batch: too many fields on manifest line: %.*s\n", (int)(p - line), line);
+                free(words[0]);
+                free(words[1]);
+                return 0;
+            }
+            words[count++] = copyWord(w, wordEnd);
+            w              = wordEnd;
+        }
+        if (count > 0)
+        {
+            if (words[1] && strcmp(words[1], "-") == 0)
+            {
+                free(words[1]);
+                words[1] = NULL;
+            }
+            int program = internProgram(b, words[0]);
+            if (program < 0)
+            {
+                free(words[1]);
+                return 0;
+            }
+            addJob(b, program, words[1]);
+        }
+        if (p < end)
+            p++;
+    }
+    return 1;
+}
+
+/* The parsed jobs and the loaded programs. */
+static void freeManifest(Batch* b)
+{
+    for (int i = 0; i < b->jobCount; i++)
+        free(b->jobs[i].input);
+    for (int i = 0; i < b->programCount; i++)
+    {
+        unloadSource(&b->programs[i].src);
+        free(b->programs[i].path);
+    }
+    free(b->programs);
+    free(b->buckets);
+    free(b->jobs);
+}
+
+/* Next job for worker id: from the front of its range, else stolen. */
+static int takeJob(Batch* b, int id)
+{
+    BatchRange* own = &b->ranges[id];
+    int         job = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail)
+        job = own->head++;
+    pthread_mutex_unlock(&own->lock);
+    if (job >= 0)
+        return job;
+
+    for (int k = 1; k < b->threads; k++)
+    {
+        BatchRange* victim = &b->ranges[(id + k) % b->threads];
+        int         from;
+        int         to;
+
+        pthread_mutex_lock(&victim->lock);
+        from = victim->head + (victim->tail - victim->head) / 2;
+        to   = victim->tail;
+        if (from < to)
+            victim->tail = from;
+        pthread_mutex_unlock(&victim->lock);
+        if (from >= to)
+            continue;
+        pthread_mutex_lock(&own->lock);
+        own->head = from + 1;
+        own->tail = to;
+        pthread_mutex_unlock(&own->lock);
+        return from;
+    }
+    return -1;
+}
+
+static void runJob(Batch* b, Interp* interp, BatchJob* job)
+{
+    const Source* src = &b->programs[job->program].src;
+    Value         none;
+    int           fd = -1;
+
+    ft_memset(&interp->opts.input, 0, sizeof(InputSource));
+    interp->opts.input.onEof = b->opts->input.onEof;
+    if (job->input)
+    {
+        fd = open(job->input, O_RDONLY);
+        if (fd < 0)
+        {
+            job->error.code    = ERR_SYSTEM;
+            job->error.message = "Cannot open input";
+            return;
+        }
+        interp->opts.input.kind = INPUT_FD;
+        interp->opts.input.fd   = fd;
+    }
+    else
+    {
+        interp->opts.input.kind   = INPUT_MEMORY;
+        interp->opts.input.values = &none;
+        interp->opts.input.count  = 0;
+    }
+    Compiled* c = cacheCompile(b->cache, src->text, src->length, b->opts, &job->error);
+    if (c)
+    {
+        interpRunCompiled(interp, c);
+        job->error = interp->error;
+        compiledRelease(c);
+    }
+    inputClose(interp);
+    if (fd >= 0)
+        close(fd);
+    job->out = interpTakeOutput(interp, &job->outLen);
+}
+
+static void* batchWorker(void* arg)
+{
+    BatchWorker* w = (BatchWorker*)arg;
+    Batch*       b = w->batch;
+    Interp*      interp;
+    int          job;
+
+    interp = interpCreate(b->opts);
+    if (!interp)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    interp->opts.captureOutput = 1;
+    while ((job = takeJob(b, w->id)) >= 0)
+    {
+        runJob(b, interp, &b->jobs[job]);
+        pthread_mutex_lock(&b->doneLock);
+        b->jobs[job].done = 1;
+        pthread_cond_broadcast(&b->doneCond);
+        pthread_mutex_unlock(&b->doneLock);
+    }
+    interpDestroy(interp);
+    return NULL;
+}
+
+static void writeAll(const char* text, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, text, len);
+        if (n <= 0)
+            return;
+        text += n;
+        len -= (size_t)n;
+    }
+}
+
+static double elapsedSince(const struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int runBatch(const char* manifestPath, int threads, const InterpOptions* opts)
+{
+    Batch           b;
+    Source          manifest;
+    pthread_t*      tids;
+    BatchWorker*    workers;
+    struct timespec start;
+    int             failed = 0;
+
+    ft_memset(&b, 0, sizeof(Batch));
+    if (!loadSource(manifestPath, &manifest))
+    {
+        fprintf(stderr, "batch: cannot read %s\n", manifestPath);
+        return 0;
+    }
+    if (!parseManifest(&b, manifest.text, manifest.length))
+    {
+        unloadSource(&manifest);
+        freeManifest(&b);
+        return 0;
+    }
+    unloadSource(&manifest);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > b.jobCount && b.jobCount > 0)
+        threads = b.jobCount;
+    b.threads = threads;
+    b.opts    = opts;
+    b.cache   = cacheCreate(BATCH_CACHE_BYTES);
+    b.ranges  = (BatchRange*)malloc(sizeof(BatchRange) * (size_t)threads);
+    tids      = (pthread_t*)malloc(sizeof(pthread_t) * (size_t)threads);
+    workers   = (BatchWorker*)malloc(sizeof(BatchWorker) * (size_t)threads);
+    if (!b.ranges || !tids || !workers || !b.cache)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    pthread_mutex_init(&b.doneLock, NULL);
+    pthread_cond_init(&b.doneCond, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_mutex_init(&b.ranges[i].lock, NULL);
+        b.ranges[i].head = (int)((long)b.jobCount * i / threads);
+        b.ranges[i].tail = (int)((long)b.jobCount * (i + 1) / threads);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].batch = &b;
+        workers[i].id    = i;
+        if (pthread_create(&tids[i], NULL, batchWorker, &workers[i]) != 0)
+            reportError(ERR_SYSTEM, "Cannot start batch worker");
+    }
+
+    /* Emit in manifest order while later jobs are still running. */
+    for (int i = 0; i < b.jobCount; i++)
+    {
+        pthread_mutex_lock(&b.doneLock);
+        while (!b.jobs[i].done)
+            pthread_cond_wait(&b.doneCond, &b.doneLock);
+        pthread_mutex_unlock(&b.doneLock);
+        writeAll(b.jobs[i].out, b.jobs[i].outLen);
+        free(b.jobs[i].out);
+        b.jobs[i].out = NULL;
+        if (b.jobs[i].error.code != ERR_NONE)
+        {
+            fprintf(stderr, "batch: job %d (%s%s%s): ", i + 1, b.programs[b.jobs[i].program].path,
+                b.jobs[i].input ? " < " : "", b.jobs[i].input ? b.jobs[i].input : "");
+            printDiagnostic(&b.jobs[i].error, stderr);
+            failed++;
+        }
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    double secs = elapsedSince(&start);
+    CacheStats cs;
+    cacheGetStats(b.cache, &cs);
+    fprintf(stderr, "batch: %d jobs on %d threads in %.3fs (%.1f jobs/s), %zu compiled, %zu cache hits, %d failed\n",
+        b.jobCount, threads, secs, secs > 0 ? b.jobCount / secs : 0.0, cs.misses, cs.hits, failed);
+    cacheDestroy(b.cache);
+
+    for (int i = 0; i < threads; i++)
+        pthread_mutex_destroy(&b.ranges[i].lock);
+    pthread_mutex_destroy(&b.doneLock);
+    pthread_cond_destroy(&b.doneCond);
+    freeManifest(&b);
+    free(b.ranges);
+    free(tids);
+    free(workers);
+    return failed == 0;
+}
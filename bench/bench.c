@@ -0,0 +1,579 @@
+#include "interpreter.h"
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+** Benchmark harness. Each workload is a generated program, run with every
+** engine in a child process of its own so that peak RSS is that workload's
+** alone. Reported per workload and engine:
+**   tokens/s    tokenize throughput on the program text
+**   compile ms  compileSource, parse to bytecode or native loops
+**   iters/s     while-loop iterations per second of run time
+**   ns/stmt     run time per executed assignment, < and >
+**   peak RSS    of the child, including the generated text
+** Times are the best of --runs. Results go to stdout as a table and, with
+** --json, to a file one result per line; --baseline compares against such
+** a file and exits with 1 when a metric got worse by more than --threshold
+** percent.
+** usage: benchmark [--json=FILE] [--baseline=FILE] [--threshold=PCT]
+**                  [--runs=N] [--only=WORKLOAD]
+*/
+
+typedef struct
+{
+    char*  text;
+    size_t length;
+    double iterations;
+    double statements;
+    size_t inputs;
+} Workload;
+
+typedef struct
+{
+    double tokens;
+    double tokensPerSec;
+    double compileMs;
+    double runMs;
+    double iterations;
+    double statements;
+    long   peakRssKb;
+    int    failed;
+} Result;
+
+typedef struct
+{
+    const char* name;
+    void        (*generate)(Workload* w);
+} WorkloadDef;
+
+typedef struct
+{
+    char*  text;
+    size_t length;
+    size_t cap;
+} Buffer;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void append(Buffer* b, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(Buffer* b, const char* fmt, ...)
+{
+    va_list ap;
+    int     n;
+
+    for (;;)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(b->text + b->length, b->cap - b->length, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && b->length + (size_t)n < b->cap)
+            break;
+        b->cap  = b->cap ? b->cap * 2 : 4096;
+        b->text = (char*)realloc(b->text, b->cap);
+        if (!b->text)
+            exit(1);
+    }
+    b->length += (size_t)n;
+}
+
+static void finish(Workload* w, Buffer* b)
+{
+    append(b, ".\n");
+    w->text   = b->text;
+    w->length = b->length;
+}
+
+/* Nested counting loops as in the README: 1458 x 2916 inner iterations. */
+static void genLoop(Workload* w)
+{
+    Buffer b = {0};
+    double n = 1458;
+    double m = 2916;
+
+    append(&b, "n = 1458;\nm = 2916;\ni = 0;\nt = 0;\n");
+    append(&b, "{ i - n ?\n    j = 0;\n    { j - m ?\n        t = t + j %% 7;\n        j = j + 1;\n    }\n    i = i + 1;\n}\n< t;\n");
+    w->iterations = n * m + n;
+    w->statements = 4 + 2 * n + 2 * n * m + 1;
+    finish(w, &b);
+}
+
+/* A 400-term expression evaluated 6561 times. */
+static void genChain(Workload* w)
+{
+    static const char* terms[] = { "+ i", "- b", "+ c * 2", "- i % 3", "+ 7", "- a" };
+    Buffer b = {0};
+    double n = 6561;
+
+    append(&b, "n = 6561;\ni = 0;\nb = 3;\nc = 5;\na = 0;\n{ i - n ?\n    a = i");
+    for (int k = 0; k < 400; k++)
+        append(&b, "%s %s", k % 8 == 0 ? "\n       " : "", terms[k % 6]);
+    append(&b, ";\n    i = i + 1;\n}\n< a;\n");
+    w->iterations = n;
+    w->statements = 5 + 2 * n + 1;
+    finish(w, &b);
+}
+
+/* Several powers per statement, 9^5 times. */
+static void genPow(Workload* w)
+{
+    Buffer b = {0};
+    double n = 59049;
+
+    append(&b, "n = 59049;\ni = 0;\ns = 0;\n{ i - n ?\n");
+    append(&b, "    s = s + (i %% 9) ^ 5 - (i %% 7) ^ 3 + (i %% 5) ^ 2 ^ 2;\n");
+    append(&b, "    s = s %% 729 + (s %% 4) ^ 9;\n    i = i + 1;\n}\n< s;\n");
+    w->iterations = n;
+    w->statements = 3 + 3 * n + 1;
+    finish(w, &b);
+}
+
+static void genTree(Buffer* b, int depth, int leaf)
+{
+    if (depth == 0)
+    {
+        append(b, "t = t + %d;", leaf % 9 + 1);
+        return;
+    }
+    append(b, "[ i %% %d ? ", depth + 1);
+    genTree(b, depth - 1, leaf * 2);
+    append(b, " : ");
+    genTree(b, depth - 1, leaf * 2 + 1);
+    append(b, " ]");
+}
+
+/* A depth 8 tree of [ ? : ] branches, one path taken per iteration. */
+static void genIfTree(Workload* w)
+{
+    Buffer b = {0};
+    double n = 59049 * 2;
+
+    append(&b, "n = 118098;\ni = 0;\nt = 0;\n{ i - n ?\n    ");
+    genTree(&b, 8, 0);
+    append(&b, "\n    i = i + 1;\n}\n< t;\n");
+    w->iterations = n;
+    w->statements = 3 + 2 * n + 1;
+    finish(w, &b);
+}
+
+/* One < per iteration. */
+static void genOutput(Workload* w)
+{
+    Buffer b = {0};
+    double n = 59049 * 8;
+
+    append(&b, "n = 472392;\ni = 0;\n{ i - n ?\n    < i * 9 * 9;\n    i = i + 1;\n}\n");
+    w->iterations = n;
+    w->statements = 2 + 2 * n;
+    finish(w, &b);
+}
+
+/* One > per iteration, from a file of integers. */
+static void genInput(Workload* w)
+{
+    Buffer b = {0};
+    double n = 59049 * 4;
+
+    append(&b, "n = 236196;\ni = 0;\ns = 0;\n{ i - n ?\n    > x;\n    s = s + x %% 9;\n    i = i + 1;\n}\n< s;\n");
+    w->iterations = n;
+    w->statements = 3 + 3 * n + 1;
+    w->inputs     = (size_t)n;
+    finish(w, &b);
+}
+
+/* 16 MiB of straight-line statements: the front end is most of the cost. */
+static void genLarge(Workload* w)
+{
+    static const char* lines[] = {
+        "a = b + c * 2 - d % 7;\n",
+        "b = a ^ 2 + (c - 1) * e;\n",
+        "[ a - b ? c = c + 1; : d = d - 1; ]\n",
+        "e = (a + b) % 9 + c * d;\n",
+    };
+    Buffer b = {0};
+    double count = 0;
+
+    while (b.length < ((size_t)16 << 20))
+    {
+        append(&b, "%s", lines[(size_t)count % 4]);
+        count++;
+    }
+    w->iterations = 0;
+    w->statements = count;
+    finish(w, &b);
+}
+
+/* A bounds-guarded indexed loop over 64Ki elements, then 64 rounds of whole-array operations. */
+static void genArray(Workload* w)
+{
+    Buffer b = {0};
+    double n = 65536;
+    double k = 64;
+
+    append(&b, "n = 65536;\na[n];\nb[n];\nc[n];\ni = 0;\n{ i - n ?\n");
+    append(&b, "    a[i] = i %% 1000;\n    b[i] = i %% 7 + 1;\n    i = i + 1;\n}\n");
+    append(&b, "k = 0;\nt = 0;\n{ k - 64 ?\n    c = a * b;\n    c = c + a;\n");
+    append(&b, "    t = t + sum(c) %% 1000 + max(c) %% 7;\n    k = k + 1;\n}\n< t;\n");
+    w->iterations = n + k;
+    w->statements = 5 + 3 * n + 2 + 4 * k + 1;
+    finish(w, &b);
+}
+
+static const WorkloadDef workloads[] = {
+    { "loop",   genLoop },
+    { "chain",  genChain },
+    { "pow",    genPow },
+    { "iftree", genIfTree },
+    { "output", genOutput },
+    { "input",  genInput },
+    { "large",  genLarge },
+    { "array",  genArray },
+};
+
+#define WORKLOAD_COUNT (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static const char* engineNames[] = { "ast", "vm", "jit" };
+
+#ifdef JIT_SUPPORTED
+# define ENGINE_COUNT 3
+#else
+# define ENGINE_COUNT 2
+#endif
+
+/* A temporary file of count integers for > to read. */
+static int inputFile(size_t count)
+{
+    FILE* f = tmpfile();
+
+    if (!f)
+        return -1;
+    for (size_t k = 0; k < count; k++)
+        fprintf(f, "%zu\n", (k * 7919) % 100000);
+    fflush(f);
+    return dup(fileno(f));
+}
+
+static void measureLexer(const Workload* w, Result* r)
+{
+    double    spent = 0;
+    int       reps  = 0;
+    TokenList list;
+
+    while (spent < 0.05 || reps < 3)
+    {
+        Arena  arena;
+        arenaInit(&arena);
+        double t0 = now();
+        tokenize(w->text, w->length, &list, &arena);
+        spent += now() - t0;
+        r->tokens = (double)(list.count - 1);
+        arenaFree(&arena);
+        reps++;
+    }
+    r->tokensPerSec = r->tokens * reps / spent;
+}
+
+/* Runs in the child: every measurement of one workload on one engine. */
+static void measure(const WorkloadDef* def, int engine, int runs, Result* r)
+{
+    Workload      w = {0};
+    InterpOptions opts;
+    Diagnostic    err;
+    Compiled*     c = NULL;
+
+    def->generate(&w);
+    measureLexer(&w, r);
+    initOptions(&opts);
+    opts.engine       = engine == 0 ? ENGINE_AST : ENGINE_VM;
+    opts.jit          = engine == 2;
+    opts.input.kind   = INPUT_FD;
+    opts.input.fd     = w.inputs ? inputFile(w.inputs) : STDIN_FILENO;
+    opts.input.prompt = 0;
+    r->compileMs = 1e30;
+    r->runMs     = 1e30;
+    for (int k = 0; k < runs; k++)
+    {
+        double t0 = now();
+        c = compileSource(w.text, w.length, &opts, &err);
+        double t1 = now();
+        if (!c)
+        {
+            printDiagnostic(&err, stderr);
+            r->failed = 1;
+            return;
+        }
+        if ((t1 - t0) * 1e3 < r->compileMs)
+            r->compileMs = (t1 - t0) * 1e3;
+        if (k + 1 < runs)
+            compiledRelease(c);
+    }
+    for (int k = 0; k < runs; k++)
+    {
+        Interp* interp = interpCreate(&opts);
+        if (w.inputs)
+            lseek(opts.input.fd, 0, SEEK_SET);
+        double t0 = now();
+        ErrorCode code = interpRunCompiled(interp, c);
+        double t1 = now();
+        if (code != ERR_NONE)
+        {
+            printDiagnostic(&interp->error, stderr);
+            r->failed = 1;
+        }
+        interpDestroy(interp);
+        if ((t1 - t0) * 1e3 < r->runMs)
+            r->runMs = (t1 - t0) * 1e3;
+    }
+    compiledRelease(c);
+    r->iterations = w.iterations;
+    r->statements = w.statements;
+}
+
+static int runChild(const WorkloadDef* def, int engine, int runs, Result* r)
+{
+    int           fds[2];
+    struct rusage usage;
+    int           status;
+    pid_t         pid;
+
+    ft_memset(r, 0, sizeof(Result));
+    fflush(stdout);
+    if (pipe(fds) != 0 || (pid = fork()) < 0)
+        return 0;
+    if (pid == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        close(fds[0]);
+        measure(def, engine, runs, r);
+        if (write(fds[1], r, sizeof(Result)) != (ssize_t)sizeof(Result))
+            _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], r, sizeof(Result));
+    close(fds[0]);
+    if (wait4(pid, &status, 0, &usage) < 0 || got != (ssize_t)sizeof(Result)
+        || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        r->failed = 1;
+    r->peakRssKb = usage.ru_maxrss;
+    return !r->failed;
+}
+
+static double nsPerStatement(const Result* r)
+{
+    return r->statements > 0 ? r->runMs * 1e6 / r->statements : 0;
+}
+
+static double itersPerSecond(const Result* r)
+{
+    return r->iterations > 0 && r->runMs > 0 ? r->iterations / (r->runMs / 1e3) : 0;
+}
+
+static void writeJson(FILE* out, const Result results[][ENGINE_COUNT], const int* chosen)
+{
+    int first = 1;
+
+    fprintf(out, "{\"version\": 1, \"results\": [\n");
+    for (int k = 0; k < WORKLOAD_COUNT; k++)
+        for (int e = 0; e < ENGINE_COUNT; e++)
+        {
+            const Result* r = &results[k][e];
+            if (!chosen[k] || r->failed)
+                continue;
+            fprintf(out, "%s{\"workload\": \"%s\", \"engine\": \"%s\", \"tokens\": %.0f, "
+                "\"tokens_per_s\": %.0f, \"compile_ms\": %.3f, \"run_ms\": %.3f, "
+                "\"iterations\": %.0f, \"iters_per_s\": %.0f, \"statements\": %.0f, "
+                "\"ns_per_stmt\": %.3f, \"peak_rss_kb\": %ld}",
+                first ? "" : ",\n", workloads[k].name, engineNames[e], r->tokens,
+                r->tokensPerSec, r->compileMs, r->runMs, r->iterations, itersPerSecond(r),
+                r->statements, nsPerStatement(r), r->peakRssKb);
+            first = 0;
+        }
+    fprintf(out, "\n]}\n");
+}
+
+static void printTable(const Result results[][ENGINE_COUNT], const int* chosen)
+{
+    printf("%-8s %-4s %9s %11s %10s %10s %9s %8s\n",
+        "workload", "eng", "Mtok/s", "compile ms", "run ms", "Miter/s", "ns/stmt", "RSS MB");
+    for (int k = 0; k < WORKLOAD_COUNT; k++)
+        for (int e = 0; e < ENGINE_COUNT; e++)
+        {
+            const Result* r = &results[k][e];
+            if (!chosen[k])
+                continue;
+            if (r->failed)
+            {
+                printf("%-8s %-4s failed\n", workloads[k].name, engineNames[e]);
+                continue;
+            }
+            printf("%-8s %-4s %9.1f %11.2f %10.2f %10.2f %9.2f %8.1f\n",
+                workloads[k].name, engineNames[e], r->tokensPerSec / 1e6, r->compileMs,
+                r->runMs, itersPerSecond(r) / 1e6, nsPerStatement(r), r->peakRssKb / 1024.0);
+        }
+}
+
+/* Pulls "key": number out of one line of a results file. */
+static int jsonNumber(const char* line, const char* key, double* value)
+{
+    char        pattern[64];
+    const char* at;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    if (!(at = strstr(line, pattern)))
+        return 0;
+    *value = strtod(at + strlen(pattern), NULL);
+    return 1;
+}
+
+static int jsonString(const char* line, const char* key, char* value, size_t size)
+{
+    char        pattern[64];
+    const char* at;
+    size_t      n = 0;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": \"", key);
+    if (!(at = strstr(line, pattern)))
+        return 0;
+    for (at += strlen(pattern); *at && *at != '"' && n + 1 < size; at++)
+        value[n++] = *at;
+    value[n] = '\0';
+    return 1;
+}
+
+/*
+** A metric is worse when it moved the wrong way by more than threshold
+** percent and by more than noise, the change too small to mean anything.
+*/
+static int compareMetric(const char* label, const char* metric, double old, double cur,
+    int higherIsBetter, double threshold, double noise)
+{
+    if (old <= 0 || cur <= 0 || (cur - old < noise && old - cur < noise))
+        return 0;
+    double change = (cur - old) / old * 100.0;
+    int    worse  = higherIsBetter ? change < -threshold : change > threshold;
+    int    better = higherIsBetter ? change > threshold : change < -threshold;
+    if (worse || better)
+        printf("%-10s %-12s %12.3f -> %12.3f  %+6.1f%%  %s\n", label, metric, old, cur, change,
+            worse ? "REGRESSION" : "improved");
+    return worse;
+}
+
+static int compareBaseline(const char* path, const Result results[][ENGINE_COUNT],
+    const int* chosen, double threshold)
+{
+    FILE* f = fopen(path, "r");
+    char  line[1024];
+    int   regressions = 0;
+    int   matched     = 0;
+
+    if (!f)
+    {
+        fprintf(stderr, "benchmark: cannot open baseline %s\n", path);
+        return -1;
+    }
+    printf("\ncompared with %s (threshold %.0f%%):\n", path, threshold);
+    while (fgets(line, sizeof(line), f))
+    {
+        char   name[32];
+        char   engine[8];
+        double tokensPerSec, compileMs, nsPerStmt, rss;
+        if (!jsonString(line, "workload", name, sizeof(name))
+            || !jsonString(line, "engine", engine, sizeof(engine)))
+            continue;
+        for (int k = 0; k < WORKLOAD_COUNT; k++)
+            for (int e = 0; e < ENGINE_COUNT; e++)
+            {
+                const Result* r = &results[k][e];
+                char          label[48];
+                if (!chosen[k] || r->failed || strcmp(workloads[k].name, name) != 0
+                    || strcmp(engineNames[e], engine) != 0)
+                    continue;
+                matched++;
+                snprintf(label, sizeof(label), "%s/%s", name, engine);
+                /* Lexing a few hundred tokens and compiling in well under a millisecond are all overhead. */
+                if (r->tokens >= 100000 && jsonNumber(line, "tokens_per_s", &tokensPerSec))
+                    regressions += compareMetric(label, "tokens/s", tokensPerSec, r->tokensPerSec, 1, threshold, 0);
+                if (jsonNumber(line, "compile_ms", &compileMs))
+                    regressions += compareMetric(label, "compile ms", compileMs, r->compileMs, 0, threshold, 1.0);
+                if (jsonNumber(line, "ns_per_stmt", &nsPerStmt))
+                    regressions += compareMetric(label, "ns/stmt", nsPerStmt, nsPerStatement(r), 0, threshold, 0);
+                if (jsonNumber(line, "peak_rss_kb", &rss))
+                    regressions += compareMetric(label, "peak RSS KB", rss, (double)r->peakRssKb, 0, threshold, 1024);
+            }
+    }
+    fclose(f);
+    printf("%d results compared, %d regressions\n", matched, regressions);
+    return regressions;
+}
+
+int main(int argc, char** argv)
+{
+    static Result results[WORKLOAD_COUNT][ENGINE_COUNT];
+    const char*   jsonPath     = NULL;
+    const char*   baselinePath = NULL;
+    const char*   only         = NULL;
+    double        threshold    = 10.0;
+    int           runs         = 5;
+    int           chosen[WORKLOAD_COUNT];
+    int           failed       = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--json=", 7) == 0)
+            jsonPath = argv[i] + 7;
+        else if (strncmp(argv[i], "--baseline=", 11) == 0)
+            baselinePath = argv[i] + 11;
+        else if (strncmp(argv[i], "--threshold=", 12) == 0)
+            threshold = atof(argv[i] + 12);
+        else if (strncmp(argv[i], "--runs=", 7) == 0)
+            runs = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "--only=", 7) == 0)
+            only = argv[i] + 7;
+        else
+        {
+            fprintf(stderr, "usage: %s [--json=FILE] [--baseline=FILE] [--threshold=PCT] [--runs=N] [--only=WORKLOAD]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (runs < 1)
+        runs = 1;
+
+    for (int k = 0; k < WORKLOAD_COUNT; k++)
+    {
+        chosen[k] = !only || strcmp(only, workloads[k].name) == 0;
+        for (int e = 0; e < ENGINE_COUNT && chosen[k]; e++)
+            if (!runChild(&workloads[k], e, runs, &results[k][e]))
+            {
+                fprintf(stderr, "benchmark: %s on %s failed\n", workloads[k].name, engineNames[e]);
+                failed = 1;
+            }
+    }
+    printTable(results, chosen);
+    if (jsonPath)
+    {
+        FILE* out = fopen(jsonPath, "w");
+        if (!out)
+        {
+            fprintf(stderr, "benchmark: cannot write %s\n", jsonPath);
+            return 1;
+        }
+        writeJson(out, results, chosen);
+        fclose(out);
+        printf("results written to %s\n", jsonPath);
+    }
+    if (baselinePath && compareBaseline(baselinePath, results, chosen, threshold) != 0)
+        return 1;
+    return failed;
+}
@@ -0,0 +1,148 @@
+#include "interpreter.h"
+#include <time.h>
+
+/*
+** Lexer microbenchmark. Generates a large program with indented nested
+** blocks and times tokenize against the byte-at-a-time switch lexer it
+** replaced, reporting MB/s and tokens/s for the best of several runs.
+** usage: lexbench [MEGABYTES] [RUNS]
+*/
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static char* generate(size_t size, size_t* length)
+{
+    static const char* lines[] = {
+        "a = b + c * 2 - d / 3;\n",
+        "< a % 7 + b ^ 2;\n",
+        "[ a - b ? c = c + 1; : c = c - 1; ]\n",
+        "{ n - 9 ? s = s + n; n = n + 1; }\n",
+        "> x;\n",
+    };
+    char*  text = (char*)malloc(size + 256);
+    size_t len  = 0;
+    int    i    = 0;
+
+    if (!text)
+        exit(1);
+    while (len < size)
+    {
+        int indent = 4 * (i % 5);
+        memset(text + len, ' ', (size_t)indent);
+        len += (size_t)indent;
+        size_t n = strlen(lines[i % 5]);
+        memcpy(text + len, lines[i % 5], n);
+        len += n;
+        i++;
+    }
+    text[len++] = '.';
+    *length     = len;
+    return text;
+}
+
+static volatile TokenType lastType;
+
+/* The previous lexer: whitespace through ft_isspace, then a switch per token. */
+static size_t legacyLex(const char* text, size_t length)
+{
+    size_t pos   = 0;
+    size_t count = 0;
+
+    for (;;)
+    {
+        TokenType t;
+        while (pos < length && ft_isspace((unsigned char)text[pos]))
+            pos++;
+        if (pos >= length)
+            break;
+        char c = text[pos++];
+        switch (c)
+        {
+            case '[': t = T_LBRACKET; break;
+            case ']': t = T_RBRACKET; break;
+            case '{': t = T_LBRACE;   break;
+            case '}': t = T_RBRACE;   break;
+            case '(': t = T_LPAREN;   break;
+            case ')': t = T_RPAREN;   break;
+            case '?': t = T_QUESTION; break;
+            case ':': t = T_COLON;    break;
+            case ';': t = T_SEMI;     break;
+            case '.': t = T_DOT;      break;
+            case '+': t = T_PLUS;     break;
+            case '-': t = T_MINUS;    break;
+            case '*': t = T_STAR;     break;
+            case '/': t = T_SLASH;    break;
+            case '%': t = T_MOD;      break;
+            case '^': t = T_CARET;    break;
+            case '=': t = T_ASSIGN;   break;
+            case '<': t = T_LT;       break;
+            case '>': t = T_GT;       break;
+            default:
+                if (ft_isalpha((unsigned char)c) || c == '_')
+                    t = T_ID;
+                else if (ft_isdigit((unsigned char)c))
+                    t = T_NUM;
+                else
+                    t = T_UNKNOWN;
+                while (t != T_UNKNOWN && pos < length
+                    && (ft_isalpha((unsigned char)text[pos]) || ft_isdigit((unsigned char)text[pos]) || text[pos] == '_'))
+                    pos++;
+        }
+        lastType = t;
+        count++;
+    }
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    size_t mb   = argc > 1 ? (size_t)atoi(argv[1]) : 64;
+    int    runs = argc > 2 ? atoi(argv[2]) : 5;
+    size_t length;
+    char*  text = generate(mb << 20, &length);
+    double bestNew = 1e30;
+    double bestOld = 1e30;
+    size_t tokens  = 0;
+
+    for (int r = 0; r < runs; r++)
+    {
+        TokenList list;
+        Arena     arena;
+        arenaInit(&arena);
+        double    t0 = now();
+        tokenize(text, length, &list, &arena);
+        double    t1 = now();
+        tokens = list.count - 1;
+        arenaFree(&arena);
+        double    t2 = now();
+        size_t    oldCount = legacyLex(text, length);
+        double    t3 = now();
+        if (oldCount != tokens)
+        {
+            fprintf(stderr, "lexbench: token counts differ (%zu vs %zu)\n", tokens, oldCount);
+            return 1;
+        }
+        if (t1 - t0 < bestNew)
+            bestNew = t1 - t0;
+        if (t3 - t2 < bestOld)
+            bestOld = t3 - t2;
+    }
+#ifdef LEX_NO_SIMD
+    const char* variant = "scalar";
+#else
+    const char* variant = "simd";
+#endif
+    printf("%zu bytes, %zu tokens, best of %d\n", length, tokens, runs);
+    printf("tokenize (%s): %8.1f MB/s %8.1f Mtok/s\n", variant,
+        (double)length / bestNew / 1e6, (double)tokens / bestNew / 1e6);
+    printf("switch lexer:    %8.1f MB/s %8.1f Mtok/s\n",
+        (double)length / bestOld / 1e6, (double)tokens / bestOld / 1e6);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,272 @@
+#include "interpreter.h"
+#include <pthread.h>
+
+/*
+** Compiled-program cache. Entries are found through a chained hash table
+** keyed by a hash of the source text and the options that shape the
+** compiled code, and confirmed by comparing the text itself. A doubly
+** linked list keeps them in recency order; once the entries' bytes (their
+** compiled size plus the saved text) exceed the limit, the least recently
+** used ones are dropped. Dropping only releases the cache's reference, so
+** a program that is still running stays alive until its runner releases
+** it. Compilation happens outside the lock; when two threads miss on the
+** same program at once, the first one to insert wins and the other
+** discards its copy.
+*/
+
+typedef struct CacheEntry
+{
+    uint64_t           hash;
+    unsigned           key;
+    char*              text;
+    size_t             length;
+    Compiled*          compiled;
+    size_t             bytes;
+    struct CacheEntry* chain;
+    struct CacheEntry* newer;
+    struct CacheEntry* older;
+} CacheEntry;
+
+struct ProgramCache
+{
+    pthread_mutex_t lock;
+    CacheEntry**    buckets;
+    size_t          bucketCount;
+    CacheEntry*     newest;
+    CacheEntry*     oldest;
+    size_t          limit;
+    CacheStats      stats;
+};
+
+/*
+** Eight bytes per step, so hashing a large source costs little next to
+** lexing it. Also the checksum of compiled images.
+*/
+uint64_t hashBytes(const void* data, size_t length)
+{
+    const char* text = (const char*)data;
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ length;
+    uint64_t word;
+    size_t   i = 0;
+
+    for (; i + 8 <= length; i += 8)
+    {
+        memcpy(&word, text + i, 8);
+        h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    word = 0;
+    memcpy(&word, text + i, length - i);
+    h = (h ^ word) * 0xC4CEB9FE1A85EC53ull;
+    return h ^ (h >> 29);
+}
+
+/* The options compileSource looks at; a program compiled differently is another entry. */
+static unsigned optionKey(const InterpOptions* opts)
+{
+    return (unsigned)opts->engine | (unsigned)opts->numMode << 1
+        | (unsigned)(opts->optimize != 0) << 3 | (unsigned)(opts->jit != 0) << 4
+        | (unsigned)(opts->profile != 0) << 5;
+}
+
+ProgramCache* cacheCreate(size_t limitBytes)
+{
+    ProgramCache* cache = (ProgramCache*)malloc(sizeof(ProgramCache));
+
+    if (!cache)
+        return NULL;
+    ft_memset(cache, 0, sizeof(ProgramCache));
+    cache->bucketCount = 64;
+    cache->buckets     = (CacheEntry**)calloc(cache->bucketCount, sizeof(CacheEntry*));
+    if (!cache->buckets)
+    {
+        free(cache);
+        return NULL;
+    }
+    cache->limit = limitBytes;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+static void freeEntry(CacheEntry* e)
+{
+    compiledRelease(e->compiled);
+    free(e->text);
+    free(e);
+}
+
+void cacheDestroy(ProgramCache* cache)
+{
+    if (!cache)
+        return;
+    while (cache->newest)
+    {
+        CacheEntry* e = cache->newest;
+        cache->newest = e->older;
+        freeEntry(e);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+void cacheGetStats(ProgramCache* cache, CacheStats* stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void unlinkRecency(ProgramCache* cache, CacheEntry* e)
+{
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        cache->newest = e->older;
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        cache->oldest = e->newer;
+}
+
+static void pushNewest(ProgramCache* cache, CacheEntry* e)
+{
+    e->newer = NULL;
+    e->older = cache->newest;
+    if (cache->newest)
+        cache->newest->newer = e;
+    else
+        cache->oldest = e;
+    cache->newest = e;
+}
+
+static CacheEntry** bucketOf(ProgramCache* cache, uint64_t hash)
+{
+    return &cache->buckets[hash & (cache->bucketCount - 1)];
+}
+
+static CacheEntry* findEntry(ProgramCache* cache, uint64_t hash, unsigned key,
+    const char* text, size_t length)
+{
+    for (CacheEntry* e = *bucketOf(cache, hash); e; e = e->chain)
+        if (e->hash == hash && e->key == key && e->length == length
+            && memcmp(e->text, text, length) == 0)
+            return e;
+    return NULL;
+}
+
+static void removeEntry(ProgramCache* cache, CacheEntry* e)
+{
+    CacheEntry** link = bucketOf(cache, e->hash);
+
+    while (*link != e)
+        link = &(*link)->chain;
+    *link = e->chain;
+    unlinkRecency(cache, e);
+    cache->stats.entries--;
+    cache->stats.bytes -= e->bytes;
+}
+
+/* Doubles the table once entries outnumber buckets. */
+static void growBuckets(ProgramCache* cache)
+{
+    size_t       count   = cache->bucketCount * 2;
+    CacheEntry** buckets = (CacheEntry**)calloc(count, sizeof(CacheEntry*));
+
+    if (!buckets)
+        return;
+    for (size_t i = 0; i < cache->bucketCount; i++)
+        while (cache->buckets[i])
+        {
+            CacheEntry* e     = cache->buckets[i];
+            cache->buckets[i] = e->chain;
+            e->chain          = buckets[e->hash & (count - 1)];
+            buckets[e->hash & (count - 1)] = e;
+        }
+    free(cache->buckets);
+    cache->buckets     = buckets;
+    cache->bucketCount = count;
+}
+
+/* Evicts from the old end until the cache fits, never dropping keep. */
+static void evict(ProgramCache* cache, const CacheEntry* keep)
+{
+    while (cache->stats.bytes > cache->limit && cache->oldest && cache->oldest != keep)
+    {
+        CacheEntry* e = cache->oldest;
+        removeEntry(cache, e);
+        cache->stats.evictions++;
+        freeEntry(e);
+    }
+}
+
+/*
+** Returns the compiled form of the source, compiling it on a miss. The
+** handle is retained for the caller, who must compiledRelease it. A program
+** that fails to compile is not cached: the result is NULL and err says why.
+*/
+Compiled* cacheCompile(ProgramCache* cache, const char* programText, size_t length, const InterpOptions* opts,
+    Diagnostic* err)
+{
+    uint64_t    hash = hashBytes(programText, length);
+    unsigned    key  = optionKey(opts);
+    CacheEntry* e;
+    Compiled*   c;
+
+    pthread_mutex_lock(&cache->lock);
+    e = findEntry(cache, hash, key, programText, length);
+    if (e)
+    {
+        c = e->compiled;
+        cache->stats.hits++;
+        unlinkRecency(cache, e);
+        pushNewest(cache, e);
+        compiledRetain(c);
+        pthread_mutex_unlock(&cache->lock);
+        return c;
+    }
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    c = compileSource(programText, length, opts, err);
+    if (!c)
+        return NULL;
+    e = (CacheEntry*)malloc(sizeof(CacheEntry));
+    char* text = (char*)malloc(length ? length : 1);
+    if (!e || !text)
+    {
+        free(e);
+        free(text);
+        return c;
+    }
+    memcpy(text, programText, length);
+    ft_memset(e, 0, sizeof(CacheEntry));
+    e->hash     = hash;
+    e->key      = key;
+    e->text     = text;
+    e->length   = length;
+    e->compiled = c;
+    e->bytes    = sizeof(CacheEntry) + length + c->size;
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry* raced = findEntry(cache, hash, key, programText, length);
+    if (raced)
+    {
+        Compiled* shared = raced->compiled;
+        compiledRetain(shared);
+        pthread_mutex_unlock(&cache->lock);
+        freeEntry(e);
+        return shared;
+    }
+    if (cache->stats.entries >= cache->bucketCount)
+        growBuckets(cache);
+    e->chain               = *bucketOf(cache, hash);
+    *bucketOf(cache, hash) = e;
+    pushNewest(cache, e);
+    cache->stats.entries++;
+    cache->stats.bytes += e->bytes;
+    compiledRetain(c);
+    evict(cache, e);
+    pthread_mutex_unlock(&cache->lock);
+    return c;
+}
@@ -0,0 +1,518 @@
+#include "interpreter.h"
+
+static const char* opNames[OP_COUNT] = {
+    [OP_HALT]    = "HALT",
+    [OP_PUSH]    = "PUSH",
+    [OP_LOAD]    = "LOAD",
+    [OP_STORE]   = "STORE",
+    [OP_ADD]     = "ADD",
+    [OP_SUB]     = "SUB",
+    [OP_MUL]     = "MUL",
+    [OP_DIV]     = "DIV",
+    [OP_MOD]     = "MOD",
+    [OP_POW]     = "POW",
+    [OP_ADD64]   = "ADD64",
+    [OP_SUB64]   = "SUB64",
+    [OP_MUL64]   = "MUL64",
+    [OP_DIV64]   = "DIV64",
+    [OP_MOD64]   = "MOD64",
+    [OP_POW64]   = "POW64",
+    [OP_ADDCHK]  = "ADDCHK",
+    [OP_SUBCHK]  = "SUBCHK",
+    [OP_MULCHK]  = "MULCHK",
+    [OP_DIVCHK]  = "DIVCHK",
+    [OP_MODCHK]  = "MODCHK",
+    [OP_POWCHK]  = "POWCHK",
+    [OP_JZ]      = "JZ",
+    [OP_JNZ]     = "JNZ",
+    [OP_JMP]     = "JMP",
+    [OP_PRINT]   = "PRINT",
+    [OP_READ]    = "READ",
+    [OP_LOOP]    = "LOOP",
+    [OP_SUMMARY] = "SUMMARY",
+    [OP_DECLARE] = "DECLARE",
+    [OP_INDEX]   = "INDEX",
+    [OP_INDEXU]  = "INDEXU",
+    [OP_STOREX]  = "STOREX",
+    [OP_STOREXU] = "STOREXU",
+    [OP_LEN]     = "LEN",
+    [OP_SUM]     = "SUM",
+    [OP_MIN]     = "MIN",
+    [OP_MAX]     = "MAX",
+    [OP_ARRAY]   = "ARRAY",
+    [OP_GUARD]   = "GUARD",
+};
+
+static void emit(Bytecode* bc, int word);
+static void emitOp(Bytecode* bc, OpCode op, int stackEffect);
+static int  addConst(Bytecode* bc, Value value);
+static int  addLoop(Bytecode* bc);
+static void patch(Bytecode* bc, int at, int target);
+static void compileBlock(Bytecode* bc, const Node* stmt);
+static void compileStatement(Bytecode* bc, const Node* stmt);
+static void compileExpr(Bytecode* bc, const Node* n);
+
+/*
+** A branch that lands on a JMP goes straight to where that JMP leads, so
+** skipping an untaken [ ] nested at the end of another branch costs one jump
+** instead of one per level. The compiler only emits forward JMPs, so the
+** chains end.
+*/
+static void threadJumps(Bytecode* bc)
+{
+    int* code = bc->code;
+
+    for (int pc = 0; pc < bc->codeLen; pc += 1 + opOperands(code[pc]))
+        if (code[pc] == OP_JMP || code[pc] == OP_JZ || code[pc] == OP_JNZ)
+            while (code[code[pc + 1]] == OP_JMP)
+                code[pc + 1] = code[code[pc + 1] + 1];
+}
+
+/* The arrays and variable names moved into one block, the code first so its chunk can be kept. */
+static void packBytecode(Bytecode* bc, const Program* prog)
+{
+    size_t codeSize  = (sizeof(int) * (size_t)bc->codeLen + 15) & ~(size_t)15;
+    size_t constSize = (sizeof(Value) * (size_t)bc->constCount + 15) & ~(size_t)15;
+    size_t loopSize  = (sizeof(LoopInfo) * (size_t)bc->loopCount + 15) & ~(size_t)15;
+    size_t sumSize   = (sizeof(LoopSummary) * (size_t)prog->summaryCount + 15) & ~(size_t)15;
+    size_t slotSize  = sizeof(char*) * (size_t)prog->slots.count;
+    size_t nameSize  = 0;
+
+    for (int i = 0; i < prog->slots.count; i++)
+        nameSize += strlen(prog->slots.names[i]) + 1;
+
+    char* block = (char*)arenaDetach(bc->arena, bc->code, sizeof(int) * (size_t)bc->codeLen,
+        codeSize + constSize + loopSize + sumSize + slotSize + nameSize);
+    const char** names = (const char**)(block + codeSize + constSize + loopSize + sumSize);
+    char*        text  = block + codeSize + constSize + loopSize + sumSize + slotSize;
+
+    for (int i = 0; i < prog->slots.count; i++)
+    {
+        size_t len = strlen(prog->slots.names[i]) + 1;
+        memcpy(text, prog->slots.names[i], len);
+        names[i] = text;
+        text += len;
+    }
+
+    if (bc->constCount)
+        memcpy(block + codeSize, bc->consts, sizeof(Value) * (size_t)bc->constCount);
+    if (bc->loopCount)
+        memcpy(block + codeSize + constSize, bc->loops, sizeof(LoopInfo) * (size_t)bc->loopCount);
+    if (prog->summaryCount)
+        memcpy(block + codeSize + constSize + loopSize, prog->summaries,
+            sizeof(LoopSummary) * (size_t)prog->summaryCount);
+    bc->storage       = block;
+    bc->code          = (int*)block;
+    bc->consts        = (Value*)(block + codeSize);
+    bc->loops         = (LoopInfo*)(block + codeSize + constSize);
+    bc->summaries     = prog->summaryCount ? (LoopSummary*)(block + codeSize + constSize + loopSize) : NULL;
+    bc->summaryCount  = prog->summaryCount;
+    bc->slots.names   = names;
+    bc->slots.count   = prog->slots.count;
+    bc->slots.cap     = prog->slots.count;
+    bc->codeCap       = bc->codeLen;
+    bc->constCap      = bc->constCount;
+    bc->loopCap       = bc->loopCount;
+    bc->constIndex    = NULL;
+    bc->constIndexCap = 0;
+    bc->arena         = NULL;
+}
+
+void compileProgram(Program* prog, Bytecode* bc)
+{
+    ft_memset(bc, 0, sizeof(Bytecode));
+    bc->mode  = prog->mode;
+    bc->arena = &prog->arena;
+    compileBlock(bc, prog->body);
+    emitOp(bc, OP_HALT, 0);
+    threadJumps(bc);
+    packBytecode(bc, prog);
+}
+
+void freeBytecode(Bytecode* bc)
+{
+    free(bc->storage);
+    ft_memset(bc, 0, sizeof(Bytecode));
+}
+
+/* Operand words following op: ARRAY and GUARD have four, SUMMARY two, the others at most one. */
+int opOperands(int op)
+{
+    if (op == OP_ARRAY || op == OP_GUARD)
+        return 4;
+    if (op == OP_SUMMARY)
+        return 2;
+    return op == OP_PUSH || op == OP_LOAD || op == OP_STORE || op == OP_READ
+        || op == OP_JZ || op == OP_JNZ || op == OP_JMP || op == OP_LOOP
+        || (op >= OP_DECLARE && op <= OP_MAX);
+}
+
+static const char* slotName(const Bytecode* bc, int slot)
+{
+    return slot >= 0 ? bc->slots.names[slot] : "#";
+}
+
+void disassemble(const Bytecode* bc, FILE* out)
+{
+    int pc = 0;
+
+    fprintf(out, "; %d words, %d constants, max stack %d\n",
+        bc->codeLen, bc->constCount, bc->maxStack);
+    while (pc < bc->codeLen)
+    {
+        int op = bc->code[pc];
+        if (op == OP_SUMMARY)
+        {
+            fprintf(out, "%04d  %-6s S%d %04d\n", pc, opNames[op], bc->code[pc + 1], bc->code[pc + 2]);
+            pc += 3;
+            continue;
+        }
+        if (op >= OP_DECLARE)
+        {
+            /* Array instructions name the array; ARRAY and GUARD add their operands. */
+            const int* w = &bc->code[pc + 1];
+            fprintf(out, "%04d  %-7s %s", pc, opNames[op], slotName(bc, w[0]));
+            if (op == OP_ARRAY)
+                fprintf(out, " %d %s %s", w[1], slotName(bc, w[2]), slotName(bc, w[3]));
+            else if (op == OP_GUARD)
+                fprintf(out, " %+d %+d %04d", w[1], w[2], w[3]);
+            fputc('\n', out);
+            pc += 1 + opOperands(op);
+            continue;
+        }
+        if (!opOperands(op))
+        {
+            fprintf(out, "%04d  %s\n", pc, opNames[op]);
+            pc += 1;
+            continue;
+        }
+        int arg = bc->code[pc + 1];
+        fprintf(out, "%04d  %-6s", pc, opNames[op]);
+        if (op == OP_PUSH)
+            fprintf(out, "#%d (%lld)\n", arg, (long long)bc->consts[arg]);
+        else if (op == OP_LOAD || op == OP_STORE || op == OP_READ)
+            fprintf(out, "%s\n", bc->slots.names[arg]);
+        else if (op == OP_LOOP)
+            fprintf(out, "L%d %04d-%04d\n", arg, bc->loops[arg].start, bc->loops[arg].end);
+        else
+            fprintf(out, "%04d\n", arg);
+        pc += 2;
+    }
+}
+
+static void emit(Bytecode* bc, int word)
+{
+    if (bc->codeLen >= bc->codeCap)
+    {
+        int cap     = bc->codeCap ? bc->codeCap * 2 : 64;
+        bc->code    = (int*)arenaGrow(bc->arena, bc->code, sizeof(int) * (size_t)bc->codeCap, sizeof(int) * (size_t)cap);
+        bc->codeCap = cap;
+    }
+    bc->code[bc->codeLen++] = word;
+}
+
+static void emitOp(Bytecode* bc, OpCode op, int stackEffect)
+{
+    emit(bc, op);
+    bc->depth += stackEffect;
+    if (bc->depth > bc->maxStack)
+        bc->maxStack = bc->depth;
+}
+
+static uint32_t hashConst(Value value)
+{
+    return (uint32_t)(((uint64_t)value * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/* Open-addressed table from constant value to pool index, kept at most half full. */
+static void growConstIndex(Bytecode* bc)
+{
+    int  cap   = bc->constIndexCap ? bc->constIndexCap * 2 : 64;
+    int* index = (int*)arenaAlloc(bc->arena, sizeof(int) * (size_t)cap);
+
+    for (int i = 0; i < cap; i++)
+        index[i] = -1;
+    for (int k = 0; k < bc->constCount; k++)
+    {
+        uint32_t at = hashConst(bc->consts[k]) & (uint32_t)(cap - 1);
+        while (index[at] >= 0)
+            at = (at + 1) & (uint32_t)(cap - 1);
+        index[at] = k;
+    }
+    bc->constIndex    = index;
+    bc->constIndexCap = cap;
+}
+
+static int addConst(Bytecode* bc, Value value)
+{
+    if (bc->constCount * 2 >= bc->constIndexCap)
+        growConstIndex(bc);
+
+    uint32_t mask = (uint32_t)(bc->constIndexCap - 1);
+    uint32_t at   = hashConst(value) & mask;
+    while (bc->constIndex[at] >= 0)
+    {
+        if (bc->consts[bc->constIndex[at]] == value)
+            return bc->constIndex[at];
+        at = (at + 1) & mask;
+    }
+    if (bc->constCount >= bc->constCap)
+    {
+        int cap      = bc->constCap ? bc->constCap * 2 : 16;
+        bc->consts   = (Value*)arenaGrow(bc->arena, bc->consts, sizeof(Value) * (size_t)bc->constCap, sizeof(Value) * (size_t)cap);
+        bc->constCap = cap;
+    }
+    bc->consts[bc->constCount] = value;
+    bc->constIndex[at]         = bc->constCount;
+    return bc->constCount++;
+}
+
+static int addLoop(Bytecode* bc)
+{
+    if (bc->loopCount >= bc->loopCap)
+    {
+        int cap     = bc->loopCap ? bc->loopCap * 2 : 8;
+        bc->loops   = (LoopInfo*)arenaGrow(bc->arena, bc->loops, sizeof(LoopInfo) * (size_t)bc->loopCap, sizeof(LoopInfo) * (size_t)cap);
+        bc->loopCap = cap;
+    }
+    return bc->loopCount++;
+}
+
+static void patch(Bytecode* bc, int at, int target)
+{
+    bc->code[at] = target;
+}
+
+static void compileBlock(Bytecode* bc, const Node* stmt)
+{
+    while (stmt)
+    {
+        compileStatement(bc, stmt);
+        stmt = stmt->next;
+    }
+}
+
+static void compileLoop(Bytecode* bc, const Node* stmt)
+{
+    /* Condition at the bottom so each iteration costs one jump. */
+    int toSkip = -1;
+    if (stmt->value >= 0)
+    {
+        emitOp(bc, OP_SUMMARY, 0);
+        emit(bc, stmt->value);
+        toSkip = bc->codeLen;
+        emit(bc, 0);
+    }
+    int loop = addLoop(bc);
+    emitOp(bc, OP_LOOP, 0);
+    emit(bc, loop);
+    bc->loops[loop].start = bc->codeLen;
+    emitOp(bc, OP_JMP, 0);
+    int toCond = bc->codeLen;
+    emit(bc, 0);
+    int bodyStart = bc->codeLen;
+    compileBlock(bc, stmt->right);
+    patch(bc, toCond, bc->codeLen);
+    compileExpr(bc, stmt->left);
+    emitOp(bc, OP_JNZ, -1);
+    emit(bc, bodyStart);
+    bc->loops[loop].end = bc->codeLen;
+    if (toSkip >= 0)
+        patch(bc, toSkip, bc->codeLen);
+}
+
+/* Pushes the base of a guard bound and returns its constant offset. */
+static int compileBound(Bytecode* bc, const Node* n)
+{
+    if (n->kind == N_ADD)
+    {
+        compileExpr(bc, n->left);
+        return (int)n->right->value;
+    }
+    compileExpr(bc, n);
+    return 0;
+}
+
+/*
+** A loop with bounds guards is compiled twice. When every GUARD holds the
+** first copy runs with unchecked indexing; otherwise the GUARDs, whose
+** targets are chained through their operand words until the checked copy
+** is placed, jump to the second.
+*/
+static void compileGuarded(Bytecode* bc, const Node* stmt)
+{
+    int toChecked = -1;
+
+    for (const Node* g = stmt->alt; g; g = g->next)
+    {
+        int lowOffset  = compileBound(bc, g->left);
+        int highOffset = compileBound(bc, g->right);
+        emitOp(bc, OP_GUARD, -2);
+        emit(bc, g->value);
+        emit(bc, lowOffset);
+        emit(bc, highOffset);
+        emit(bc, toChecked);
+        toChecked = bc->codeLen - 1;
+    }
+    bc->unchecked = 1;
+    compileLoop(bc, stmt);
+    bc->unchecked = 0;
+    emitOp(bc, OP_JMP, 0);
+    int toEnd = bc->codeLen;
+    emit(bc, 0);
+    while (toChecked >= 0)
+    {
+        int next = bc->code[toChecked];
+        patch(bc, toChecked, bc->codeLen);
+        toChecked = next;
+    }
+    compileLoop(bc, stmt);
+    patch(bc, toEnd, bc->codeLen);
+}
+
+/* Compiles a whole-array operand: an array gives its slot, a number is pushed and gives -1. */
+static int compileOperand(Bytecode* bc, const Node* n)
+{
+    if (n->kind == N_ARRAY)
+        return (int)n->value;
+    compileExpr(bc, n);
+    return -1;
+}
+
+static void compileArrayAssign(Bytecode* bc, const Node* stmt)
+{
+    const Node* e  = stmt->left;
+    int         op = -1;
+    int         a;
+    int         b  = -1;
+
+    if (isOperator(e) && (e->left->kind == N_ARRAY || e->right->kind == N_ARRAY))
+    {
+        op = e->kind - N_ADD;
+        a  = compileOperand(bc, e->left);
+        b  = compileOperand(bc, e->right);
+    }
+    else
+        a = compileOperand(bc, e);
+    emitOp(bc, OP_ARRAY, -((a < 0) + (op >= 0 && b < 0)));
+    emit(bc, stmt->value);
+    emit(bc, op);
+    emit(bc, a);
+    emit(bc, b);
+}
+
+static void compileStatement(Bytecode* bc, const Node* stmt)
+{
+    switch (stmt->kind)
+    {
+        case N_ASSIGN:
+            compileExpr(bc, stmt->left);
+            emitOp(bc, OP_STORE, -1);
+            emit(bc, stmt->value);
+            break;
+
+        case N_OUTPUT:
+            compileExpr(bc, stmt->left);
+            emitOp(bc, OP_PRINT, -1);
+            break;
+
+        case N_INPUT:
+            emitOp(bc, OP_READ, 0);
+            emit(bc, stmt->value);
+            break;
+
+        case N_IF:
+        {
+            compileExpr(bc, stmt->left);
+            emitOp(bc, OP_JZ, -1);
+            int toElse = bc->codeLen;
+            emit(bc, 0);
+            compileBlock(bc, stmt->right);
+            if (stmt->alt)
+            {
+                emitOp(bc, OP_JMP, 0);
+                int toEnd = bc->codeLen;
+                emit(bc, 0);
+                patch(bc, toElse, bc->codeLen);
+                compileBlock(bc, stmt->alt);
+                patch(bc, toEnd, bc->codeLen);
+            }
+            else
+                patch(bc, toElse, bc->codeLen);
+        }
+        break;
+
+        case N_WHILE:
+            if (stmt->alt)
+                compileGuarded(bc, stmt);
+            else
+                compileLoop(bc, stmt);
+            break;
+
+        case N_DECLARE:
+            compileExpr(bc, stmt->left);
+            emitOp(bc, OP_DECLARE, -1);
+            emit(bc, stmt->value);
+            break;
+
+        case N_STORE:
+            compileExpr(bc, stmt->right);
+            compileExpr(bc, stmt->left);
+            emitOp(bc, bc->unchecked ? OP_STOREXU : OP_STOREX, -2);
+            emit(bc, stmt->value);
+            break;
+
+        case N_ARRAY_ASSIGN:
+            compileArrayAssign(bc, stmt);
+            break;
+
+        default:
+            reportError(ERR_INTERNAL, "Unexpected node in compileStatement");
+    }
+}
+
+static void compileExpr(Bytecode* bc, const Node* n)
+{
+    switch (n->kind)
+    {
+        case N_NUM:
+            emitOp(bc, OP_PUSH, 1);
+            emit(bc, addConst(bc, n->value));
+            return;
+
+        case N_VAR:
+            emitOp(bc, OP_LOAD, 1);
+            emit(bc, n->value);
+            return;
+
+        case N_INDEX:
+            compileExpr(bc, n->left);
+            emitOp(bc, bc->unchecked ? OP_INDEXU : OP_INDEX, 0);
+            emit(bc, n->value);
+            return;
+
+        case N_LEN: case N_SUM: case N_MIN: case N_MAX:
+            emitOp(bc, (OpCode)(OP_LEN + (n->kind - N_LEN)), 1);
+            emit(bc, n->value);
+            return;
+
+        case N_ADD: case N_SUB: case N_MUL:
+        case N_DIV: case N_MOD: case N_POW:
+        {
+            Spine s;
+
+            spineCollect(&s, n);
+            compileExpr(bc, s.leaf);
+            for (int i = s.count - 1; i >= 0; i--)
+            {
+                compileExpr(bc, s.ops[i]->right);
+                emitOp(bc, (OpCode)(OP_ADD + bc->mode * ARITH_OPS + (s.ops[i]->kind - N_ADD)), -1);
+            }
+            spineFree(&s);
+            return;
+        }
+
+        default:
+            reportError(ERR_INTERNAL, "Unexpected node in compileExpr");
+    }
+}
@@ -0,0 +1,254 @@
+#include "array.h"
+#include "numeric.h"
+
+/* unchecked is set while a loop whose bounds guards held runs its body. */
+typedef struct
+{
+    Interp*        interp;
+    const Program* program;
+    Profile*       profile;
+    Value*         variables;
+    ArrayTable     arrays;
+    int            unchecked;
+} Evaluator;
+
+static void  execBlock(Evaluator* ev, const Node* stmt);
+static void  execStatement(Evaluator* ev, const Node* stmt);
+static Value evalExpr(Evaluator* ev, const Node* n);
+static Value evalChain(Evaluator* ev, const Node* n);
+
+/* The profile covers whatever ran, also when an error ends the program. */
+static void finishProfile(void* prof)
+{
+    profileReport((Profile*)prof, stderr);
+    profileFree((Profile*)prof);
+}
+
+static void runProfiled(Evaluator* ev)
+{
+    ev->profile = profileCreate(ev->program);
+    pushCleanup(finishProfile, ev->profile);
+    execBlock(ev, ev->program->body);
+    outputFlush(ev->interp);
+    popCleanup();
+    finishProfile(ev->profile);
+}
+
+/* A program parsed for --profile keeps its source; only then are statements timed. */
+void execProgram(Interp* interp, const Program* prog)
+{
+    Evaluator ev;
+
+    ft_memset(&ev, 0, sizeof(ev));
+    ev.interp    = interp;
+    ev.program   = prog;
+    ev.variables = (Value*)calloc((size_t)prog->slots.count + 1, sizeof(Value));
+    if (!ev.variables)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    pushCleanup(free, ev.variables);
+    arraysInit(&ev.arrays, prog->slots.count);
+    pushCleanup(arraysFree, &ev.arrays);
+    if (prog->source)
+        runProfiled(&ev);
+    else
+        execBlock(&ev, prog->body);
+    popCleanup();
+    arraysFree(&ev.arrays);
+    popCleanup();
+    free(ev.variables);
+}
+
+static void execProfiled(Evaluator* ev, const Node* stmt)
+{
+    while (stmt)
+    {
+        int      site  = profileSite(ev->profile, stmt);
+        uint64_t start = profileTicks();
+        execStatement(ev, stmt);
+        profileCount(ev->profile, site, profileTicks() - start);
+        stmt = stmt->next;
+    }
+}
+
+static void execBlock(Evaluator* ev, const Node* stmt)
+{
+    if (ev->profile)
+    {
+        execProfiled(ev, stmt);
+        return;
+    }
+    while (stmt)
+    {
+        execStatement(ev, stmt);
+        stmt = stmt->next;
+    }
+}
+
+/* A guard bound is a variable, constant or length, plus an optional constant. */
+static Value guardBound(Evaluator* ev, const Node* n, int* offset)
+{
+    *offset = 0;
+    if (n->kind == N_ADD)
+    {
+        *offset = n->right->value;
+        n       = n->left;
+    }
+    return evalExpr(ev, n);
+}
+
+static int guardsHold(Evaluator* ev, const Node* guard)
+{
+    for (; guard; guard = guard->next)
+    {
+        int   lowOffset;
+        int   highOffset;
+        Value low  = guardBound(ev, guard->left, &lowOffset);
+        Value high = guardBound(ev, guard->right, &highOffset);
+        if (!arrayCovers(&ev->arrays, guard->value, low, lowOffset, high, highOffset))
+            return 0;
+    }
+    return 1;
+}
+
+/* The operands of an array assignment: a slot, or -1 with the number in *value. */
+static int arrayOperand(Evaluator* ev, const Node* n, Value* value)
+{
+    *value = 0;
+    if (n->kind == N_ARRAY)
+        return n->value;
+    *value = evalExpr(ev, n);
+    return -1;
+}
+
+static void execArrayAssign(Evaluator* ev, const Node* stmt)
+{
+    const Node* e = stmt->left;
+    Value       x;
+    Value       y;
+
+    if (isOperator(e) && (e->left->kind == N_ARRAY || e->right->kind == N_ARRAY))
+    {
+        int a = arrayOperand(ev, e->left, &x);
+        int b = arrayOperand(ev, e->right, &y);
+        arrayApply(&ev->arrays, ev->program->mode, stmt->value, e->kind - N_ADD, a, x, b, y);
+    }
+    else
+    {
+        int a = arrayOperand(ev, e, &x);
+        arrayApply(&ev->arrays, ev->program->mode, stmt->value, -1, a, x, -1, 0);
+    }
+}
+
+static void execStatement(Evaluator* ev, const Node* stmt)
+{
+    switch (stmt->kind)
+    {
+        case N_ASSIGN:
+            ev->variables[stmt->value] = evalExpr(ev, stmt->left);
+            break;
+
+        case N_OUTPUT:
+            printValue(ev->interp, evalExpr(ev, stmt->left));
+            break;
+
+        case N_INPUT:
+            ev->variables[stmt->value] = readValue(ev->interp, stmt->value, ev->program->mode);
+            break;
+
+        case N_IF:
+            if (evalExpr(ev, stmt->left) != 0)
+                execBlock(ev, stmt->right);
+            else
+                execBlock(ev, stmt->alt);
+            break;
+
+        case N_WHILE:
+        {
+            uint64_t iterations = 0;
+            if (stmt->value >= 0 && applySummary(&ev->program->summaries[stmt->value], ev->variables))
+                break;
+            ev->unchecked = stmt->alt && guardsHold(ev, stmt->alt);
+            for (; evalExpr(ev, stmt->left) != 0; iterations++)
+                execBlock(ev, stmt->right);
+            ev->unchecked = 0;
+            if (ev->profile)
+                profileLoop(ev->profile, stmt, iterations);
+        }
+        break;
+
+        case N_DECLARE:
+            arrayDeclare(&ev->arrays, stmt->value, evalExpr(ev, stmt->left));
+            break;
+
+        case N_STORE:
+        {
+            Value index = evalExpr(ev, stmt->right);
+            Value value = evalExpr(ev, stmt->left);
+            if (ev->unchecked)
+                ev->arrays.items[stmt->value].data[index] = value;
+            else
+                *arrayElement(&ev->arrays, stmt->value, index) = value;
+        }
+        break;
+
+        case N_ARRAY_ASSIGN:
+            execArrayAssign(ev, stmt);
+            break;
+
+        default:
+            reportError(ERR_INTERNAL, "Unexpected node in execStatement");
+    }
+}
+
+/* A left-deep chain such as a+b+c, bottom operator first. */
+static Value evalChain(Evaluator* ev, const Node* n)
+{
+    Spine s;
+
+    spineCollect(&s, n);
+    Value acc = evalExpr(ev, s.leaf);
+    for (int i = s.count - 1; i >= 0; i--)
+        acc = numEval(ev->program->mode, s.ops[i]->kind - N_ADD, acc, evalExpr(ev, s.ops[i]->right));
+    spineFree(&s);
+    return acc;
+}
+
+static Value evalExpr(Evaluator* ev, const Node* n)
+{
+    switch (n->kind)
+    {
+        case N_NUM:
+            return n->value;
+
+        case N_VAR:
+            return ev->variables[n->value];
+
+        case N_INDEX:
+        {
+            Value index = evalExpr(ev, n->left);
+            if (ev->unchecked)
+                return ev->arrays.items[n->value].data[index];
+            return *arrayElement(&ev->arrays, n->value, index);
+        }
+
+        case N_LEN:
+            return (Value)ev->arrays.items[n->value].length;
+
+        case N_SUM: case N_MIN: case N_MAX:
+            return arrayReduce(&ev->arrays, ev->program->mode, n->kind, n->value);
+
+        case N_ADD: case N_SUB: case N_MUL:
+        case N_DIV: case N_MOD: case N_POW:
+        {
+            if (isOperator(n->left))
+                return evalChain(ev, n);
+            Value left  = evalExpr(ev, n->left);
+            Value right = evalExpr(ev, n->right);
+            return numEval(ev->program->mode, n->kind - N_ADD, left, right);
+        }
+
+        default:
+            reportError(ERR_INTERNAL, "Unexpected node in evalExpr");
+    }
+    return 0;
+}
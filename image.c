@@ -0,0 +1,348 @@
+#include "interpreter.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+** Compiled program images. A file holds a fixed header followed by 8-byte
+** aligned sections: the instruction stream, the constant pool, the loop
+** table, the loop summaries and the slot map (one NUL-terminated variable
+** name per slot). Sections are addressed by offsets from the start of the
+** file, so a mapped image is used in place wherever it lands. The header
+** records the format version, byte order and record sizes, and a checksum
+** over everything after it. Before anything runs, the code is verified:
+** opcodes and operands in range, jumps landing on instruction boundaries
+** at statement level, and the stack staying within maxStack. That keeps a
+** damaged or hand-made file from driving the VM or the JIT out of bounds.
+** A file cannot prove that a GUARD protects the loop after it, so images
+** are written with checked indexing and the unchecked forms are rejected.
+*/
+
+#define IMAGE_MAGIC      "MINIBC\r\n"
+#define IMAGE_VERSION    1
+#define IMAGE_BYTE_ORDER 0x01020304u
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t valueBytes;
+    uint32_t summaryBytes;
+    uint32_t mode;
+    uint32_t maxStack;
+    uint32_t codeLen;
+    uint32_t constCount;
+    uint32_t loopCount;
+    uint32_t summaryCount;
+    uint32_t slotCount;
+    uint32_t slotBytes;
+    uint64_t codeAt;
+    uint64_t constsAt;
+    uint64_t loopsAt;
+    uint64_t summariesAt;
+    uint64_t slotsAt;
+    uint64_t length;
+    uint64_t checksum;
+} ImageHeader;
+
+static uint64_t align8(uint64_t at)
+{
+    return (at + 7) & ~(uint64_t)7;
+}
+
+int isCompiledImage(const char* data, size_t length)
+{
+    return length >= 8 && memcmp(data, IMAGE_MAGIC, 8) == 0;
+}
+
+/* Writes the bytecode of c, which must have been compiled for the VM. */
+int writeCompiled(const Compiled* c, const char* path)
+{
+    const Bytecode* bc = &c->bc;
+    ImageHeader     h;
+    char*           image;
+    int*            code;
+    uint64_t        slotBytes = 0;
+    int             ok;
+
+    for (int i = 0; i < bc->slots.count; i++)
+        slotBytes += strlen(bc->slots.names[i]) + 1;
+
+    ft_memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, 8);
+    h.version      = IMAGE_VERSION;
+    h.byteOrder    = IMAGE_BYTE_ORDER;
+    h.valueBytes   = sizeof(Value);
+    h.summaryBytes = sizeof(LoopSummary);
+    h.mode         = (uint32_t)bc->mode;
+    h.maxStack     = (uint32_t)bc->maxStack;
+    h.codeLen      = (uint32_t)bc->codeLen;
+    h.constCount   = (uint32_t)bc->constCount;
+    h.loopCount    = (uint32_t)bc->loopCount;
+    h.summaryCount = (uint32_t)bc->summaryCount;
+    h.slotCount    = (uint32_t)bc->slots.count;
+    h.slotBytes    = (uint32_t)slotBytes;
+    h.codeAt       = align8(sizeof(ImageHeader));
+    h.constsAt     = align8(h.codeAt + sizeof(int) * (uint64_t)h.codeLen);
+    h.loopsAt      = align8(h.constsAt + sizeof(Value) * (uint64_t)h.constCount);
+    h.summariesAt  = align8(h.loopsAt + sizeof(LoopInfo) * (uint64_t)h.loopCount);
+    h.slotsAt      = align8(h.summariesAt + sizeof(LoopSummary) * (uint64_t)h.summaryCount);
+    h.length       = h.slotsAt + h.slotBytes;
+
+    image = (char*)calloc(1, (size_t)h.length);
+    if (!image)
+        return 0;
+    memcpy(image + h.codeAt, bc->code, sizeof(int) * (size_t)h.codeLen);
+    code = (int*)(image + h.codeAt);
+    for (int pc = 0; pc < bc->codeLen; pc += 1 + opOperands(code[pc]))
+        if (code[pc] == OP_INDEXU || code[pc] == OP_STOREXU)
+            code[pc] = code[pc] == OP_INDEXU ? OP_INDEX : OP_STOREX;
+    if (h.constCount)
+        memcpy(image + h.constsAt, bc->consts, sizeof(Value) * (size_t)h.constCount);
+    if (h.loopCount)
+        memcpy(image + h.loopsAt, bc->loops, sizeof(LoopInfo) * (size_t)h.loopCount);
+    if (h.summaryCount)
+        memcpy(image + h.summariesAt, bc->summaries, sizeof(LoopSummary) * (size_t)h.summaryCount);
+    for (uint64_t i = 0, at = h.slotsAt; i < h.slotCount; i++)
+    {
+        size_t len = strlen(bc->slots.names[i]) + 1;
+        memcpy(image + at, bc->slots.names[i], len);
+        at += len;
+    }
+    h.checksum = hashBytes(image + sizeof(ImageHeader), (size_t)h.length - sizeof(ImageHeader));
+    memcpy(image, &h, sizeof(h));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok     = fd >= 0;
+    for (size_t done = 0; ok && done < h.length;)
+    {
+        ssize_t n = write(fd, image + done, (size_t)h.length - done);
+        ok        = n > 0;
+        done += ok ? (size_t)n : 0;
+    }
+    if (fd >= 0 && close(fd) != 0)
+        ok = 0;
+    free(image);
+    return ok;
+}
+
+static int validSlot(const Bytecode* bc, int slot, int allowNone)
+{
+    return (allowNone && slot == -1) || (slot >= 0 && slot < bc->slots.count);
+}
+
+static int verifySummaries(const Bytecode* bc)
+{
+    for (int i = 0; i < bc->summaryCount; i++)
+    {
+        const LoopSummary* s = &bc->summaries[i];
+        if (!validSlot(bc, s->ind, 0) || !validSlot(bc, s->cond.var, 1)
+            || s->count < 0 || s->count > SUMMARY_MAX_VARS)
+            return 0;
+        for (int n = 0; n < s->count; n++)
+            if (!validSlot(bc, s->entries[n].slot, 0) || !validSlot(bc, s->entries[n].f.var, 1)
+                || s->entries[n].kind < SUM_ACCUM || s->entries[n].kind > SUM_LAST)
+                return 0;
+    }
+    return 1;
+}
+
+/* A jump target must start an instruction at statement level (empty stack). */
+static int validTarget(const int* depthAt, int codeLen, int target)
+{
+    return target >= 0 && target < codeLen && depthAt[target] == 0;
+}
+
+/*
+** The compiler only jumps between statements, where the stack is empty, so
+** one linear pass gives every instruction its stack depth.
+*/
+static int verifyCode(const Bytecode* bc)
+{
+    const int* code    = bc->code;
+    int*       depthAt = (int*)malloc(sizeof(int) * ((size_t)bc->codeLen + 1));
+    int        depth   = 0;
+    int        pc      = 0;
+    int        lastOp  = -1;
+    int        ok      = 1;
+
+    if (!depthAt)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    if (bc->codeLen == 0)
+    {
+        free(depthAt);
+        return 0;
+    }
+    for (int i = 0; i <= bc->codeLen; i++)
+        depthAt[i] = -1;
+    while (ok && pc < bc->codeLen)
+    {
+        int op   = code[pc];
+        int pops = 0;
+        int push = 0;
+
+        depthAt[pc] = depth;
+        if (op < 0 || op >= OP_COUNT || pc + opOperands(op) >= bc->codeLen)
+        {
+            ok = 0;
+            break;
+        }
+        if (op == OP_PUSH)
+            ok = code[pc + 1] >= 0 && code[pc + 1] < bc->constCount;
+        else if (op == OP_LOAD || op == OP_STORE || op == OP_READ)
+            ok = validSlot(bc, code[pc + 1], 0);
+        else if (op == OP_LOOP)
+            ok = code[pc + 1] >= 0 && code[pc + 1] < bc->loopCount;
+        else if (op == OP_SUMMARY)
+            ok = code[pc + 1] >= 0 && code[pc + 1] < bc->summaryCount;
+        else if (op == OP_INDEXU || op == OP_STOREXU)
+            ok = 0;
+        else if (op >= OP_DECLARE && op <= OP_MAX)
+            ok = validSlot(bc, code[pc + 1], 0);
+        else if (op == OP_ARRAY)
+        {
+            ok   = validSlot(bc, code[pc + 1], 0) && code[pc + 2] >= -1 && code[pc + 2] <= 4
+                && validSlot(bc, code[pc + 3], 1) && validSlot(bc, code[pc + 4], 1)
+                && (code[pc + 2] >= 0 || code[pc + 4] == -1);
+            pops = (code[pc + 3] == -1) + (code[pc + 2] >= 0 && code[pc + 4] == -1);
+        }
+        else if (op == OP_GUARD)
+        {
+            ok   = validSlot(bc, code[pc + 1], 1);
+            pops = 2;
+        }
+        if (op == OP_PUSH || op == OP_LOAD || op == OP_LEN || op == OP_SUM || op == OP_MIN || op == OP_MAX)
+            push = 1;
+        else if (op == OP_STORE || op == OP_PRINT || op == OP_JZ || op == OP_JNZ || op == OP_DECLARE)
+            pops = 1;
+        else if (op == OP_INDEX)
+        {
+            pops = 1;
+            push = 1;
+        }
+        else if (op == OP_STOREX)
+            pops = 2;
+        else if (op >= OP_ADD && op <= OP_POWCHK)
+        {
+            pops = 2;
+            push = 1;
+        }
+        if (depth < pops || depth - pops + push > bc->maxStack)
+            ok = 0;
+        depth += push - pops;
+        if ((op == OP_JZ || op == OP_JNZ || op == OP_JMP || op == OP_SUMMARY || op == OP_HALT || op == OP_GUARD)
+            && depth != 0)
+            ok = 0;
+        lastOp = op;
+        pc += 1 + opOperands(op);
+    }
+    if (ok)
+        ok = pc == bc->codeLen && lastOp == OP_HALT;
+
+    /* Now that every depth is known, check where jumps and loops lead. */
+    for (pc = 0; ok && pc < bc->codeLen; pc += 1 + opOperands(code[pc]))
+    {
+        int op = code[pc];
+        if (op == OP_JZ || op == OP_JNZ || op == OP_JMP)
+            ok = validTarget(depthAt, bc->codeLen, code[pc + 1]);
+        else if (op == OP_SUMMARY)
+            ok = validTarget(depthAt, bc->codeLen, code[pc + 2]);
+        else if (op == OP_GUARD)
+            ok = validTarget(depthAt, bc->codeLen, code[pc + 4]);
+    }
+    for (int i = 0; ok && i < bc->loopCount; i++)
+        ok = bc->loops[i].start < bc->loops[i].end
+            && validTarget(depthAt, bc->codeLen, bc->loops[i].start)
+            && validTarget(depthAt, bc->codeLen, bc->loops[i].end);
+    free(depthAt);
+    return ok && verifySummaries(bc);
+}
+
+/* Points names at each of the count NUL-terminated names that make up the slot map. */
+static int loadSlotNames(Bytecode* bc, const char* map, uint32_t count, uint32_t bytes)
+{
+    uint32_t at = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const char* end = (const char*)memchr(map + at, '\0', bytes - at);
+        if (!end || end == map + at)
+            return 0;
+        bc->slots.names[i] = map + at;
+        at = (uint32_t)(end - map) + 1;
+    }
+    bc->slots.count = (int)count;
+    bc->slots.cap   = (int)count;
+    return at == bytes;
+}
+
+static int sectionFits(const ImageHeader* h, uint64_t at, uint64_t count, uint64_t size)
+{
+    return at % 8 == 0 && at >= sizeof(ImageHeader) && at <= h->length
+        && count <= (h->length - at) / size;
+}
+
+/*
+** Wraps a mapped or loaded image in a Compiled handle without copying it;
+** data must stay valid until the handle is released. Malformed images stop
+** with a diagnostic.
+*/
+Compiled* loadCompiled(const char* data, size_t length, const InterpOptions* opts)
+{
+    ImageHeader h;
+    Compiled*   c;
+
+    if (length < sizeof(ImageHeader) || !isCompiledImage(data, length))
+        reportError(ERR_BAD_IMAGE, "Not a compiled program");
+    memcpy(&h, data, sizeof(h));
+    if (h.version != IMAGE_VERSION || h.byteOrder != IMAGE_BYTE_ORDER
+        || h.valueBytes != sizeof(Value) || h.summaryBytes != sizeof(LoopSummary))
+        reportError(ERR_BAD_IMAGE, "Unsupported compiled program version");
+    if (((uintptr_t)data & 7) != 0)
+        reportError(ERR_BAD_IMAGE, "Misaligned compiled program");
+    if (h.length != length || h.mode > NUM_CHECKED || h.maxStack > h.codeLen
+        || h.slotCount > MAX_VARIABLES || h.slotBytes > length
+        || !sectionFits(&h, h.codeAt, h.codeLen, sizeof(int))
+        || !sectionFits(&h, h.constsAt, h.constCount, sizeof(Value))
+        || !sectionFits(&h, h.loopsAt, h.loopCount, sizeof(LoopInfo))
+        || !sectionFits(&h, h.summariesAt, h.summaryCount, sizeof(LoopSummary))
+        || !sectionFits(&h, h.slotsAt, h.slotBytes, 1)
+        || hashBytes(data + sizeof(ImageHeader), length - sizeof(ImageHeader)) != h.checksum)
+        reportError(ERR_BAD_IMAGE, "Corrupt compiled program");
+
+    c = (Compiled*)malloc(sizeof(Compiled) + sizeof(char*) * h.slotCount);
+    if (!c)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    ft_memset(c, 0, sizeof(Compiled));
+    c->bc.slots.names = (const char**)(c + 1);
+    if (!loadSlotNames(&c->bc, data + h.slotsAt, h.slotCount, h.slotBytes))
+    {
+        free(c);
+        reportError(ERR_BAD_IMAGE, "Corrupt compiled program");
+    }
+    c->refs            = 1;
+    c->borrowed        = 1;
+    c->engine          = ENGINE_VM;
+    c->mode            = (NumMode)h.mode;
+    c->optimize        = 1;
+    c->jit             = opts->jit;
+    c->bc.mode         = (NumMode)h.mode;
+    c->bc.maxStack     = (int)h.maxStack;
+    c->bc.code         = (int*)(data + h.codeAt);
+    c->bc.codeLen      = (int)h.codeLen;
+    c->bc.consts       = (Value*)(data + h.constsAt);
+    c->bc.constCount   = (int)h.constCount;
+    c->bc.loops        = (LoopInfo*)(data + h.loopsAt);
+    c->bc.loopCount    = (int)h.loopCount;
+    c->bc.summaries    = (LoopSummary*)(data + h.summariesAt);
+    c->bc.summaryCount = (int)h.summaryCount;
+    if (!verifyCode(&c->bc))
+    {
+        free(c);
+        reportError(ERR_BAD_IMAGE, "Corrupt compiled program");
+    }
+    if (c->jit)
+        jitCompile(&c->bc, &c->native);
+    c->size = sizeof(Compiled) + sizeof(char*) * h.slotCount + c->native.size;
+    return c;
+}
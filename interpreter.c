@@ -1,783 +1,479 @@
 #include "interpreter.h"
 
-static const char* inputText;
-static int         position;
-static Token       currentToken;
-static int         variables[26];
-static int         executeFlag = 1;
-
-void interpret(const char* programText);
-
-static Token getToken(void);
-static void  getNextToken(void);
-static void  reportError(const char* msg);
-
-static void parseP(void);
-static void parseC(void);
-static void parseIf(void);
-static void parseWhile(void);
-static void parseAssignment(void);
-static void parseOutput(void);
-static void parseInput(void);
-
-static int  parseExpr(void);
-static int  parseTerm(void);
-static int  parsePower(void);
-static int  parseFactor(void);
-
-static int miniParseE(MiniLexer* ml);
-static int miniParseT(MiniLexer* ml);
-static int miniParseU(MiniLexer* ml);
-static int miniParseF(MiniLexer* ml);
-
-static void   blockParse(BlockParser* bp);
-static void   blockStatement(BlockParser* bp);
-static void   blockIf(BlockParser* bp);
-static int    blockExpr(BlockParser* bp);
-static int    blockTerm(BlockParser* bp);
-static int    blockPower(BlockParser* bp);
-static int    blockFactor(BlockParser* bp);
-static Token  blockNextToken(BlockParser* bp);
-static Token  blockPeekToken(BlockParser* bp);
-static void   blockError(const char* msg);
-
-static void initTokenBuffer(TokenBuffer* buf);
-static void freeTokenBuffer(TokenBuffer* buf);
-static void pushToken(TokenBuffer* buf, Token tk);
-
-void interpret(const char* programText)
-{
-    inputText  = programText;
-    position   = 0;
-    ft_memset(variables, 0, sizeof(variables));
-    getNextToken();
-    parseP();
-}
-
-static Token getToken(void)
-{
-    Token t;
-    while (inputText[position] && ft_isspace((unsigned char)inputText[position]))
-        position++;
-
-    if (!inputText[position])
-    {
-        t.type = T_END;
-        t.ch   = 0;
-        return t;
-    }
-
-    char c = inputText[position++];
-    switch (c)
-    {
-        case '[': t.type = T_LBRACKET; t.ch = c; return t;
-        case ']': t.type = T_RBRACKET; t.ch = c; return t;
-        case '{': t.type = T_LBRACE;   t.ch = c; return t;
-        case '}': t.type = T_RBRACE;   t.ch = c; return t;
-        case '(': t.type = T_LPAREN;   t.ch = c; return t;
-        case ')': t.type = T_RPAREN;   t.ch = c; return t;
-        case '?': t.type = T_QUESTION; t.ch = c; return t;
-        case ':': t.type = T_COLON;    t.ch = c; return t;
-        case ';': t.type = T_SEMI;     t.ch = c; return t;
-        case '.': t.type = T_DOT;      t.ch = c; return t;
-        case '+': t.type = T_PLUS;     t.ch = c; return t;
-        case '-': t.type = T_MINUS;    t.ch = c; return t;
-        case '*': t.type = T_STAR;     t.ch = c; return t;
-        case '/': t.type = T_SLASH;    t.ch = c; return t;
-        case '%': t.type = T_MOD;      t.ch = c; return t;
-        case '^': t.type = T_CARET;    t.ch = c; return t;
-        case '=': t.type = T_ASSIGN;   t.ch = c; return t;
-        case '<': t.type = T_LT;       t.ch = c; return t;
-        case '>': t.type = T_GT;       t.ch = c; return t;
-        default:
-            if (ft_isalpha((unsigned char)c))
-            {
-                t.type = T_ID;
-                t.ch   = c;
-            }
-            else if (ft_isdigit((unsigned char)c))
-            {
-                t.type = T_NUM;
-                t.ch   = c;
-            }
-            else
-            {
-                t.type = T_UNKNOWN;
-                t.ch   = c;
-            }
-            return t;
+void initOptions(InterpOptions* opts)
+{
+    opts->engine        = ENGINE_VM;
+    opts->disassemble   = 0;
+    opts->jit           = 0;
+    opts->optimize      = 1;
+    opts->optStats      = 0;
+    opts->profile       = 0;
+    opts->perfStats     = 0;
+    opts->numMode       = NUM_INT32;
+    opts->outFlush      = OUT_FLUSH_AUTO;
+    opts->captureOutput = 0;
+    opts->compileOut    = NULL;
+    opts->emitOut       = NULL;
+    ft_memset(&opts->input, 0, sizeof(InputSource));
+    opts->input.kind   = INPUT_FD;
+    opts->input.fd     = 0;
+    opts->input.prompt = 1;
+    opts->input.onEof  = EOF_ERROR;
+}
+
+/*
+** The instance running on this thread, so that an error with no trap armed
+** can flush its pending output before the message.
+*/
+static _Thread_local Interp* activeInterp;
+
+/*
+** Cleanups pending on this thread, oldest first. The first CLEANUP_INLINE
+** live in thread-local storage, so a run pushes and pops them without
+** allocating; deeper stacks move to the heap until the outermost trap pops.
+*/
+#define CLEANUP_INLINE 32
+
+typedef struct
+{
+    void (*fn)(void*);
+    void* arg;
+} Cleanup;
+
+static _Thread_local ErrorTrap* activeTrap;
+static _Thread_local Cleanup    cleanupLocal[CLEANUP_INLINE];
+static _Thread_local Cleanup*   cleanups;
+static _Thread_local size_t     cleanupCount;
+static _Thread_local size_t     cleanupCap;
+
+void trapPush(ErrorTrap* trap)
+{
+    ft_memset(&trap->diag, 0, sizeof(Diagnostic));
+    trap->cleanupMark = cleanupCount;
+    trap->outer       = activeTrap;
+    activeTrap        = trap;
+}
+
+void trapPop(ErrorTrap* trap)
+{
+    activeTrap   = trap->outer;
+    cleanupCount = trap->cleanupMark;
+    if (!activeTrap && cleanups && cleanups != cleanupLocal)
+    {
+        free(cleanups);
+        cleanups   = NULL;
+        cleanupCap = 0;
+    }
+}
+
+/*
+** Registers fn(arg) to run if an error unwinds before the matching
+** popCleanup. Without a trap an error ends the process, so nothing is kept.
+*/
+void pushCleanup(void (*fn)(void*), void* arg)
+{
+    if (!activeTrap)
+        return;
+    if (cleanupCount == cleanupCap)
+    {
+        size_t   cap   = cleanupCap ? cleanupCap * 2 : CLEANUP_INLINE;
+        Cleanup* grown = cleanupCap ? (Cleanup*)malloc(sizeof(Cleanup) * cap) : cleanupLocal;
+        if (!grown)
+        {
+            fn(arg);
+            reportError(ERR_NO_MEMORY, "Out of memory");
+        }
+        if (cleanupCount)
+            memcpy(grown, cleanups, sizeof(Cleanup) * cleanupCount);
+        if (cleanups && cleanups != cleanupLocal)
+            free(cleanups);
+        cleanups   = grown;
+        cleanupCap = cap;
     }
-}
-static void getNextToken(void)
-{
-    currentToken = getToken();
+    cleanups[cleanupCount].fn  = fn;
+    cleanups[cleanupCount].arg = arg;
+    cleanupCount++;
 }
 
-static void reportError(const char* msg)
+void popCleanup(void)
 {
-    fprintf(stderr, "Parser Error: %s\n", msg);
-    exit(1);
+    if (activeTrap)
+        cleanupCount--;
 }
 
-static void parseP(void)
+void printDiagnostic(const Diagnostic* diag, FILE* out)
 {
-    while (currentToken.type != T_DOT)
-    {
-        if (currentToken.type == T_END)
-            reportError("Expected '.' before end of program");
-        parseC();
-    }
-    getNextToken();
-    printf("Program successfully parsed.\n");
-    fflush(stdout);
-}
-
-static void parseC(void)
-{
-    switch (currentToken.type)
-    {
-        case T_LBRACKET:
-            getNextToken();
-            parseIf();
-            break;
-
-        case T_LBRACE:
-            getNextToken();
-            parseWhile();
-            break;
-
-        case T_ID:
-            parseAssignment();
-            break;
-
-        case T_LT:
-            getNextToken();
-            parseOutput();
-            break;
-
-        case T_GT:
-            getNextToken();
-            parseInput();
-            break;
-
-        default:
-            reportError("Unexpected token in parseC");
-    }
+    if (diag->line)
+        fprintf(out, "Parser Error: %s at line %d, column %d\n", diag->message, diag->line, diag->column);
+    else
+        fprintf(out, "Parser Error: %s\n", diag->message);
 }
 
-static void parseIf(void)
+void reportDiagnostic(const Diagnostic* diag)
 {
-    int condition = parseExpr();
-
-    if (currentToken.type != T_QUESTION)
-        reportError("Missing '?' in IF statement");
-    getNextToken();
-
-    int savedExec = executeFlag;
-    if (condition != 0)
-        executeFlag = 1;
-    else
-        executeFlag = 0;
+    ErrorTrap* trap = activeTrap;
 
-    while (currentToken.type != T_COLON && currentToken.type != T_RBRACKET)
+    if (!trap)
     {
-        if (currentToken.type == T_DOT || currentToken.type == T_END)
-            reportError("Missing ':' or ']' in IF");
-        parseC();
+        if (activeInterp)
+            outputFlush(activeInterp);
+        printDiagnostic(diag, stderr);
+        exit(1);
     }
-
-    if (currentToken.type == T_COLON)
+    /* Popped first, so an error inside a cleanup goes to the outer trap. */
+    activeTrap = trap->outer;
+    while (cleanupCount > trap->cleanupMark)
     {
-        getNextToken();
-        if (condition != 0)
-            executeFlag = 0;
-        else
-            executeFlag = 1;
-
-        while (currentToken.type != T_RBRACKET)
-        {
-            if (currentToken.type == T_DOT || currentToken.type == T_END)
-                reportError("Missing ']' in IF");
-            parseC();
-        }
+        cleanupCount--;
+        cleanups[cleanupCount].fn(cleanups[cleanupCount].arg);
     }
-
-    if (currentToken.type != T_RBRACKET)
-        reportError("Missing ']' in IF");
-
-    getNextToken();
-    executeFlag = savedExec;
+    trapPop(trap);
+    trap->diag = *diag;
+    longjmp(trap->env, 1);
 }
 
-static void parseWhile(void)
+void reportError(ErrorCode code, const char* msg)
 {
-    TokenBuffer condBuf;
-    initTokenBuffer(&condBuf);
-
-    while (currentToken.type != T_QUESTION)
-    {
-        if (currentToken.type == T_END || currentToken.type == T_DOT)
-            reportError("Missing '?' in WHILE condition");
-        pushToken(&condBuf, currentToken);
-        getNextToken();
-    }
-    getNextToken();
-    TokenBuffer blockBuf;
-    initTokenBuffer(&blockBuf);
-
-    while (currentToken.type != T_RBRACE)
-    {
-        if (currentToken.type == T_END || currentToken.type == T_DOT)
-            reportError("Missing '}' in WHILE block");
-        pushToken(&blockBuf, currentToken);
-        getNextToken();
-    }
-    getNextToken();
+    Diagnostic diag;
 
-    while (1)
-    {
-        MiniLexer mlCond;
-        mlCond.tokens = condBuf.tokens;
-        mlCond.pos    = 0;
-        mlCond.size   = condBuf.count;
-
-        int condVal = miniParseE(&mlCond);
-        if (condVal == 0)
-            break;
-
-        BlockParser bp;
-        bp.tokens   = blockBuf.tokens;
-        bp.pos      = 0;
-        bp.size     = blockBuf.count;
-        bp.execFlag = 1;
-
-        blockParse(&bp);
-    }
-
-    freeTokenBuffer(&condBuf);
-    freeTokenBuffer(&blockBuf);
+    ft_memset(&diag, 0, sizeof(Diagnostic));
+    diag.code    = code;
+    diag.message = msg;
+    reportDiagnostic(&diag);
 }
 
-static void parseAssignment(void)
+/* An error at a byte offset of the source; the line and column are only worked out here. */
+void reportErrorAt(ErrorCode code, const char* msg, const char* text, size_t offset)
 {
-    char varName = currentToken.ch;
-    getNextToken();
-
-    if (currentToken.type != T_ASSIGN)
-        reportError("Missing '=' in assignment");
-    getNextToken();
-
-    int val = parseExpr();
+    Diagnostic  diag;
+    const char* lineStart = text;
+    const char* nl;
 
-    if (currentToken.type != T_SEMI)
-        reportError("Missing ';' at the end of assignment");
-    getNextToken();
-
-    if (executeFlag)
+    diag.code    = code;
+    diag.message = msg;
+    diag.offset  = offset;
+    diag.line    = 1;
+    while ((nl = (const char*)memchr(lineStart, '\n', (size_t)(text + offset - lineStart))) != NULL)
     {
-        int idx = varName - 'a';
-        variables[idx] = val;
+        diag.line++;
+        lineStart = nl + 1;
     }
+    diag.column = (int)(text + offset - lineStart) + 1;
+    reportDiagnostic(&diag);
 }
 
-static void parseOutput(void)
+Interp* interpCreate(const InterpOptions* opts)
 {
-    int val = parseExpr();
-    if (currentToken.type != T_SEMI)
-        reportError("Missing ';' after output expression");
-    getNextToken();
+    Interp* interp = (Interp*)malloc(sizeof(Interp));
 
-    if (executeFlag)
-    {
-        printf("%d\n", val);
-        fflush(stdout);
-    }
+    if (!interp)
+        return NULL;
+    ft_memset(interp, 0, sizeof(Interp));
+    if (opts)
+        interp->opts = *opts;
+    else
+        initOptions(&interp->opts);
+    return interp;
 }
 
-static void parseInput(void)
+void interpDestroy(Interp* interp)
 {
-    if (currentToken.type != T_ID)
-        reportError("Missing variable ID in input statement");
-
-    char varName = currentToken.ch;
-    getNextToken();
-
-    if (currentToken.type != T_SEMI)
-        reportError("Missing ';' after input statement");
-    getNextToken();
-
-    if (executeFlag)
-    {
-        int val;
-        printf("Input for variable '%c': ", varName);
-        fflush(stdout);
-        scanf("%d", &val);
-        int idx = varName - 'a';
-        variables[idx] = val;
-    }
+    if (!interp)
+        return;
+    free(interp->out.buf);
+    free(interp->out.captured);
+    inputClose(interp);
+    free(interp);
 }
 
-static int parseExpr(void)
+static size_t bytecodeSize(const Bytecode* bc)
 {
-    int result = parseTerm();
-    while (currentToken.type == T_PLUS || currentToken.type == T_MINUS)
-    {
-        TokenType op = currentToken.type;
-        getNextToken();
-        int right = parseTerm();
-        if (op == T_PLUS)  result += right;
-        else               result -= right;
-    }
-    return result;
+    size_t size = sizeof(int) * (size_t)bc->codeCap + sizeof(Value) * (size_t)bc->constCap
+        + sizeof(LoopInfo) * (size_t)bc->loopCap + sizeof(LoopSummary) * (size_t)bc->summaryCount;
+
+    for (int i = 0; i < bc->slots.count; i++)
+        size += sizeof(char*) + strlen(bc->slots.names[i]) + 1;
+    return size;
 }
 
-static int parseTerm(void)
+/* Parses and optimises the source; the caller owns the result. */
+static void frontEnd(Program* prog, const char* programText, size_t length, const InterpOptions* opts)
 {
-    int result = parsePower();
-    while (currentToken.type == T_STAR || currentToken.type == T_SLASH || currentToken.type == T_MOD)
-    {
-        TokenType op = currentToken.type;
-        getNextToken();
-        int right = parsePower();
-        if (op == T_STAR)
-            result *= right;
-        else if (op == T_SLASH)
-        {
-            if (right == 0)
-                reportError("Division by zero");
-            result /= right;
-        }
-        else if (op == T_MOD)
-        {
-            if (right == 0)
-                reportError("Modulo by zero");
-            result %= right;
-        }
-    }
-    return result;
+    OptStats stats;
+
+    parseProgram(prog, programText, length, opts->profile);
+    prog->mode = opts->numMode;
+    if (!opts->optimize)
+        return;
+    perfPhase(PERF_OPTIMIZE);
+    optimizeProgram(prog, &stats);
+    if (opts->optStats)
+        fprintf(stderr, "optimizer: %d nodes -> %d (%d removed): %d folded, %d simplified, %d dead branches, %d loops summarised, %d bounds-guarded\n",
+            stats.before, stats.after, stats.before - stats.after,
+            stats.folded, stats.simplified, stats.branches, stats.loops, stats.guarded);
 }
 
-static int parsePower(void)
+/* Everything compiling took, tokens to bytecode, as one line on stderr. */
+static void reportArena(const Program* prog)
 {
-    int left = parseFactor();
-    if (currentToken.type == T_CARET)
-    {
-        getNextToken();
-        int right = parsePower();
-        int out = 1;
-        for(int i = 0; i < right; i++)
-            out *= left;
-        return out;
-    }
-    return left;
+    const ArenaStats* st = &prog->arena.stats;
+
+    fprintf(stderr, "arena: %zu allocations, %zu KiB in %zu chunks (%zu new, %zu reused)\n",
+        st->allocs, (st->bytes + 1023) / 1024, st->chunks, st->fresh, st->chunks - st->fresh);
 }
 
-static int parseFactor(void)
+static void dropProgram(void* prog)
 {
-    if (currentToken.type == T_LPAREN)
-    {
-        getNextToken();
-        int val = parseExpr();
-        if (currentToken.type != T_RPAREN)
-            reportError("Missing ')' in factor");
-        getNextToken();
-        return val;
-    }
-    else if (currentToken.type == T_ID)
-    {
-        char varName = currentToken.ch;
-        getNextToken();
-        int idx = varName - 'a';
-        return variables[idx];
-    }
-    else if (currentToken.type == T_NUM)
-    {
-        int val = currentToken.ch - '0';
-        getNextToken();
-        return val;
-    }
-    else
-        reportError("Unexpected token in parseFactor");
-    return 0;
+    freeProgram((Program*)prog);
 }
 
-static int miniParseE(MiniLexer* ml)
+static void dropBytecode(void* bc)
 {
-    int result = miniParseT(ml);
-    while (ml->pos < ml->size)
-    {
-        Token op = ml->tokens[ml->pos];
-        if (op.type == T_PLUS || op.type == T_MINUS)
-        {
-            ml->pos++;
-            int right = miniParseT(ml);
-            if (op.type == T_PLUS)
-                result += right;
-            else
-                result -= right;
-        }
-        else
-            break;
-    }
-    return result;
+    freeBytecode((Bytecode*)bc);
 }
-static int miniParseT(MiniLexer* ml)
+
+static void dropCompiled(void* c)
 {
-    int result = miniParseU(ml);
-    while (ml->pos < ml->size)
-    {
-        Token op = ml->tokens[ml->pos];
-        if (op.type == T_STAR || op.type == T_SLASH || op.type == T_MOD)
-        {
-            ml->pos++;
-            int right = miniParseU(ml);
-            if (op.type == T_STAR)
-                result *= right;
-            else if (op.type == T_SLASH)
-            {
-                if (right == 0)
-                    reportError("miniParseT: divide by zero");
-                result /= right;
-            }
-            else if (op.type == T_MOD)
-            {
-                if (right == 0)
-                    reportError("miniParseT: modulo by zero");
-                result %= right;
-            }
-        }
-        else
-            break;
-    }
-    return result;
+    compiledRelease((Compiled*)c);
 }
-static int miniParseU(MiniLexer* ml)
+
+static void dropOutput(void* interp)
 {
-    int left = miniParseF(ml);
-    if (ml->pos < ml->size && ml->tokens[ml->pos].type == T_CARET)
-    {
-        ml->pos++;
-        int right = miniParseU(ml);
-        int result = 1;
-        for (int i = 0; i < right; i++)
-            result *= left;
-        return result;
-    }
-    return left;
+    outputRelease((Interp*)interp);
 }
-static int miniParseF(MiniLexer* ml)
+
+/*
+** Only the parts the chosen engine runs are kept: the tree-walker needs the
+** AST, the VM its bytecode and, with --jit, the native loops. Returns NULL
+** with the reason in err when the program does not compile.
+*/
+Compiled* compileSource(const char* programText, size_t length, const InterpOptions* opts, Diagnostic* err)
 {
-    if (ml->pos >= ml->size)
-        reportError("miniParseF: out of tokens");
+    Compiled* volatile c = (Compiled*)malloc(sizeof(Compiled));
+    ErrorTrap          trap;
 
-    Token tk = ml->tokens[ml->pos++];
-    if (tk.type == T_LPAREN)
+    if (!c)
     {
-        int val = miniParseE(ml);
-        if (ml->pos >= ml->size)
-            reportError("miniParseF: missing ')' token");
-        Token tk2 = ml->tokens[ml->pos++];
-        if (tk2.type != T_RPAREN)
-            reportError("miniParseF: missing closing parenthesis");
-        return val;
+        ft_memset(err, 0, sizeof(Diagnostic));
+        err->code    = ERR_NO_MEMORY;
+        err->message = "Out of memory";
+        return NULL;
     }
-    else if (tk.type == T_ID)
+    ft_memset(c, 0, sizeof(Compiled));
+    c->refs     = 1;
+    c->engine   = opts->profile ? ENGINE_AST : opts->engine;
+    c->mode     = opts->numMode;
+    c->optimize = opts->optimize;
+    c->jit      = opts->jit && c->engine == ENGINE_VM;
+    trapPush(&trap);
+    if (setjmp(trap.env))
     {
-        int idx = tk.ch - 'a';
-        return variables[idx];
+        compiledRelease(c);
+        *err = trap.diag;
+        return NULL;
     }
-    else if (tk.type == T_NUM)
+    frontEnd(&c->prog, programText, length, opts);
+    perfPhase(PERF_COMPILE);
+    if (c->engine == ENGINE_VM)
+        compileProgram(&c->prog, &c->bc);
+    if (opts->optStats)
+        reportArena(&c->prog);
+    if (c->engine == ENGINE_VM)
     {
-        return tk.ch - '0';
+        freeProgram(&c->prog);
+        if (c->jit)
+            jitCompile(&c->bc, &c->native);
     }
-    else
-        reportError("miniParseF: unexpected token");
-    return 0;
+    trapPop(&trap);
+    c->size = sizeof(Compiled) + arenaReserved(&c->prog.arena) + bytecodeSize(&c->bc) + c->native.size;
+    return c;
 }
 
-static void blockParse(BlockParser* bp)
+void compiledRetain(Compiled* c)
 {
-    while (bp->pos < bp->size)
-    {
-        blockStatement(bp);
-    }
+    __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
 }
 
-static void blockStatement(BlockParser* bp)
+void compiledRelease(Compiled* c)
 {
-    Token tk = blockPeekToken(bp);
-    switch (tk.type)
-    {
-        case T_LBRACKET:
-            blockNextToken(bp);
-            blockIf(bp);
-            break;
-
-        case T_LBRACE:
-            blockNextToken(bp);
-            blockError("Nested while is not implemented in this example.");
-            break;
-
-        case T_ID:
-        {
-            Token varTok = blockNextToken(bp);
-            Token eqTok  = blockNextToken(bp);
-            if (eqTok.type != T_ASSIGN)
-                blockError("Expected '=' in assignment");
-            int val = blockExpr(bp);
-
-            Token semi = blockNextToken(bp);
-            if (semi.type != T_SEMI)
-                blockError("Expected ';' after assignment");
-
-            if (bp->execFlag)
-            {
-                int idx = varTok.ch - 'a';
-                variables[idx] = val;
-            }
-        }
-        break;
-
-        case T_LT:
-        {
-            blockNextToken(bp);
-            int val = blockExpr(bp);
-
-            Token semi = blockNextToken(bp);
-            if (semi.type != T_SEMI)
-                blockError("Expected ';' after output");
-
-            if (bp->execFlag)
-            {
-                printf("%d\n", val);
-                fflush(stdout);
-            }
-        }
-        break;
-
-        case T_GT:
-        {
-            blockNextToken(bp);
-            Token varTok = blockNextToken(bp);
-            if (varTok.type != T_ID)
-                blockError("Expected ID for input statement");
-
-            Token semi = blockNextToken(bp);
-            if (semi.type != T_SEMI)
-                blockError("Expected ';' after input");
-
-            if (bp->execFlag)
-            {
-                int val;
-                printf("Input for variable '%c': ", varTok.ch);
-                fflush(stdout);
-                scanf("%d", &val);
-                int idx = varTok.ch - 'a';
-                variables[idx] = val;
-            }
-        }
-        break;
-
-        case T_END:
-            return;
-
-        default:
-            blockError("Unexpected token in blockStatement");
-    }
+    if (!c || __atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    jitFree(&c->native);
+    if (!c->borrowed)
+        freeBytecode(&c->bc);
+    freeProgram(&c->prog);
+    free(c);
 }
 
-static void blockIf(BlockParser* bp)
+/* Output written before an error still reaches its destination. */
+static void runCompiled(Interp* interp, const Compiled* c)
 {
-    int saved = bp->execFlag;
-    int condVal = blockExpr(bp);
-
-    Token qTok = blockNextToken(bp);
-    if (qTok.type != T_QUESTION)
-        blockError("Missing '?' in blockIf");
-
-    if (condVal != 0)
-        bp->execFlag = 1;
+    outputInit(interp, interp->opts.outFlush);
+    pushCleanup(dropOutput, interp);
+    inputInit(interp, &interp->opts.input);
+    interp->names = c->engine == ENGINE_AST ? &c->prog.slots : &c->bc.slots;
+    perfPhase(PERF_EXEC);
+    if (c->engine == ENGINE_AST)
+        execProgram(interp, &c->prog);
     else
-        bp->execFlag = 0;
+        runBytecode(interp, &c->bc, &c->native);
+    outputText(interp, "Program successfully parsed.\n");
+    popCleanup();
+    outputRelease(interp);
+    outputCheck(interp);
+}
 
-    while (1)
-    {
-        Token pk = blockPeekToken(bp);
-        if (pk.type == T_COLON || pk.type == T_RBRACKET || pk.type == T_END)
-            break;
-        blockStatement(bp);
-    }
+/* Runs a compiled program with fresh variables; c is only read. */
+ErrorCode interpRunCompiled(Interp* interp, const Compiled* c)
+{
+    Interp*   caller = activeInterp;
+    ErrorTrap trap;
 
-    Token pk = blockPeekToken(bp);
-    if (pk.type == T_COLON)
+    activeInterp = interp;
+    trapPush(&trap);
+    if (setjmp(trap.env) == 0)
     {
-        blockNextToken(bp);
-        if (condVal != 0)
-            bp->execFlag = 0;
-        else
-            bp->execFlag = 1;
-
-        while (1)
-        {
-            Token pk2 = blockPeekToken(bp);
-            if (pk2.type == T_RBRACKET || pk2.type == T_END)
-                break;
-            blockStatement(bp);
-        }
+        runCompiled(interp, c);
+        trapPop(&trap);
     }
-
-    Token rb = blockNextToken(bp);
-    if (rb.type != T_RBRACKET)
-        blockError("Missing ']' in blockIf");
-
-    bp->execFlag = saved;
+    interp->error = trap.diag;
+    activeInterp  = caller;
+    return trap.diag.code;
 }
 
-static int blockExpr(BlockParser* bp)
+static void runSource(Interp* interp, const char* programText, size_t length)
 {
-    int result = blockTerm(bp);
-    while (1)
+    const InterpOptions* opts = &interp->opts;
+    Program              prog;
+    Bytecode             bc;
+    Diagnostic           err;
+    Compiled*            c;
+
+    if ((opts->compileOut || opts->disassemble) && !isCompiledImage(programText, length))
     {
-        Token pk = blockPeekToken(bp);
-        if (pk.type == T_PLUS || pk.type == T_MINUS)
+        ft_memset(&prog, 0, sizeof(Program));
+        pushCleanup(dropProgram, &prog);
+        frontEnd(&prog, programText, length, opts);
+        perfPhase(PERF_COMPILE);
+        if (opts->compileOut)
         {
-            Token op = blockNextToken(bp);
-            int right = blockTerm(bp);
-            if (op.type == T_PLUS)
-                result += right;
-            else
-                result -= right;
+            if (!buildNative(&prog, &opts->input, opts->compileOut))
+                reportError(ERR_SYSTEM, "Native build failed");
         }
         else
-            break;
+        {
+            ft_memset(&bc, 0, sizeof(Bytecode));
+            pushCleanup(dropBytecode, &bc);
+            compileProgram(&prog, &bc);
+            disassemble(&bc, stdout);
+            popCleanup();
+            freeBytecode(&bc);
+        }
+        popCleanup();
+        freeProgram(&prog);
+        return;
     }
-    return result;
-}
 
-static int blockTerm(BlockParser* bp)
-{
-    int result = blockPower(bp);
-    while (1)
+    if (isCompiledImage(programText, length))
     {
-        Token pk = blockPeekToken(bp);
-        if (pk.type == T_STAR || pk.type == T_SLASH || pk.type == T_MOD)
-        {
-            Token op = blockNextToken(bp);
-            int right = blockPower(bp);
-            if (op.type == T_STAR)
-                result *= right;
-            else if (op.type == T_SLASH)
-            {
-                if (right == 0)
-                    blockError("Division by zero in while block");
-                result /= right;
-            }
-            else
-            {
-                if (right == 0)
-                    blockError("Modulo by zero in while block");
-                result %= right;
-            }
-        }
+        c = loadCompiled(programText, length, opts);
+        pushCleanup(dropCompiled, c);
+        if (opts->disassemble)
+            disassemble(&c->bc, stdout);
         else
-            break;
+            runCompiled(interp, c);
+        popCleanup();
+        compiledRelease(c);
+        return;
     }
-    return result;
-}
-
-static int blockPower(BlockParser* bp)
-{
-    int left = blockFactor(bp);
-
-    Token pk = blockPeekToken(bp);
-    if (pk.type == T_CARET)
+    if (opts->emitOut)
     {
-        blockNextToken(bp);
-        int right = blockPower(bp);
-        int out = 1;
-        for(int i = 0; i < right; i++)
-            out *= left;
-        return out;
+        InterpOptions vm = *opts;
+        vm.engine        = ENGINE_VM;
+        vm.jit           = 0;
+        c                = compileSource(programText, length, &vm, &err);
+        if (!c)
+            reportDiagnostic(&err);
+        int built = writeCompiled(c, opts->emitOut);
+        compiledRelease(c);
+        if (!built)
+            reportError(ERR_SYSTEM, "Cannot write compiled program");
+        return;
     }
-    return left;
+
+    c = compileSource(programText, length, opts, &err);
+    if (!c)
+        reportDiagnostic(&err);
+    pushCleanup(dropCompiled, c);
+    runCompiled(interp, c);
+    popCleanup();
+    compiledRelease(c);
 }
 
-static int blockFactor(BlockParser* bp)
+static void finishPerf(void* perf)
 {
-    Token tk = blockNextToken(bp);
-    if (tk.type == T_LPAREN)
-    {
-        int val = blockExpr(bp);
-        Token tk2 = blockNextToken(bp);
-        if (tk2.type != T_RPAREN)
-            blockError("Missing ')' in blockFactor");
-        return val;
-    }
-    else if (tk.type == T_ID)
-    {
-        int idx = tk.ch - 'a';
-        return variables[idx];
-    }
-    else if (tk.type == T_NUM)
-    {
-        return tk.ch - '0';
-    }
-    else
-        blockError("Unexpected token in blockFactor");
-    return 0;
+    perfEnd((PerfSession*)perf, stderr);
 }
-static Token blockNextToken(BlockParser* bp)
+
+/* --perf: the counters are read at each phase boundary and reported even when the run fails. */
+static void runMeasured(Interp* interp, const char* programText, size_t length)
 {
-    if (bp->pos >= bp->size)
-    {
-        Token t;
-        t.type = T_END;
-        t.ch   = 0;
-        return t;
-    }
-    return bp->tokens[bp->pos++];
+    PerfSession* perf = perfBegin();
+
+    pushCleanup(finishPerf, perf);
+    runSource(interp, programText, length);
+    popCleanup();
+    finishPerf(perf);
 }
 
-static Token blockPeekToken(BlockParser* bp)
+/*
+** The source need not be NUL-terminated, so a mapped file can be run in
+** place. Errors come back as a code, with the details in interp->error.
+*/
+ErrorCode interpRun(Interp* interp, const char* programText, size_t length)
 {
-    if (bp->pos >= bp->size)
+    Interp*   caller = activeInterp;
+    ErrorTrap trap;
+
+    activeInterp = interp;
+    trapPush(&trap);
+    if (setjmp(trap.env) == 0)
     {
-        Token t;
-        t.type = T_END;
-        t.ch   = 0;
-        return t;
+        if (interp->opts.perfStats)
+            runMeasured(interp, programText, length);
+        else
+            runSource(interp, programText, length);
+        trapPop(&trap);
     }
-    return bp->tokens[bp->pos];
+    interp->error = trap.diag;
+    activeInterp  = caller;
+    return trap.diag.code;
 }
 
-static void blockError(const char* msg)
+/* Runs one program on a fresh instance and prints the diagnostic if it fails. */
+ErrorCode interpretSource(const char* programText, size_t length, const InterpOptions* opts)
 {
-    fprintf(stderr, "While block parse error: %s\n", msg);
-    exit(1);
-}
+    Interp*   interp = interpCreate(opts);
+    ErrorCode code;
 
-static void initTokenBuffer(TokenBuffer* buf)
-{
-    buf->count    = 0;
-    buf->capacity = 16;
-    buf->tokens   = (Token*)malloc(sizeof(Token) * buf->capacity);
+    if (!interp)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    code = interpRun(interp, programText, length);
+    if (code != ERR_NONE)
+        printDiagnostic(&interp->error, stderr);
+    interpDestroy(interp);
+    return code;
 }
 
-static void freeTokenBuffer(TokenBuffer* buf)
+ErrorCode interpretWith(const char* programText, const InterpOptions* opts)
 {
-    if (buf->tokens)
-        free(buf->tokens);
-    buf->tokens   = NULL;
-    buf->count    = 0;
-    buf->capacity = 0;
+    return interpretSource(programText, strlen(programText), opts);
 }
 
-static void pushToken(TokenBuffer* buf, Token tk)
+ErrorCode interpret(const char* programText)
 {
-    if (buf->count >= buf->capacity)
-    {
-        buf->capacity *= 2;
-        buf->tokens = (Token*)realloc(buf->tokens, sizeof(Token) * buf->capacity);
-    }
-    buf->tokens[buf->count++] = tk;
+    InterpOptions opts;
+
+    initOptions(&opts);
+    return interpretWith(programText, &opts);
 }
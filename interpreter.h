@@ -6,6 +6,34 @@
 # include <string.h>
 # include <ctype.h>
 # include <stddef.h>
+# include <stdint.h>
+# include <setjmp.h>
+
+# define MAX_VARIABLES    (1 << 20)
+# define SUMMARY_MAX_VARS 8
+
+# if defined(__GNUC__) || defined(__clang__)
+#  define VM_COMPUTED_GOTO 1
+# endif
+
+# if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#  define JIT_SUPPORTED 1
+# endif
+
+/*
+** Runtime values are 64 bits wide in every mode; NumMode selects how
+** arithmetic on them behaves (see numeric.h).
+*/
+typedef int64_t Value;
+
+typedef enum
+{
+    NUM_INT32,
+    NUM_INT64,
+    NUM_CHECKED
+} NumMode;
+
+typedef struct Interp Interp;
 
 typedef enum
 {
@@ -34,39 +62,653 @@ typedef enum
     T_UNKNOWN
 } TokenType;
 
+/* ch is the token's only character, or 0 for a longer name or number starting at at. */
 typedef struct
 {
     TokenType type;
-    char      ch;  
+    char      ch;
+    size_t    at;
 } Token;
 
+/*
+** A whole program's tokens, ending with T_END, as parallel arrays: token i
+** is types[i] with the character chars[i]. Names and numbers longer than
+** one byte have chars[i] == 0 and their offsets in words, in token order.
+** Only diagnostics need the other offsets, so marks keeps just the offset
+** of every TOKEN_MARK_STRIDE-th token and tokenOffset rescans from there.
+*/
+# define TOKEN_MARK_STRIDE 64
+
 typedef struct
 {
-    Token* tokens;
-    int    pos;
-    int    size;
-} MiniLexer;
+    unsigned char* types;
+    char*          chars;
+    size_t*        marks;
+    size_t*        words;
+    size_t         count;
+    size_t         wordCount;
+} TokenList;
 
-typedef struct
+/*
+** Expression nodes use left/right as operands, N_NUM keeps its constant and
+** N_VAR its variable slot in value. The array expressions keep the array's
+** slot in value: N_INDEX has the index in left, N_LEN, N_SUM, N_MIN and
+** N_MAX take the whole array, and N_ARRAY is an array operand of an
+** N_ARRAY_ASSIGN. Statement nodes are chained through next:
+**   N_ASSIGN        value = slot, left = expression
+**   N_OUTPUT        left = expression
+**   N_INPUT         value = slot
+**   N_IF            left = condition, right = then block, alt = else block
+**   N_WHILE         left = condition, right = body, value = loop summary or
+**                   -1, alt = bounds guards (see optimize.c) or NULL
+**   N_DECLARE       value = slot, left = length
+**   N_STORE         value = slot, left = expression, right = index
+**   N_ARRAY_ASSIGN  value = slot, left = an N_ARRAY, an operator between an
+**                   N_ARRAY and an N_ARRAY or number, or a number to fill with
+**   N_GUARD         value = array slot or -1, left and right = index range
+*/
+typedef enum
+{
+    N_NUM,
+    N_VAR,
+    N_ADD,
+    N_SUB,
+    N_MUL,
+    N_DIV,
+    N_MOD,
+    N_POW,
+    N_ASSIGN,
+    N_OUTPUT,
+    N_INPUT,
+    N_IF,
+    N_WHILE,
+    N_INDEX,
+    N_LEN,
+    N_SUM,
+    N_MIN,
+    N_MAX,
+    N_ARRAY,
+    N_DECLARE,
+    N_STORE,
+    N_ARRAY_ASSIGN,
+    N_GUARD
+} NodeKind;
+
+typedef struct Node
 {
-    Token* tokens;
-    int    pos;
-    int    size;
-    int    execFlag;
-} BlockParser;
+    NodeKind     kind;
+    int          value;
+    struct Node* left;
+    struct Node* right;
+    struct Node* alt;
+    struct Node* next;
+} Node;
+
+/*
+** The operators along the left edge of an expression, top first, with the
+** operand at the bottom in leaf. Parsing a+b+c+... yields such left-deep
+** chains, so walkers loop over a spine instead of recursing once per
+** operator; only right operands and parentheses recurse, and the parser
+** bounds those by MAX_NESTING.
+*/
+# define SPINE_INLINE 16
+# define MAX_NESTING  4096
 
 typedef struct
 {
-    Token* tokens;
+    Node** ops;
     int    count;
-    int    capacity;
-} TokenBuffer;
+    int    cap;
+    Node*  leaf;
+    Node*  local[SPINE_INLINE];
+} Spine;
+
+/*
+** Bump-pointer allocator for everything built while compiling one program:
+** tokens, nodes, summaries and the bytecode while it grows. Blocks are never
+** freed one by one; arenaFree hands the chunks back to a process-wide pool
+** that the next compilation draws from (see arena.c).
+*/
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct
+{
+    size_t allocs;
+    size_t bytes;
+    size_t chunks;
+    size_t fresh;
+} ArenaStats;
+
+typedef struct
+{
+    ArenaChunk* small;
+    ArenaChunk* large;
+    ArenaStats  stats;
+} Arena;
+
+/* coef * i + k + varCoef * variables[var]; var is -1 when unused. */
+typedef struct
+{
+    int coef;
+    int k;
+    int var;
+    int varCoef;
+} Affine;
+
+typedef enum
+{
+    SUM_ACCUM,
+    SUM_SCALE,
+    SUM_LAST
+} SumKind;
+
+typedef struct
+{
+    SumKind kind;
+    int     slot;
+    int     after;
+    Affine  f;
+} SumEntry;
+
+typedef struct
+{
+    int      ind;
+    int      step;
+    Affine   cond;
+    int      count;
+    SumEntry entries[SUMMARY_MAX_VARS];
+} LoopSummary;
+
+/*
+** Variable names by slot. The parser interns every identifier, giving each
+** new name the next slot, so the engines index a dense array of count
+** values and never look a name up; the names are kept for input prompts,
+** listings, generated C and compiled images.
+*/
+typedef struct
+{
+    const char** names;
+    int          count;
+    int          cap;
+} SlotNames;
+
+/*
+** Where a statement starts, recorded only for --profile; with it the
+** program keeps a copy of its source for the annotated listing.
+*/
+typedef struct
+{
+    const Node* stmt;
+    int         line;
+} StmtSite;
+
+typedef struct
+{
+    Node*        body;
+    Arena        arena;
+    LoopSummary* summaries;
+    int          summaryCount;
+    int          summaryCap;
+    NumMode      mode;
+    SlotNames    slots;
+    StmtSite*    sites;
+    int          siteCount;
+    int          siteCap;
+    const char*  source;
+    size_t       sourceLength;
+} Program;
+
+/*
+** Stack machine instructions. PUSH, LOAD, STORE, READ, JZ, JNZ and JMP take
+** one operand: a constant pool index, a variable slot or a code offset.
+** LOOP precedes every while loop and names its entry in Bytecode.loops.
+** SUMMARY takes a summary index and the loop's end offset, and skips the
+** loop when applySummary computed its result directly.
+** Arithmetic comes in one group of ARITH_OPS opcodes per NumMode, so
+** OP_ADD + mode * ARITH_OPS is the addition of that mode.
+** The array instructions take the array's slot: DECLARE pops a length,
+** INDEX an index, STOREX a value and an index; the U forms skip the bounds
+** check and only appear in loops whose GUARD held. LEN, SUM, MIN and MAX
+** push a whole-array result. ARRAY takes the destination, the operator
+** (0..4 for + - * / %, -1 for a copy or fill) and two operand slots, each
+** -1 for a number popped from the stack. GUARD takes an array slot, the
+** offsets added to the two bounds it pops and the offset to jump to when
+** they are not within the array.
+*/
+# define ARITH_OPS 6
+
+typedef enum
+{
+    OP_HALT,
+    OP_PUSH,
+    OP_LOAD,
+    OP_STORE,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_POW,
+    OP_ADD64,
+    OP_SUB64,
+    OP_MUL64,
+    OP_DIV64,
+    OP_MOD64,
+    OP_POW64,
+    OP_ADDCHK,
+    OP_SUBCHK,
+    OP_MULCHK,
+    OP_DIVCHK,
+    OP_MODCHK,
+    OP_POWCHK,
+    OP_JZ,
+    OP_JNZ,
+    OP_JMP,
+    OP_PRINT,
+    OP_READ,
+    OP_LOOP,
+    OP_SUMMARY,
+    OP_DECLARE,
+    OP_INDEX,
+    OP_INDEXU,
+    OP_STOREX,
+    OP_STOREXU,
+    OP_LEN,
+    OP_SUM,
+    OP_MIN,
+    OP_MAX,
+    OP_ARRAY,
+    OP_GUARD,
+    OP_COUNT
+} OpCode;
+
+typedef struct
+{
+    int start;
+    int end;
+} LoopInfo;
+
+/*
+** The arrays grow in the program's arena while compiling; compileProgram
+** then packs them into storage, the single block freeBytecode releases.
+*/
+typedef struct
+{
+    int*         code;
+    int          codeLen;
+    int          codeCap;
+    Value*       consts;
+    int          constCount;
+    int          constCap;
+    int*         constIndex;
+    int          constIndexCap;
+    LoopInfo*    loops;
+    int          loopCount;
+    int          loopCap;
+    LoopSummary* summaries;
+    int          summaryCount;
+    int          maxStack;
+    int          depth;
+    int          unchecked;
+    NumMode      mode;
+    SlotNames    slots;
+    Arena*       arena;
+    void*        storage;
+} Bytecode;
+
+/*
+** The arrays of a running program, one per slot: an array holds length
+** zeroed elements from its declaration on, and a slot never declared reads
+** as an empty array. first and end bound the slots declared so far, so
+** freeing the table only visits those.
+*/
+typedef struct
+{
+    Value* data;
+    size_t length;
+} Array;
+
+typedef struct
+{
+    Array* items;
+    int    first;
+    int    end;
+} ArrayTable;
+
+typedef void (*JitFn)(Value* variables, void* ctx);
+
+typedef struct
+{
+    unsigned char* mem;
+    size_t         size;
+    JitFn*         entries;
+    int            compiled;
+} JitCode;
+
+typedef struct
+{
+    int before;
+    int after;
+    int folded;
+    int simplified;
+    int branches;
+    int loops;
+    int guarded;
+} OptStats;
+
+typedef enum
+{
+    OUT_FLUSH_AUTO,
+    OUT_FLUSH_FULL,
+    OUT_FLUSH_LINE
+} OutFlush;
+
+/*
+** Where > reads from. INPUT_FD parses integers from a file descriptor, which
+** is mapped when it is a regular file and read in large blocks otherwise;
+** INPUT_MEMORY hands out values from an array. prompt prints the
+** "Input for variable" prompt before each read, and onEof decides whether
+** running out of input is an error or reads as 0.
+*/
+typedef enum
+{
+    INPUT_FD,
+    INPUT_MEMORY
+} InputKind;
+
+typedef enum
+{
+    EOF_ERROR,
+    EOF_ZERO
+} EofPolicy;
+
+typedef struct
+{
+    InputKind    kind;
+    int          fd;
+    const Value* values;
+    size_t       count;
+    int          prompt;
+    EofPolicy    onEof;
+} InputSource;
+
+typedef enum
+{
+    ENGINE_AST,
+    ENGINE_VM
+} Engine;
+
+typedef struct
+{
+    Engine      engine;
+    int         disassemble;
+    int         jit;
+    int         optimize;
+    int         optStats;
+    int         profile;
+    int         perfStats;
+    NumMode     numMode;
+    OutFlush    outFlush;
+    int         captureOutput;
+    InputSource input;
+    const char* compileOut;
+    const char* emitOut;
+} InterpOptions;
+
+/*
+** One interpreter instance. Everything a run touches lives here or in
+** structures local to the call, so instances are independent and can run
+** on different threads at once. The output buffer is only allocated while
+** a program runs; the input reader is kept until interpDestroy so that
+** consecutive runs share one input stream. names are the running
+** program's variable names, for the input prompt. out.failed records a
+** write to fd 1 that failed, which ends the run with ERR_SYSTEM.
+*/
+typedef struct
+{
+    char*    buf;
+    size_t   len;
+    OutFlush policy;
+    char*    captured;
+    size_t   capturedLen;
+    size_t   capturedCap;
+    int      failed;
+} Output;
+
+typedef struct
+{
+    InputSource src;
+    const char* cur;
+    const char* end;
+    char*       map;
+    size_t      mapLen;
+    size_t      next;
+    int         done;
+    int         open;
+    char*       block;
+} Input;
+
+/*
+** Why a run failed. Syntax errors carry the byte offset of the offending
+** token in the source and its 1-based line and column; other errors have
+** line 0. message is a static string.
+*/
+typedef enum
+{
+    ERR_NONE,
+    ERR_SYNTAX,
+    ERR_DIV_ZERO,
+    ERR_MOD_ZERO,
+    ERR_OVERFLOW,
+    ERR_INPUT,
+    ERR_EOF,
+    ERR_ARRAY,
+    ERR_BAD_IMAGE,
+    ERR_NO_MEMORY,
+    ERR_SYSTEM,
+    ERR_INTERNAL
+} ErrorCode;
+
+typedef struct
+{
+    ErrorCode   code;
+    const char* message;
+    size_t      offset;
+    int         line;
+    int         column;
+} Diagnostic;
+
+/*
+** reportError unwinds to the innermost ErrorTrap armed on the thread: the
+** cleanups pushed since trapPush run newest first, the trap is popped and
+** its setjmp returns 1 with diag filled in. A caller arms one with
+**     trapPush(&trap);
+**     if (setjmp(trap.env) == 0) { ...; trapPop(&trap); }
+** Without a trap the error is printed and the process exits.
+*/
+typedef struct ErrorTrap
+{
+    jmp_buf           env;
+    Diagnostic        diag;
+    size_t            cleanupMark;
+    struct ErrorTrap* outer;
+} ErrorTrap;
+
+struct Interp
+{
+    InterpOptions    opts;
+    Output           out;
+    Input            in;
+    Diagnostic       error;
+    const SlotNames* names;
+};
+
+/*
+** A compiled program. It is immutable once compileSource returns, so one
+** handle can be run by any number of instances and threads at once, each
+** run starting with fresh variables. Which parts exist depends on the
+** options it was compiled with: the AST for the tree-walker, bytecode and
+** native loops for the VM. The last compiledRelease frees it. A handle
+** loaded from an image borrows its bytecode from the image (borrowed).
+*/
+typedef struct Compiled
+{
+    int      refs;
+    int      borrowed;
+    Engine   engine;
+    NumMode  mode;
+    int      optimize;
+    int      jit;
+    Program  prog;
+    Bytecode bc;
+    JitCode  native;
+    size_t   size;
+} Compiled;
+
+/* Source-keyed LRU cache of compiled programs, bounded in bytes. */
+typedef struct ProgramCache ProgramCache;
+
+typedef struct
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+} CacheStats;
 
 int	ft_isalpha(int c);
 int	ft_isdigit(int c);
 int ft_isspace(char c);
 void *ft_memset(void *b, int c, size_t len);
 
-void interpret(const char* programText);
+void   arenaInit(Arena* arena);
+void*  arenaAlloc(Arena* arena, size_t size);
+void*  arenaGrow(Arena* arena, void* block, size_t oldSize, size_t newSize);
+void   arenaRelease(Arena* arena, void* block);
+void*  arenaDetach(Arena* arena, void* block, size_t oldSize, size_t newSize);
+void   arenaReset(Arena* arena);
+void   arenaFree(Arena* arena);
+size_t arenaReserved(const Arena* arena);
+
+void tokenize(const char* programText, size_t length, TokenList* list, Arena* arena);
+size_t tokenLength(const char* programText, size_t length, size_t at);
+size_t tokenOffset(const TokenList* list, const char* programText, size_t length, size_t index);
+void parseProgram(Program* prog, const char* programText, size_t length, int withSites);
+void freeProgram(Program* prog);
+int  isOperator(const Node* n);
+void spineCollect(Spine* s, const Node* n);
+void spineFree(Spine* s);
+
+void trapPush(ErrorTrap* trap);
+void trapPop(ErrorTrap* trap);
+void pushCleanup(void (*fn)(void*), void* arg);
+void popCleanup(void);
+void reportError(ErrorCode code, const char* msg);
+void reportErrorAt(ErrorCode code, const char* msg, const char* text, size_t offset);
+void reportDiagnostic(const Diagnostic* diag);
+void printDiagnostic(const Diagnostic* diag, FILE* out);
+
+void optimizeProgram(Program* prog, OptStats* stats);
+int  summarizeLoops(Program* prog);
+int  applySummary(const LoopSummary* sum, Value* variables);
+
+/* A program text, either mapped from its file or read into memory. */
+typedef struct
+{
+    char*  text;
+    size_t length;
+    int    mapped;
+} Source;
+
+int   loadSource(const char* path, Source* src);
+void  unloadSource(Source* src);
+void  outputInit(Interp* interp, OutFlush policy);
+void  outputFlush(Interp* interp);
+void  outputCheck(Interp* interp);
+void  outputRelease(Interp* interp);
+void  outputText(Interp* interp, const char* text);
+void  printValue(Interp* interp, Value v);
+void  inputInit(Interp* interp, const InputSource* src);
+void  inputClose(Interp* interp);
+Value readValue(Interp* interp, int slot, NumMode mode);
+
+void execProgram(Interp* interp, const Program* prog);
+
+/* Statement counts and times for --profile, collected by the tree-walker. */
+typedef struct Profile Profile;
+
+Profile* profileCreate(const Program* prog);
+void     profileFree(Profile* prof);
+uint64_t profileTicks(void);
+int      profileSite(Profile* prof, const Node* stmt);
+void     profileCount(Profile* prof, int site, uint64_t ticks);
+void     profileLoop(Profile* prof, const Node* loop, uint64_t iterations);
+void     profileReport(Profile* prof, FILE* out);
+
+/* Hardware and software counters per compilation phase for --perf. */
+typedef enum
+{
+    PERF_LEX,
+    PERF_PARSE,
+    PERF_OPTIMIZE,
+    PERF_COMPILE,
+    PERF_EXEC,
+    PERF_PHASES
+} PerfPhase;
+
+typedef struct PerfSession PerfSession;
+
+PerfSession* perfBegin(void);
+void         perfPhase(int phase);
+void         perfEnd(PerfSession* perf, FILE* out);
+
+/* Array storage and the whole-array kernels behind it (see array.c). */
+void        arraysInit(ArrayTable* t, int slots);
+void        arraysFree(void* t);
+void        arrayDeclare(ArrayTable* t, int slot, Value length);
+void        arrayApply(ArrayTable* t, NumMode mode, int dst, int op, int a, Value x, int b, Value y);
+Value       arrayReduce(const ArrayTable* t, NumMode mode, NodeKind kind, int slot);
+int         arrayCovers(const ArrayTable* t, int slot, Value low, int lowOffset, Value high, int highOffset);
+int         arraySelectKernels(const char* name);
+const char* arrayKernelName(void);
+
+void compileProgram(Program* prog, Bytecode* bc);
+void freeBytecode(Bytecode* bc);
+void disassemble(const Bytecode* bc, FILE* out);
+int  opOperands(int op);
+void runBytecode(Interp* interp, const Bytecode* bc, const JitCode* jit);
+
+int  jitCompile(const Bytecode* bc, JitCode* jit);
+void jitFree(JitCode* jit);
+
+void transpileProgram(const Program* prog, const InputSource* input, FILE* out);
+int  buildNative(const Program* prog, const InputSource* input, const char* outPath);
+
+Compiled* compileSource(const char* programText, size_t length, const InterpOptions* opts, Diagnostic* err);
+void      compiledRetain(Compiled* c);
+void      compiledRelease(Compiled* c);
+
+ProgramCache* cacheCreate(size_t limitBytes);
+void          cacheDestroy(ProgramCache* cache);
+Compiled*     cacheCompile(ProgramCache* cache, const char* programText, size_t length, const InterpOptions* opts, Diagnostic* err);
+void          cacheGetStats(ProgramCache* cache, CacheStats* stats);
+uint64_t      hashBytes(const void* data, size_t length);
+
+int       isCompiledImage(const char* data, size_t length);
+int       writeCompiled(const Compiled* c, const char* path);
+Compiled* loadCompiled(const char* data, size_t length, const InterpOptions* opts);
+
+void      initOptions(InterpOptions* opts);
+Interp*   interpCreate(const InterpOptions* opts);
+ErrorCode interpRun(Interp* interp, const char* programText, size_t length);
+ErrorCode interpRunCompiled(Interp* interp, const Compiled* c);
+void      interpDestroy(Interp* interp);
+char*     interpTakeOutput(Interp* interp, size_t* length);
+int       runBatch(const char* manifestPath, int threads, const InterpOptions* opts);
+
+ErrorCode interpretSource(const char* programText, size_t length, const InterpOptions* opts);
+ErrorCode interpretWith(const char* programText, const InterpOptions* opts);
+ErrorCode interpret(const char* programText);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,431 @@
+#include "numeric.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+** Program output is formatted straight into one large buffer and written to
+** fd 1 in bulk. The policy decides when that happens besides the buffer
+** filling up: OUT_FLUSH_LINE after every line, OUT_FLUSH_FULL only when full
+** or through outputFlush, and OUT_FLUSH_AUTO picks LINE for a terminal and
+** FULL otherwise. Prompts and errors flush first, so output, prompts and
+** diagnostics always appear in program order. Interrupted writes are
+** retried; once a write fails nothing more is written, and the run stops
+** with an error at the next refill of the buffer or at its end.
+*/
+
+#define OUT_BUFFER_SIZE 65536
+#define OUT_VALUE_MAX   24
+
+static const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Appends to the captured output that interpTakeOutput hands out. */
+static void outputCapture(Interp* interp, const char* text, size_t len)
+{
+    Output* out = &interp->out;
+
+    if (len == 0)
+        return;
+    if (out->capturedLen + len > out->capturedCap)
+    {
+        size_t cap = out->capturedCap ? out->capturedCap : 256;
+        while (cap < out->capturedLen + len)
+            cap *= 2;
+        char* grown = (char*)realloc(out->captured, cap);
+        if (!grown)
+            reportError(ERR_NO_MEMORY, "Out of memory");
+        out->captured    = grown;
+        out->capturedCap = cap;
+    }
+    memcpy(out->captured + out->capturedLen, text, len);
+    out->capturedLen += len;
+}
+
+char* interpTakeOutput(Interp* interp, size_t* length)
+{
+    char* text = interp->out.captured;
+
+    *length                 = interp->out.capturedLen;
+    interp->out.captured    = NULL;
+    interp->out.capturedLen = 0;
+    interp->out.capturedCap = 0;
+    return text;
+}
+
+void outputInit(Interp* interp, OutFlush policy)
+{
+    if (policy == OUT_FLUSH_AUTO)
+        policy = isatty(STDOUT_FILENO) ? OUT_FLUSH_LINE : OUT_FLUSH_FULL;
+    interp->out.policy = policy;
+    interp->out.len    = 0;
+    interp->out.failed = 0;
+}
+
+/* Writes all of text to fd 1 unless an earlier write failed. */
+static void outputWrite(Output* out, const char* text, size_t len)
+{
+    while (len > 0 && !out->failed)
+    {
+        ssize_t n = write(STDOUT_FILENO, text, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            out->failed = 1;
+        else
+        {
+            text += n;
+            len -= (size_t)n;
+        }
+    }
+}
+
+/* Never reports the failure itself: it also runs in cleanups and on the way out of an error. */
+void outputFlush(Interp* interp)
+{
+    Output* out = &interp->out;
+
+    if (interp->opts.captureOutput)
+        outputCapture(interp, out->buf, out->len);
+    else
+        outputWrite(out, out->buf, out->len);
+    out->len = 0;
+}
+
+void outputCheck(Interp* interp)
+{
+    if (interp->out.failed)
+        reportError(ERR_SYSTEM, "Cannot write output");
+}
+
+/* Flushes and gives the buffer back; the next write allocates it again. */
+void outputRelease(Interp* interp)
+{
+    outputFlush(interp);
+    free(interp->out.buf);
+    interp->out.buf = NULL;
+}
+
+/* Room for len more bytes, flushing or allocating the buffer as needed. */
+static char* outputReserve(Interp* interp, size_t len)
+{
+    Output* out = &interp->out;
+
+    if (!out->buf)
+    {
+        out->buf = (char*)malloc(OUT_BUFFER_SIZE);
+        if (!out->buf)
+            reportError(ERR_NO_MEMORY, "Out of memory");
+    }
+    if (out->len + len > OUT_BUFFER_SIZE)
+    {
+        outputFlush(interp);
+        outputCheck(interp);
+    }
+    return out->buf + out->len;
+}
+
+void outputText(Interp* interp, const char* text)
+{
+    size_t len = strlen(text);
+
+    if (len > OUT_BUFFER_SIZE)
+    {
+        outputFlush(interp);
+        if (interp->opts.captureOutput)
+        {
+            outputCapture(interp, text, len);
+            return;
+        }
+        outputWrite(&interp->out, text, len);
+        outputCheck(interp);
+        return;
+    }
+    memcpy(outputReserve(interp, len), text, len);
+    interp->out.len += len;
+    if (interp->out.policy == OUT_FLUSH_LINE)
+    {
+        outputFlush(interp);
+        outputCheck(interp);
+    }
+}
+
+/* Writes v right-aligned ending at end, two digits per step; returns the start. */
+static char* formatValue(char* end, Value v)
+{
+    uint64_t mag = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+
+    while (mag >= 100)
+    {
+        const char* pair = digitPairs + (mag % 100) * 2;
+        mag /= 100;
+        *--end = pair[1];
+        *--end = pair[0];
+    }
+    if (mag >= 10)
+    {
+        *--end = digitPairs[mag * 2 + 1];
+        *--end = digitPairs[mag * 2];
+    }
+    else
+        *--end = (char)('0' + mag);
+    if (v < 0)
+        *--end = '-';
+    return end;
+}
+
+void printValue(Interp* interp, Value v)
+{
+    char  tmp[OUT_VALUE_MAX];
+    char* end = tmp + sizeof(tmp);
+
+    *--end = '\n';
+    char*  start = formatValue(end, v);
+    size_t len   = (size_t)(tmp + sizeof(tmp) - start);
+
+    memcpy(outputReserve(interp, len), start, len);
+    interp->out.len += len;
+    if (interp->out.policy == OUT_FLUSH_LINE)
+    {
+        outputFlush(interp);
+        outputCheck(interp);
+    }
+}
+
+/*
+** Program sources are mapped read-only and run in place; only pipes and
+** terminals, which cannot be mapped, are read into a growing buffer.
+*/
+int loadSource(const char* path, Source* src)
+{
+    struct stat st;
+    int         fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+
+    ft_memset(src, 0, sizeof(Source));
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            src->text   = (char*)map;
+            src->length = (size_t)st.st_size;
+            src->mapped = 1;
+            if (fd != STDIN_FILENO)
+                close(fd);
+            return 1;
+        }
+    }
+
+    size_t  cap = 0;
+    ssize_t n   = 1;
+    while (n > 0)
+    {
+        if (src->length == cap)
+        {
+            cap       = cap ? cap * 2 : 65536;
+            char* buf = (char*)realloc(src->text, cap);
+            if (!buf)
+                break;
+            src->text = buf;
+        }
+        n = read(fd, src->text + src->length, cap - src->length);
+        if (n > 0)
+            src->length += (size_t)n;
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+    if (n != 0)
+    {
+        free(src->text);
+        src->text = NULL;
+    }
+    return n == 0;
+}
+
+void unloadSource(Source* src)
+{
+    if (src->mapped)
+        munmap(src->text, src->length);
+    else
+        free(src->text);
+    ft_memset(src, 0, sizeof(Source));
+}
+
+/*
+** Input side. Text sources keep a [cur, end) window that is either the
+** whole mapped file or the current block read from the descriptor;
+** integers are parsed by hand from that window, so no stdio (and none of
+** its locking) is involved.
+*/
+
+#define IN_BLOCK_SIZE 65536
+
+/*
+** An instance keeps its reader between runs as long as the source stays the
+** same, so read-ahead from a pipe carries over to the next program instead
+** of being lost; inputClose drops it.
+*/
+void inputInit(Interp* interp, const InputSource* src)
+{
+    Input*      in = &interp->in;
+    struct stat st;
+
+    if (in->open && src && src->kind == INPUT_FD && in->src.kind == INPUT_FD
+        && src->fd == in->src.fd)
+    {
+        in->src.prompt = src->prompt;
+        in->src.onEof  = src->onEof;
+        return;
+    }
+    inputClose(interp);
+    in->open = 1;
+    if (src)
+        in->src = *src;
+    else
+    {
+        in->src.kind   = INPUT_FD;
+        in->src.fd     = STDIN_FILENO;
+        in->src.prompt = 1;
+    }
+    if (in->src.kind != INPUT_FD || fstat(in->src.fd, &st) != 0
+        || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return;
+
+    off_t at  = lseek(in->src.fd, 0, SEEK_CUR);
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, in->src.fd, 0);
+    if (map == MAP_FAILED)
+        return;
+    in->map    = (char*)map;
+    in->mapLen = (size_t)st.st_size;
+    in->cur    = in->map + (at > 0 && at <= st.st_size ? at : 0);
+    in->end    = in->map + in->mapLen;
+    in->done   = 1;
+}
+
+/* Gives unread input back to the descriptor so a later program can read it. */
+void inputClose(Interp* interp)
+{
+    Input* in = &interp->in;
+
+    if (!in->open)
+        return;
+    if (in->map)
+    {
+        lseek(in->src.fd, (off_t)(in->cur - in->map), SEEK_SET);
+        munmap(in->map, in->mapLen);
+    }
+    else if (in->src.kind == INPUT_FD && in->cur != in->end)
+        lseek(in->src.fd, -(off_t)(in->end - in->cur), SEEK_CUR);
+    free(in->block);
+    ft_memset(in, 0, sizeof(Input));
+}
+
+/* Next byte of a text source, or -1 at the end of input. */
+static int inputByte(Input* in)
+{
+    while (in->cur == in->end)
+    {
+        if (in->done)
+            return -1;
+        if (!in->block)
+        {
+            in->block = (char*)malloc(IN_BLOCK_SIZE);
+            if (!in->block)
+                reportError(ERR_NO_MEMORY, "Out of memory");
+        }
+        ssize_t n = read(in->src.fd, in->block, IN_BLOCK_SIZE);
+        if (n <= 0)
+        {
+            in->done = 1;
+            return -1;
+        }
+        in->cur = in->block;
+        in->end = in->block + n;
+    }
+    return (unsigned char)*in->cur++;
+}
+
+/*
+** Parses [+-]digits after optional whitespace into *out, wrapping modulo
+** 2^64; *wide is set when the text does not fit in 64 bits, which only
+** matters to NUM_CHECKED. Returns 0 at the end of input and -1 for anything
+** that is not a number.
+*/
+static int parseInteger(Input* in, Value* out, int* wide)
+{
+    int      c   = inputByte(in);
+    int      neg = 0;
+    uint64_t mag = 0;
+
+    while (c >= 0 && ft_isspace((char)c))
+        c = inputByte(in);
+    if (c < 0)
+        return 0;
+    if (c == '-' || c == '+')
+    {
+        neg = c == '-';
+        c   = inputByte(in);
+    }
+    if (c < 0 || !ft_isdigit(c))
+        return -1;
+    *wide = 0;
+    while (c >= 0 && ft_isdigit(c))
+    {
+        if (mag > (UINT64_MAX - 9) / 10)
+            *wide = 1;
+        mag = mag * 10 + (uint64_t)(c - '0');
+        c   = inputByte(in);
+    }
+    if (c >= 0)
+        in->cur--;
+    if (mag > (uint64_t)INT64_MAX + (uint64_t)neg)
+        *wide = 1;
+    *out = (Value)(neg ? 0 - mag : mag);
+    return 1;
+}
+
+/* Input is read at full width and then narrowed the way arithmetic would be. */
+Value readValue(Interp* interp, int slot, NumMode mode)
+{
+    Input* in   = &interp->in;
+    Value  val  = 0;
+    int    wide = 0;
+    int    got;
+
+    if (in->src.prompt)
+    {
+        const SlotNames* names = interp->names;
+        outputText(interp, "Input for variable '");
+        outputText(interp, names && slot < names->count ? names->names[slot] : "?");
+        outputText(interp, "': ");
+        outputFlush(interp);
+    }
+    if (in->src.kind == INPUT_MEMORY)
+    {
+        got = in->next < in->src.count;
+        if (got)
+            val = in->src.values[in->next++];
+    }
+    else
+        got = parseInteger(in, &val, &wide);
+
+    if (got < 0)
+        reportError(ERR_INPUT, "Invalid input");
+    if (got == 0)
+    {
+        if (in->src.onEof == EOF_ERROR)
+            reportError(ERR_EOF, "Unexpected end of input");
+        return 0;
+    }
+    if (mode == NUM_INT64)
+        return val;
+    if (mode == NUM_CHECKED && (wide || val < INT32_MIN || val > INT32_MAX))
+        numFail(NUM_OVERFLOW);
+    return numWrap32((uint64_t)val);
+}
@@ -0,0 +1,558 @@
+#include "numeric.h"
+
+#ifdef JIT_SUPPORTED
+# include <sys/mman.h>
+
+/*
+** Template JIT for while loops. Each loop region of the bytecode becomes a
+** native function void fn(Value* variables, void* ctx): rbx pins the variable
+** frame, r12 holds ctx (the running Interp) for runtime calls, rax caches the
+** top of the operand stack and deeper entries live on the machine stack.
+** Loops that use anything the translator does not understand stay with the
+** VM.
+**
+** The int32 modes compute in eax and sign-extend on every store, NUM_INT64
+** uses the REX.W forms of the same instructions and NUM_CHECKED follows each
+** add, sub and imul with a jo to the overflow stub.
+*/
+
+# define LABEL_EXIT          -1
+# define LABEL_FAIL_DIV      -2
+# define LABEL_FAIL_MOD      -3
+# define LABEL_FAIL_OVERFLOW -4
+
+typedef struct
+{
+    unsigned char* buf;
+    size_t         len;
+    size_t         cap;
+    int            ok;
+} Emitter;
+
+typedef struct
+{
+    size_t at;
+    int    target;
+} Fixup;
+
+static void jitPrint(void* ctx, Value val)
+{
+    printValue((Interp*)ctx, val);
+}
+
+static Value jitRead(void* ctx, int slot, int mode)
+{
+    return readValue((Interp*)ctx, slot, (NumMode)mode);
+}
+
+static Value jitPower(Value base, Value exp, int mode)
+{
+    return numEval((NumMode)mode, N_POW - N_ADD, base, exp);
+}
+
+static void jitFail(void* ctx, int status)
+{
+    (void)ctx;
+    numFail((NumStatus)status);
+}
+
+static void emit8(Emitter* e, int byte)
+{
+    if (e->len >= e->cap)
+    {
+        e->ok = 0;
+        return;
+    }
+    e->buf[e->len++] = (unsigned char)byte;
+}
+
+static void emitBytes(Emitter* e, const char* bytes, int n)
+{
+    for (int i = 0; i < n; i++)
+        emit8(e, (unsigned char)bytes[i]);
+}
+
+static void emit32(Emitter* e, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        emit8(e, (v >> (8 * i)) & 0xFF);
+}
+
+static void emit64(Emitter* e, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        emit8(e, (v >> (8 * i)) & 0xFF);
+}
+
+/* REX.W prefix for the 64-bit form of the next instruction. */
+static void emitWide(Emitter* e, int wide)
+{
+    if (wide)
+        emit8(e, 0x48);
+}
+
+/* ModRM + displacement for [rbx + slot * 8] with the given reg field. */
+static void emitVar(Emitter* e, int reg, int slot)
+{
+    int disp = slot * (int)sizeof(Value);
+
+    if (disp < 128)
+    {
+        emit8(e, 0x43 | (reg << 3));
+        emit8(e, disp);
+    }
+    else
+    {
+        emit8(e, 0x83 | (reg << 3));
+        emit32(e, (uint32_t)disp);
+    }
+}
+
+static void emitCall(Emitter* e, void* fn)
+{
+    emitBytes(e, "\x48\xB8", 2);
+    emit64(e, (uint64_t)(uintptr_t)fn);
+    emitBytes(e, "\xFF\xD0", 2);
+}
+
+static void emitJump(Emitter* e, const char* opcode, int n, Fixup* fixups, int* fixupCount, int target)
+{
+    emitBytes(e, opcode, n);
+    fixups[*fixupCount].at     = e->len;
+    fixups[*fixupCount].target = target;
+    (*fixupCount)++;
+    emit32(e, 0);
+}
+
+static void emitFailStub(Emitter* e, int code)
+{
+    emitBytes(e, "\x4C\x89\xE7", 3);
+    emit8(e, 0xBE);
+    emit32(e, (uint32_t)code);
+    emitBytes(e, "\x48\x83\xE4\xF0", 4);
+    emitCall(e, (void*)jitFail);
+    emitBytes(e, "\x0F\x0B", 2);
+}
+
+/* The mode-independent arithmetic operator (0..5) of op, or -1. */
+static int arithOf(const Bytecode* bc, int op)
+{
+    int first = OP_ADD + bc->mode * ARITH_OPS;
+
+    if (op < first || op >= first + ARITH_OPS)
+        return -1;
+    return op - first;
+}
+
+static int fitsImm32(Value v)
+{
+    return v >= INT32_MIN && v <= INT32_MAX;
+}
+
+/* Short forward jump whose rel8 is filled in by endShort. */
+static size_t beginShort(Emitter* e, int opcode)
+{
+    emit8(e, opcode);
+    emit8(e, 0);
+    return e->len;
+}
+
+static void endShort(Emitter* e, size_t from)
+{
+    if (e->ok)
+        e->buf[from - 1] = (unsigned char)(e->len - from);
+}
+
+static void emitOverflowCheck(Emitter* e, int checked, Fixup* fixups, int* fixupCount)
+{
+    if (checked)
+        emitJump(e, "\x0F\x80", 2, fixups, fixupCount, LABEL_FAIL_OVERFLOW);
+}
+
+static int compileLoop(Emitter* e, const Bytecode* bc, const LoopInfo* loop,
+    size_t* nativeAt, Fixup* fixups)
+{
+    const int* code       = bc->code;
+    int        wide       = bc->mode == NUM_INT64;
+    int        checked    = bc->mode == NUM_CHECKED;
+    int        fixupCount = 0;
+    int        depth      = 0;
+    int        pc         = loop->start;
+    size_t     exitAt, divAt, modAt, overflowAt;
+
+    /* push rbp; mov rbp, rsp; push rbx; push r12; mov rbx, rdi; mov r12, rsi */
+    emitBytes(e, "\x55\x48\x89\xE5\x53\x41\x54\x48\x89\xFB\x49\x89\xF4", 13);
+
+    while (pc < loop->end)
+    {
+        int op    = code[pc];
+        int arith = arithOf(bc, op);
+        nativeAt[pc] = e->len;
+
+        if ((op == OP_PUSH || op == OP_LOAD) && pc + 2 < loop->end && depth > 0
+            && arithOf(bc, code[pc + 2]) >= 0 && arithOf(bc, code[pc + 2]) <= 2
+            && (op == OP_LOAD || fitsImm32(bc->consts[code[pc + 1]])))
+        {
+            int next = arithOf(bc, code[pc + 2]);
+            emitWide(e, wide);
+            if (op == OP_PUSH)
+            {
+                if (next == 0)
+                    emit8(e, 0x05);
+                else if (next == 1)
+                    emit8(e, 0x2D);
+                else
+                    emitBytes(e, "\x69\xC0", 2);
+                emit32(e, (uint32_t)bc->consts[code[pc + 1]]);
+            }
+            else
+            {
+                if (next == 0)
+                    emit8(e, 0x03);
+                else if (next == 1)
+                    emit8(e, 0x2B);
+                else
+                    emitBytes(e, "\x0F\xAF", 2);
+                emitVar(e, 0, code[pc + 1]);
+            }
+            emitOverflowCheck(e, checked, fixups, &fixupCount);
+            nativeAt[pc + 2] = e->len;
+            pc += 3;
+            continue;
+        }
+
+        if (arith >= 0)
+        {
+            if (depth < 2)
+                return 0;
+            switch (arith)
+            {
+                case 0:
+                    /* pop rcx; add eax, ecx */
+                    emit8(e, 0x59);
+                    emitWide(e, wide);
+                    emitBytes(e, "\x01\xC8", 2);
+                    emitOverflowCheck(e, checked, fixups, &fixupCount);
+                    break;
+
+                case 1:
+                    /* pop rcx; sub ecx, eax; mov eax, ecx */
+                    emit8(e, 0x59);
+                    emitWide(e, wide);
+                    emitBytes(e, "\x29\xC1", 2);
+                    emitOverflowCheck(e, checked, fixups, &fixupCount);
+                    emitWide(e, wide);
+                    emitBytes(e, "\x89\xC8", 2);
+                    break;
+
+                case 2:
+                    /* pop rcx; imul eax, ecx */
+                    emit8(e, 0x59);
+                    emitWide(e, wide);
+                    emitBytes(e, "\x0F\xAF\xC1", 3);
+                    emitOverflowCheck(e, checked, fixups, &fixupCount);
+                    break;
+
+                case 3:
+                case 4:
+                {
+                    /* mov ecx, eax; pop rax; test ecx, ecx; jz fail; cmp ecx, -1; jne normal */
+                    emitWide(e, wide);
+                    emitBytes(e, "\x89\xC1\x58", 3);
+                    emitWide(e, wide);
+                    emitBytes(e, "\x85\xC9", 2);
+                    emitJump(e, "\x0F\x84", 2, fixups, &fixupCount,
+                        arith == 3 ? LABEL_FAIL_DIV : LABEL_FAIL_MOD);
+                    emitWide(e, wide);
+                    emitBytes(e, "\x83\xF9\xFF", 3);
+                    size_t toNormal = beginShort(e, 0x75);
+                    if (arith == 3 || checked)
+                    {
+                        /* neg eax, which only overflows for the minimum value;
+                        ** checked modulo uses it to reject that value too */
+                        emitWide(e, wide);
+                        emitBytes(e, "\xF7\xD8", 2);
+                        emitOverflowCheck(e, checked, fixups, &fixupCount);
+                    }
+                    if (arith == 4)
+                        emitBytes(e, "\x31\xC0", 2);
+                    size_t toDone = beginShort(e, 0xEB);
+                    endShort(e, toNormal);
+                    /* cdq; idiv ecx (cqo; idiv rcx when wide) */
+                    emitWide(e, wide);
+                    emit8(e, 0x99);
+                    emitWide(e, wide);
+                    emitBytes(e, "\xF7\xF9", 2);
+                    if (arith == 4)
+                    {
+                        emitWide(e, wide);
+                        emitBytes(e, "\x89\xD0", 2);
+                    }
+                    endShort(e, toDone);
+                }
+                break;
+
+                default:
+                    /* Sign-extend the exponent into rsi, pop the base into rdi
+                    ** and call jitPower with the stack realigned to 16 bytes. */
+                    if (wide)
+                        emitBytes(e, "\x48\x89\xC6", 3);
+                    else
+                        emitBytes(e, "\x48\x63\xF0", 3);
+                    emit8(e, 0x5F);
+                    if (!wide)
+                        emitBytes(e, "\x48\x63\xFF", 3);
+                    emit8(e, 0xBA);
+                    emit32(e, (uint32_t)bc->mode);
+                    if (depth % 2)
+                        emitBytes(e, "\x48\x83\xEC\x08", 4);
+                    emitCall(e, (void*)jitPower);
+                    if (depth % 2)
+                        emitBytes(e, "\x48\x83\xC4\x08", 4);
+                    break;
+            }
+            depth--;
+            pc++;
+            if (!e->ok)
+                return 0;
+            continue;
+        }
+
+        switch (op)
+        {
+            case OP_PUSH:
+            {
+                Value k = bc->consts[code[pc + 1]];
+                if (depth > 0)
+                    emit8(e, 0x50);
+                if (!wide)
+                {
+                    emit8(e, 0xB8);
+                    emit32(e, (uint32_t)k);
+                }
+                else if (fitsImm32(k))
+                {
+                    emitBytes(e, "\x48\xC7\xC0", 3);
+                    emit32(e, (uint32_t)k);
+                }
+                else
+                {
+                    emitBytes(e, "\x48\xB8", 2);
+                    emit64(e, (uint64_t)k);
+                }
+                depth++;
+                pc += 2;
+            }
+            break;
+
+            case OP_LOAD:
+                if (depth > 0)
+                    emit8(e, 0x50);
+                emitWide(e, wide);
+                emit8(e, 0x8B);
+                emitVar(e, 0, code[pc + 1]);
+                depth++;
+                pc += 2;
+                break;
+
+            case OP_STORE:
+                /* cdqe; mov [rbx + slot], rax */
+                if (!wide)
+                    emitBytes(e, "\x48\x98", 2);
+                emitBytes(e, "\x48\x89", 2);
+                emitVar(e, 0, code[pc + 1]);
+                if (--depth > 0)
+                    emit8(e, 0x58);
+                pc += 2;
+                break;
+
+            case OP_JZ:
+            case OP_JNZ:
+                if (depth != 1)
+                    return 0;
+                emitWide(e, wide);
+                emitBytes(e, "\x85\xC0", 2);
+                emitJump(e, op == OP_JZ ? "\x0F\x84" : "\x0F\x85", 2, fixups, &fixupCount,
+                    code[pc + 1] == loop->end ? LABEL_EXIT : code[pc + 1]);
+                depth = 0;
+                pc += 2;
+                break;
+
+            case OP_JMP:
+                if (depth != 0)
+                    return 0;
+                emitJump(e, "\xE9", 1, fixups, &fixupCount,
+                    code[pc + 1] == loop->end ? LABEL_EXIT : code[pc + 1]);
+                pc += 2;
+                break;
+
+            case OP_PRINT:
+                if (depth != 1)
+                    return 0;
+                /* movsxd rsi, eax (mov rsi, rax when wide); mov rdi, r12 */
+                emitBytes(e, wide ? "\x48\x89\xC6" : "\x48\x63\xF0", 3);
+                emitBytes(e, "\x4C\x89\xE7", 3);
+                emitCall(e, (void*)jitPrint);
+                depth = 0;
+                pc++;
+                break;
+
+            case OP_READ:
+                if (depth != 0)
+                    return 0;
+                emitBytes(e, "\x4C\x89\xE7", 3);
+                emit8(e, 0xBE);
+                emit32(e, (uint32_t)code[pc + 1]);
+                emit8(e, 0xBA);
+                emit32(e, (uint32_t)bc->mode);
+                emitCall(e, (void*)jitRead);
+                emitBytes(e, "\x48\x89", 2);
+                emitVar(e, 0, code[pc + 1]);
+                pc += 2;
+                break;
+
+            case OP_LOOP:
+                pc += 2;
+                break;
+
+            case OP_SUMMARY:
+                if (depth != 0)
+                    return 0;
+                /* mov rdi, summary; mov rsi, rbx; call applySummary; test eax, eax; jnz end */
+                emitBytes(e, "\x48\xBF", 2);
+                emit64(e, (uint64_t)(uintptr_t)&bc->summaries[code[pc + 1]]);
+                emitBytes(e, "\x48\x89\xDE", 3);
+                emitCall(e, (void*)applySummary);
+                emitBytes(e, "\x85\xC0", 2);
+                emitJump(e, "\x0F\x85", 2, fixups, &fixupCount,
+                    code[pc + 2] == loop->end ? LABEL_EXIT : code[pc + 2]);
+                pc += 3;
+                break;
+
+            default:
+                return 0;
+        }
+        if (!e->ok)
+            return 0;
+    }
+
+    /* lea rsp, [rbp - 16]; pop r12; pop rbx; pop rbp; ret */
+    exitAt = e->len;
+    emitBytes(e, "\x48\x8D\x65\xF0\x41\x5C\x5B\x5D\xC3", 9);
+    divAt = e->len;
+    emitFailStub(e, NUM_DIV_ZERO);
+    modAt = e->len;
+    emitFailStub(e, NUM_MOD_ZERO);
+    overflowAt = e->len;
+    emitFailStub(e, NUM_OVERFLOW);
+    if (!e->ok)
+        return 0;
+
+    for (int i = 0; i < fixupCount; i++)
+    {
+        size_t target;
+        int    t = fixups[i].target;
+
+        if (t == LABEL_EXIT)
+            target = exitAt;
+        else if (t == LABEL_FAIL_DIV)
+            target = divAt;
+        else if (t == LABEL_FAIL_MOD)
+            target = modAt;
+        else if (t == LABEL_FAIL_OVERFLOW)
+            target = overflowAt;
+        else if (t >= loop->start && t < loop->end)
+            target = nativeAt[t];
+        else
+            return 0;
+        int32_t rel = (int32_t)((int64_t)target - (int64_t)(fixups[i].at + 4));
+        for (int b = 0; b < 4; b++)
+            e->buf[fixups[i].at + b] = ((uint32_t)rel >> (8 * b)) & 0xFF;
+    }
+    return 1;
+}
+
+int jitCompile(const Bytecode* bc, JitCode* jit)
+{
+    Emitter e;
+    size_t  page = 4096;
+    int     coveredUntil = 0;
+
+    ft_memset(jit, 0, sizeof(JitCode));
+    if (bc->loopCount == 0)
+        return 0;
+
+    jit->size = ((size_t)bc->codeLen * 48 + (size_t)bc->loopCount * 128 + page) & ~(page - 1);
+    jit->mem  = (unsigned char*)mmap(NULL, jit->size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->mem == MAP_FAILED)
+    {
+        jit->mem = NULL;
+        return 0;
+    }
+    jit->entries = (JitFn*)calloc(bc->loopCount, sizeof(JitFn));
+    size_t* nativeAt = (size_t*)malloc(sizeof(size_t) * (bc->codeLen + 1));
+    Fixup*  fixups   = (Fixup*)malloc(sizeof(Fixup) * (bc->codeLen * 2 + 1));
+    if (!jit->entries || !nativeAt || !fixups)
+    {
+        free(nativeAt);
+        free(fixups);
+        jitFree(jit);
+        return 0;
+    }
+
+    e.buf = jit->mem;
+    e.len = 0;
+    e.cap = jit->size;
+    for (int i = 0; i < bc->loopCount; i++)
+    {
+        const LoopInfo* loop = &bc->loops[i];
+        size_t          mark = e.len;
+
+        /* Inner loops are already part of an enclosing native loop. */
+        if (loop->start < coveredUntil)
+            continue;
+        e.ok = 1;
+        if (compileLoop(&e, bc, loop, nativeAt, fixups))
+        {
+            jit->entries[i] = (JitFn)(void*)(jit->mem + mark);
+            jit->compiled++;
+            coveredUntil = loop->end;
+        }
+        else
+            e.len = mark;
+    }
+    free(nativeAt);
+    free(fixups);
+
+    if (jit->compiled == 0 || mprotect(jit->mem, jit->size, PROT_READ | PROT_EXEC) != 0)
+    {
+        jitFree(jit);
+        return 0;
+    }
+    return jit->compiled;
+}
+
+void jitFree(JitCode* jit)
+{
+    if (jit->mem)
+        munmap(jit->mem, jit->size);
+    free(jit->entries);
+    ft_memset(jit, 0, sizeof(JitCode));
+}
+
+#else
+
+int jitCompile(const Bytecode* bc, JitCode* jit)
+{
+    (void)bc;
+    ft_memset(jit, 0, sizeof(JitCode));
+    return 0;
+}
+
+void jitFree(JitCode* jit)
+{
+    ft_memset(jit, 0, sizeof(JitCode));
+}
+
+#endif
@@ -0,0 +1,219 @@
+#include "interpreter.h"
+
+#if defined(__SSE2__) && !defined(LEX_NO_SIMD)
+# include <emmintrin.h>
+# define LEX_SSE2 1
+#endif
+
+/*
+** Table-driven lexer. Every byte is classified by one lookup in lexClass:
+** punctuation maps straight to its TokenType, letters and '_' to T_ID,
+** digits to T_NUM and the ft_isspace characters to LEX_SPACE. Names and
+** numbers are runs of letters, digits and '_' (word bytes); everything else
+** is a token of one byte. With SSE2 (every x86-64) token starts are found
+** 16 bytes at a time; elsewhere, or when built with -DLEX_NO_SIMD, byte by
+** byte.
+*/
+
+#define LEX_SPACE (T_UNKNOWN + 1)
+
+#define S_  LEX_SPACE
+#define U_  T_UNKNOWN
+#define I_  T_ID
+#define N_  T_NUM
+
+static const unsigned char lexClass[256] = {
+    /* 0x00 */ U_, U_, U_, U_, U_, U_, U_, U_, U_, S_, S_, S_, S_, S_, U_, U_,
+    /* 0x10 */ U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+    /*  !"#$%&'()*+,-./ */
+    S_, U_, U_, U_, U_, T_MOD, U_, U_, T_LPAREN, T_RPAREN, T_STAR, T_PLUS, U_, T_MINUS, T_DOT, T_SLASH,
+    /* 0123456789:;<=>? */
+    N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, T_COLON, T_SEMI, T_LT, T_ASSIGN, T_GT, T_QUESTION,
+    /* @ABCDEFGHIJKLMNO */
+    U_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_,
+    /* PQRSTUVWXYZ[\]^_ */
+    I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, T_LBRACKET, U_, T_RBRACKET, T_CARET, I_,
+    /* `abcdefghijklmno */
+    U_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_,
+    /* pqrstuvwxyz{|}~  */
+    I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, I_, T_LBRACE, U_, T_RBRACE, U_, U_,
+    /* 0x80 - 0xFF */
+    U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+    U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+    U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+    U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+    U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+    U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+    U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+    U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+};
+
+#undef S_
+#undef U_
+#undef I_
+#undef N_
+
+static int isWord(unsigned char c)
+{
+    return lexClass[c] <= T_NUM;
+}
+
+#ifdef LEX_SSE2
+/* c <= limit as unsigned bytes, lane by lane. */
+static __m128i atMost(__m128i c, char limit)
+{
+    const __m128i top = _mm_set1_epi8(limit);
+
+    return _mm_cmpeq_epi8(_mm_max_epu8(c, top), top);
+}
+
+/*
+** Bit i of *solid is set when text[i] is not whitespace, and of *word when
+** it is a letter, digit or '_'.
+*/
+static void blockMasks(const unsigned char* text, unsigned* solid, unsigned* word)
+{
+    __m128i block = _mm_loadu_si128((const __m128i*)text);
+
+    /* '\t'..'\r' are the bytes whose distance from '\t' is at most 4 unsigned. */
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')),
+        atMost(_mm_sub_epi8(block, _mm_set1_epi8('\t')), 4));
+    __m128i digit  = atMost(_mm_sub_epi8(block, _mm_set1_epi8('0')), 9);
+    __m128i letter = atMost(_mm_sub_epi8(_mm_or_si128(block, _mm_set1_epi8(0x20)), _mm_set1_epi8('a')), 25);
+    __m128i under  = _mm_cmpeq_epi8(block, _mm_set1_epi8('_'));
+
+    *solid = (unsigned)_mm_movemask_epi8(space) ^ 0xFFFFu;
+    *word  = (unsigned)_mm_movemask_epi8(_mm_or_si128(digit, _mm_or_si128(letter, under)));
+}
+#endif
+
+/*
+** Sizes the list: the tokens, and how many of them are names or numbers
+** longer than one byte. A token starts at every byte that is not
+** whitespace and not a word byte following another; a long one is counted
+** at its second byte. Bit 1 of prev says whether the byte before was a
+** word byte, bit 0 the one before that.
+*/
+static size_t countTokens(const unsigned char* text, size_t length, size_t* longWords)
+{
+    size_t   count = 0;
+    size_t   longs = 0;
+    size_t   at    = 0;
+    unsigned prev  = 0;
+
+#ifdef LEX_SSE2
+    for (; at + 16 <= length; at += 16)
+    {
+        unsigned solid, word;
+        blockMasks(text + at, &solid, &word);
+        unsigned after1 = ((word << 1) | (prev >> 1)) & 0xFFFFu;
+        unsigned after2 = ((word << 2) | prev) & 0xFFFFu;
+        count += (size_t)__builtin_popcount(solid & ~(word & after1));
+        longs += (size_t)__builtin_popcount(word & after1 & ~after2);
+        prev = word >> 14;
+    }
+#endif
+    for (; at < length; at++)
+    {
+        unsigned word = isWord(text[at]);
+        count += lexClass[text[at]] != LEX_SPACE && !(word && (prev & 2));
+        longs += word && (prev & 2) && !(prev & 1);
+        prev = (prev >> 1) | (word << 1);
+    }
+    *longWords = longs;
+    return count;
+}
+
+/* A one-byte token keeps its character; a longer name or number keeps 0 and its offset. */
+static void storeToken(TokenList* list, const unsigned char* text, size_t at, int isLong)
+{
+    size_t n = list->count++;
+
+    if (n % TOKEN_MARK_STRIDE == 0)
+        list->marks[n / TOKEN_MARK_STRIDE] = at;
+    list->types[n] = lexClass[text[at]];
+    list->chars[n] = isLong ? 0 : (char)text[at];
+    if (isLong)
+        list->words[list->wordCount++] = at;
+}
+
+/*
+** Splits the whole text into tokens. A counting pass sizes the list, which
+** then takes a single allocation: the cold marks and word offsets first,
+** then the types and characters the parser reads. With SSE2 each 16-byte
+** block yields a mask of the bytes that start tokens and both passes visit
+** only those. The list lives in arena and goes with it.
+*/
+void tokenize(const char* programText, size_t length, TokenList* list, Arena* arena)
+{
+    const unsigned char* text  = (const unsigned char*)programText;
+    size_t               longs;
+    size_t               count = countTokens(text, length, &longs) + 1;
+    size_t               marks = count / TOKEN_MARK_STRIDE + 1;
+    size_t               at    = 0;
+    unsigned             prev  = 0;
+    char*                block = (char*)arenaAlloc(arena, sizeof(size_t) * (marks + longs) + 2 * count);
+
+    list->marks     = (size_t*)block;
+    list->words     = list->marks + marks;
+    list->types     = (unsigned char*)(list->words + longs);
+    list->chars     = (char*)list->types + count;
+    list->count     = 0;
+    list->wordCount = 0;
+#ifdef LEX_SSE2
+    for (; at + 16 <= length; at += 16)
+    {
+        unsigned solid, word;
+        blockMasks(text + at, &solid, &word);
+        unsigned mask  = solid & ~(word & (((word << 1) | prev) & 0xFFFFu));
+        unsigned next  = at + 16 < length && isWord(text[at + 16]);
+        unsigned longs = mask & word & ((word >> 1) | (next << 15));
+        while (mask)
+        {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            storeToken(list, text, at + bit, (longs >> bit) & 1);
+            mask &= mask - 1;
+        }
+        prev = word >> 15;
+    }
+#endif
+    for (; at < length; at++)
+    {
+        unsigned word = isWord(text[at]);
+        if (lexClass[text[at]] != LEX_SPACE && !(word && prev))
+            storeToken(list, text, at, word && at + 1 < length && isWord(text[at + 1]));
+        prev = word;
+    }
+    if (list->count % TOKEN_MARK_STRIDE == 0)
+        list->marks[list->count / TOKEN_MARK_STRIDE] = length;
+    list->types[list->count] = T_END;
+    list->chars[list->count] = 0;
+    list->count++;
+}
+
+/* Bytes in the token starting at at: a whole name or number, else one. */
+size_t tokenLength(const char* programText, size_t length, size_t at)
+{
+    const unsigned char* text = (const unsigned char*)programText;
+    size_t               end  = at + 1;
+
+    if (isWord(text[at]))
+        while (end < length && isWord(text[end]))
+            end++;
+    return end - at;
+}
+
+/* Where token index starts in the text, found from the nearest mark before it. */
+size_t tokenOffset(const TokenList* list, const char* programText, size_t length, size_t index)
+{
+    const unsigned char* text = (const unsigned char*)programText;
+    size_t               at   = list->marks[index / TOKEN_MARK_STRIDE];
+
+    for (size_t n = index % TOKEN_MARK_STRIDE; n > 0; n--)
+    {
+        at += tokenLength(programText, length, at);
+        while (at < length && lexClass[text[at]] == LEX_SPACE)
+            at++;
+    }
+    return at;
+}
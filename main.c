@@ -1,6 +1,14 @@
 #include "interpreter.h"
+#include <fcntl.h>
+#include <unistd.h>
 
-int main(void)
+static int usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [--engine=ast|vm] [--jit] [--num=int32|int64|checked] [--simd=auto|avx2|sse2|scalar] [--flush=auto|full|line] [--input=FILE] [--batch] [--eof=error|zero] [-O0] [--opt-stats] [--profile] [--perf] [--disasm] [--compile=OUT] [--emit-compiled=OUT] [--jobs=MANIFEST [--threads=N]] [FILE|-]...\n", name);
+    return 1;
+}
+
+int main(int argc, char** argv)
 {
     const char* interMyPreter =
         "n = 0;\n"
@@ -9,7 +17,116 @@ int main(void)
         "  n = n + 1;\n"
         "}\n"
         ".\n";
+    InterpOptions opts;
+    int           programs = 0;
+    const char*   manifest = NULL;
+    int           threads  = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    initOptions(&opts);
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0)
+            programs++;
+        else if (strcmp(argv[i], "--disasm") == 0)
+            opts.disassemble = 1;
+        else if (strcmp(argv[i], "--engine=ast") == 0)
+            opts.engine = ENGINE_AST;
+        else if (strcmp(argv[i], "--engine=vm") == 0)
+            opts.engine = ENGINE_VM;
+        else if (strcmp(argv[i], "--jit") == 0)
+            opts.jit = 1;
+        else if (strcmp(argv[i], "-O0") == 0)
+            opts.optimize = 0;
+        else if (strcmp(argv[i], "--opt-stats") == 0)
+            opts.optStats = 1;
+        else if (strcmp(argv[i], "--profile") == 0)
+            opts.profile = 1;
+        else if (strcmp(argv[i], "--perf") == 0)
+            opts.perfStats = 1;
+        else if (strcmp(argv[i], "--num=int32") == 0)
+            opts.numMode = NUM_INT32;
+        else if (strcmp(argv[i], "--num=int64") == 0)
+            opts.numMode = NUM_INT64;
+        else if (strcmp(argv[i], "--num=checked") == 0)
+            opts.numMode = NUM_CHECKED;
+        else if (strncmp(argv[i], "--simd=", 7) == 0)
+        {
+            if (!arraySelectKernels(argv[i] + 7))
+            {
+                fprintf(stderr, "%s: %s array kernels are not available\n", argv[0], argv[i] + 7);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--flush=auto") == 0)
+            opts.outFlush = OUT_FLUSH_AUTO;
+        else if (strcmp(argv[i], "--flush=full") == 0)
+            opts.outFlush = OUT_FLUSH_FULL;
+        else if (strcmp(argv[i], "--flush=line") == 0)
+            opts.outFlush = OUT_FLUSH_LINE;
+        else if (strncmp(argv[i], "--input=", 8) == 0 && argv[i][8])
+        {
+            opts.input.fd = open(argv[i] + 8, O_RDONLY);
+            if (opts.input.fd < 0)
+            {
+                fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i] + 8);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+            opts.input.prompt = 0;
+        else if (strcmp(argv[i], "--eof=error") == 0)
+            opts.input.onEof = EOF_ERROR;
+        else if (strcmp(argv[i], "--eof=zero") == 0)
+            opts.input.onEof = EOF_ZERO;
+        else if (strncmp(argv[i], "--compile=", 10) == 0 && argv[i][10])
+            opts.compileOut = argv[i] + 10;
+        else if (strncmp(argv[i], "--emit-compiled=", 16) == 0 && argv[i][16])
+            opts.emitOut = argv[i] + 16;
+        else if (strncmp(argv[i], "--jobs=", 7) == 0 && argv[i][7])
+            manifest = argv[i] + 7;
+        else if (strncmp(argv[i], "--threads=", 10) == 0 && atoi(argv[i] + 10) > 0)
+            threads = atoi(argv[i] + 10);
+        else
+            return usage(argv[0]);
+    }
+    if (opts.compileOut && opts.input.fd != 0)
+    {
+        fprintf(stderr, "%s: --input does not apply to --compile; redirect the built program's input instead\n", argv[0]);
+        return 1;
+    }
+    if (manifest)
+        return programs || opts.compileOut || opts.emitOut || opts.disassemble || opts.profile || opts.perfStats ? usage(argv[0]) : !runBatch(manifest, threads, &opts);
+    if (programs == 0)
+        return interpretWith(interMyPreter, &opts) != ERR_NONE;
+
+    /*
+    ** Every program runs on one instance with the same options, in
+    ** command-line order, so they read one input stream in turn.
+    */
+    Interp* interp = interpCreate(&opts);
+    if (!interp)
+        return 1;
+    for (int i = 1; i < argc; i++)
+    {
+        Source src;
 
-    interpret(interMyPreter);
+        if (argv[i][0] == '-' && argv[i][1])
+            continue;
+        if (!loadSource(argv[i], &src))
+        {
+            fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[i]);
+            interpDestroy(interp);
+            return 1;
+        }
+        ErrorCode code = interpRun(interp, src.text, src.length);
+        unloadSource(&src);
+        if (code != ERR_NONE)
+        {
+            printDiagnostic(&interp->error, stderr);
+            interpDestroy(interp);
+            return 1;
+        }
+    }
+    interpDestroy(interp);
     return 0;
 }
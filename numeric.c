@@ -0,0 +1,11 @@
+#include "numeric.h"
+
+void numFail(NumStatus status)
+{
+    if (status == NUM_DIV_ZERO)
+        reportError(ERR_DIV_ZERO, "Division by zero");
+    else if (status == NUM_MOD_ZERO)
+        reportError(ERR_MOD_ZERO, "Modulo by zero");
+    else
+        reportError(ERR_OVERFLOW, "Integer overflow");
+}
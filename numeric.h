@@ -0,0 +1,168 @@
+#ifndef NUMERIC_H
+# define NUMERIC_H
+
+# include "interpreter.h"
+
+/*
+** Arithmetic shared by every engine. Values are stored as int64_t; in the
+** int32 modes they always hold a sign-extended 32-bit result, so the same
+** variable array serves all widths. NUM_INT32 and NUM_INT64 wrap around,
+** NUM_CHECKED computes in 32 bits and traps on overflow through the
+** compiler's checked-arithmetic builtins.
+**
+** Division truncates, x / -1 negates with wraparound and x % -1 is 0 (both
+** overflow under NUM_CHECKED for the minimum value). Exponentiation is done
+** by squaring; a negative exponent behaves like 1 / x^n, so it yields 0 for
+** |x| > 1, +-1 for x = +-1 and a division by zero for x = 0.
+*/
+
+typedef enum
+{
+    NUM_OK,
+    NUM_DIV_ZERO,
+    NUM_MOD_ZERO,
+    NUM_OVERFLOW
+} NumStatus;
+
+void numFail(NumStatus status);
+
+static inline Value numWrap32(uint64_t v)
+{
+    return (Value)(int32_t)(uint32_t)v;
+}
+
+static inline Value numAdd32(Value a, Value b) { return numWrap32((uint64_t)a + (uint64_t)b); }
+static inline Value numSub32(Value a, Value b) { return numWrap32((uint64_t)a - (uint64_t)b); }
+static inline Value numMul32(Value a, Value b) { return numWrap32((uint64_t)a * (uint64_t)b); }
+static inline Value numAdd64(Value a, Value b) { return (Value)((uint64_t)a + (uint64_t)b); }
+static inline Value numSub64(Value a, Value b) { return (Value)((uint64_t)a - (uint64_t)b); }
+static inline Value numMul64(Value a, Value b) { return (Value)((uint64_t)a * (uint64_t)b); }
+
+static inline NumStatus numAddChecked(Value a, Value b, Value* out)
+{
+    int32_t r;
+    int     bad = __builtin_add_overflow((int32_t)a, (int32_t)b, &r);
+
+    *out = r;
+    return bad ? NUM_OVERFLOW : NUM_OK;
+}
+
+static inline NumStatus numSubChecked(Value a, Value b, Value* out)
+{
+    int32_t r;
+    int     bad = __builtin_sub_overflow((int32_t)a, (int32_t)b, &r);
+
+    *out = r;
+    return bad ? NUM_OVERFLOW : NUM_OK;
+}
+
+static inline NumStatus numMulChecked(Value a, Value b, Value* out)
+{
+    int32_t r;
+    int     bad = __builtin_mul_overflow((int32_t)a, (int32_t)b, &r);
+
+    *out = r;
+    return bad ? NUM_OVERFLOW : NUM_OK;
+}
+
+static inline NumStatus numDivide(NumMode mode, Value a, Value b, int modulo, Value* out)
+{
+    if (b == 0)
+        return modulo ? NUM_MOD_ZERO : NUM_DIV_ZERO;
+    if (b == -1)
+    {
+        if (mode == NUM_CHECKED && a == INT32_MIN)
+            return NUM_OVERFLOW;
+        if (modulo)
+            *out = 0;
+        else
+            *out = mode == NUM_INT64 ? numSub64(0, a) : numSub32(0, a);
+        return NUM_OK;
+    }
+    *out = modulo ? a % b : a / b;
+    return NUM_OK;
+}
+
+static inline NumStatus numPower(NumMode mode, Value base, Value exp, Value* out)
+{
+    if (exp < 0)
+    {
+        if (base == 0)
+            return NUM_DIV_ZERO;
+        if (base == 1 || base == -1)
+            *out = (base == -1 && (exp & 1)) ? -1 : 1;
+        else
+            *out = 0;
+        return NUM_OK;
+    }
+
+    uint64_t e = (uint64_t)exp;
+    if (mode == NUM_CHECKED)
+    {
+        int32_t r = 1;
+        int32_t b = (int32_t)base;
+        while (e)
+        {
+            if ((e & 1) && __builtin_mul_overflow(r, b, &r))
+                return NUM_OVERFLOW;
+            e >>= 1;
+            if (e && __builtin_mul_overflow(b, b, &b))
+                return NUM_OVERFLOW;
+        }
+        *out = r;
+        return NUM_OK;
+    }
+
+    uint64_t r = 1;
+    uint64_t b = (uint64_t)base;
+    while (e)
+    {
+        if (e & 1)
+            r *= b;
+        e >>= 1;
+        b *= b;
+    }
+    *out = mode == NUM_INT64 ? (Value)r : numWrap32(r);
+    return NUM_OK;
+}
+
+/* op is 0..5 for + - * / % ^, in the order of N_ADD..N_POW and OP_ADD..OP_POW. */
+static inline NumStatus numApply(NumMode mode, int op, Value a, Value b, Value* out)
+{
+    switch (op)
+    {
+        case 0:
+            if (mode == NUM_CHECKED)
+                return numAddChecked(a, b, out);
+            *out = mode == NUM_INT64 ? numAdd64(a, b) : numAdd32(a, b);
+            return NUM_OK;
+        case 1:
+            if (mode == NUM_CHECKED)
+                return numSubChecked(a, b, out);
+            *out = mode == NUM_INT64 ? numSub64(a, b) : numSub32(a, b);
+            return NUM_OK;
+        case 2:
+            if (mode == NUM_CHECKED)
+                return numMulChecked(a, b, out);
+            *out = mode == NUM_INT64 ? numMul64(a, b) : numMul32(a, b);
+            return NUM_OK;
+        case 3:
+            return numDivide(mode, a, b, 0, out);
+        case 4:
+            return numDivide(mode, a, b, 1, out);
+        default:
+            return numPower(mode, a, b, out);
+    }
+}
+
+static inline Value numEval(NumMode mode, int op, Value a, Value b)
+{
+    Value     out = 0;
+    NumStatus st  = numApply(mode, op, a, b, &out);
+
+    if (st != NUM_OK)
+        numFail(st);
+    return out;
+}
+
+#endif
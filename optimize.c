@@ -0,0 +1,433 @@
+#include "numeric.h"
+
+/*
+** AST-level clean-up run before every backend: folds constant operators,
+** drops if/while statements whose condition is a known constant and applies
+** the identities x+0, x-0, x*1, x/1, x^1, 1^x, x*0, x%1 and x^0. The last
+** four discard an operand, so they only fire when that operand cannot fail
+** (contains no /, % or ^, and no operator at all under NUM_CHECKED). Folding
+** uses the program's numeric mode and leaves anything that would fail at
+** runtime, such as division by zero or a checked overflow, for the runtime
+** to report. Finally, counting loops get closed-form summaries
+** (see summary.c) and the bounds checks of array accesses in counting loops
+** are hoisted into guards (see hoistLoop).
+*/
+
+typedef struct
+{
+    OptStats* stats;
+    NumMode   mode;
+    Arena*    arena;
+} Optimizer;
+
+static Node* optimizeBlock(Optimizer* o, Node* head);
+static Node* optimizeExpr(Optimizer* o, Node* n);
+
+/* Expressions are followed down their left edge without recursing. */
+static int countNodes(const Node* n)
+{
+    int count = 0;
+
+    for (; n; n = n->next)
+    {
+        count += 1 + countNodes(n->right) + countNodes(n->alt);
+        for (const Node* e = n->left; e; e = e->left)
+            count += 1 + countNodes(e->right);
+    }
+    return count;
+}
+
+/* Array operands can fail too: indices and lengths are checked, min and max reject empty arrays. */
+static int canFail(Optimizer* o, const Node* n)
+{
+    for (; n; n = n->left)
+    {
+        if (n->kind == N_DIV || n->kind == N_MOD || n->kind == N_POW
+            || n->kind == N_INDEX || n->kind == N_MIN || n->kind == N_MAX || n->kind == N_ARRAY)
+            return 1;
+        if (o->mode == NUM_CHECKED && n->kind == N_SUM)
+            return 1;
+        if (o->mode == NUM_CHECKED && isOperator(n))
+            return 1;
+        if (canFail(o, n->right))
+            return 1;
+    }
+    return 0;
+}
+
+static int isConst(const Node* n, int value)
+{
+    return n->kind == N_NUM && n->value == value;
+}
+
+static Node* makeConst(Node* n, int value)
+{
+    n->kind  = N_NUM;
+    n->value = value;
+    n->left  = NULL;
+    n->right = NULL;
+    return n;
+}
+
+/* Node constants are ints, so int64 results outside that range stay unfolded. */
+static Node* fold(Optimizer* o, Node* n)
+{
+    Value out;
+
+    if (numApply(o->mode, n->kind - N_ADD, n->left->value, n->right->value, &out) != NUM_OK
+        || out < INT32_MIN || out > INT32_MAX)
+        return n;
+    return makeConst(n, (int)out);
+}
+
+static Node* simplified(Optimizer* o, Node* keep)
+{
+    o->stats->simplified++;
+    return keep;
+}
+
+static Node* simplify(Optimizer* o, Node* n)
+{
+    Node* l = n->left;
+    Node* r = n->right;
+
+    switch (n->kind)
+    {
+        case N_ADD:
+            if (isConst(r, 0))
+                return simplified(o, l);
+            if (isConst(l, 0))
+                return simplified(o, r);
+            break;
+
+        case N_SUB:
+            if (isConst(r, 0))
+                return simplified(o, l);
+            break;
+
+        case N_MUL:
+            if (isConst(r, 1))
+                return simplified(o, l);
+            if (isConst(l, 1))
+                return simplified(o, r);
+            if ((isConst(r, 0) && !canFail(o, l)) || (isConst(l, 0) && !canFail(o, r)))
+                return simplified(o, makeConst(n, 0));
+            break;
+
+        case N_DIV:
+            if (isConst(r, 1))
+                return simplified(o, l);
+            break;
+
+        case N_MOD:
+            if (isConst(r, 1) && !canFail(o, l))
+                return simplified(o, makeConst(n, 0));
+            break;
+
+        case N_POW:
+            if (isConst(r, 1))
+                return simplified(o, l);
+            if ((isConst(r, 0) && !canFail(o, l)) || (isConst(l, 1) && !canFail(o, r)))
+                return simplified(o, makeConst(n, 1));
+            break;
+
+        default:
+            break;
+    }
+    return n;
+}
+
+static Node* optimizeOperator(Optimizer* o, Node* n)
+{
+    if (n->left->kind == N_NUM && n->right->kind == N_NUM)
+    {
+        n = fold(o, n);
+        if (n->kind == N_NUM)
+        {
+            o->stats->folded++;
+            return n;
+        }
+    }
+    return simplify(o, n);
+}
+
+/* Operator chains are rebuilt bottom-up along their spine. */
+static Node* optimizeExpr(Optimizer* o, Node* n)
+{
+    Spine s;
+
+    if (n->kind == N_INDEX)
+        n->left = optimizeExpr(o, n->left);
+    if (!isOperator(n))
+        return n;
+    spineCollect(&s, n);
+    Node* acc = optimizeExpr(o, s.leaf);
+    for (int i = s.count - 1; i >= 0; i--)
+    {
+        Node* op  = s.ops[i];
+        op->left  = acc;
+        op->right = optimizeExpr(o, op->right);
+        acc       = optimizeOperator(o, op);
+    }
+    spineFree(&s);
+    return acc;
+}
+
+static Node* optimizeBlock(Optimizer* o, Node* head)
+{
+    Node** link = &head;
+
+    while (*link)
+    {
+        Node* stmt = *link;
+        if (stmt->left)
+            stmt->left = optimizeExpr(o, stmt->left);
+        if (stmt->kind == N_STORE)
+            stmt->right = optimizeExpr(o, stmt->right);
+
+        if (stmt->kind == N_IF)
+        {
+            stmt->right = optimizeBlock(o, stmt->right);
+            stmt->alt   = optimizeBlock(o, stmt->alt);
+            if (stmt->left->kind == N_NUM)
+            {
+                Node* taken = stmt->left->value != 0 ? stmt->right : stmt->alt;
+                o->stats->branches++;
+                if (!taken)
+                {
+                    *link = stmt->next;
+                    continue;
+                }
+                *link = taken;
+                while (taken->next)
+                    taken = taken->next;
+                taken->next = stmt->next;
+                link = &taken->next;
+                continue;
+            }
+        }
+        else if (stmt->kind == N_WHILE)
+        {
+            if (stmt->left->kind == N_NUM && stmt->left->value == 0)
+            {
+                o->stats->branches++;
+                *link = stmt->next;
+                continue;
+            }
+            stmt->right = optimizeBlock(o, stmt->right);
+        }
+        link = &stmt->next;
+    }
+    return head;
+}
+
+/*
+** Hoisted bounds checks. In a loop { i - K ? ... } (or K - i) where K is a
+** constant, a variable the loop leaves alone or len(a), whose body steps i
+** by one in a single top-level i = i + 1, assigns it nowhere else, declares
+** no array and has no nested loop, i runs from its value on entry, i0, up
+** to K. When every indexed access in the body is a[i + c] for constants c
+** (one higher after the step), the indices of each array stay within
+** [i0 + lowest c, K - 1 + highest c], provided i0 <= K. Those conditions
+** become the loop's guards, a chain of N_GUARD in its alt: the engines
+** check them once on entry and run the loop without bounds checks when
+** they hold, and with every check otherwise.
+*/
+#define HOIST_MAX_ARRAYS 8
+#define HOIST_MAX_OFFSET (1 << 24)
+
+typedef struct
+{
+    int slot;
+    int low;
+    int high;
+} AccessRange;
+
+typedef struct
+{
+    int         ind;
+    int         limit;
+    const Node* step;
+    int         after;
+    int         count;
+    AccessRange ranges[HOIST_MAX_ARRAYS];
+} BoundsScan;
+
+/* The c of an index i, i + c, c + i or i - c. */
+static int offsetOf(const BoundsScan* scan, const Node* n, int* offset)
+{
+    const Node* var = n->left;
+    const Node* num = n->right;
+
+    if (n->kind == N_VAR && n->value == scan->ind)
+    {
+        *offset = 0;
+        return 1;
+    }
+    if (n->kind != N_ADD && n->kind != N_SUB)
+        return 0;
+    if (n->kind == N_ADD && var->kind == N_NUM)
+    {
+        var = n->right;
+        num = n->left;
+    }
+    if (var->kind != N_VAR || var->value != scan->ind || num->kind != N_NUM
+        || num->value < -HOIST_MAX_OFFSET || num->value > HOIST_MAX_OFFSET)
+        return 0;
+    *offset = n->kind == N_ADD ? num->value : -num->value;
+    return 1;
+}
+
+static int recordAccess(BoundsScan* scan, int slot, const Node* index)
+{
+    AccessRange* range = scan->ranges;
+    int          offset;
+
+    if (!offsetOf(scan, index, &offset))
+        return 0;
+    offset += scan->after;
+    while (range < scan->ranges + scan->count && range->slot != slot)
+        range++;
+    if (range == scan->ranges + scan->count)
+    {
+        if (scan->count == HOIST_MAX_ARRAYS)
+            return 0;
+        range->slot = slot;
+        range->low  = offset;
+        range->high = offset;
+        scan->count++;
+    }
+    if (offset < range->low)
+        range->low = offset;
+    if (offset > range->high)
+        range->high = offset;
+    return 1;
+}
+
+static int scanAccesses(BoundsScan* scan, const Node* n)
+{
+    for (; n; n = n->left)
+    {
+        if (n->kind == N_INDEX)
+            return recordAccess(scan, n->value, n->left);
+        if (!scanAccesses(scan, n->right))
+            return 0;
+    }
+    return 1;
+}
+
+static int scanBody(BoundsScan* scan, const Node* stmt)
+{
+    for (; stmt; stmt = stmt->next)
+    {
+        if (stmt == scan->step)
+        {
+            scan->after = 1;
+            continue;
+        }
+        if (stmt->kind == N_WHILE || stmt->kind == N_DECLARE)
+            return 0;
+        if ((stmt->kind == N_ASSIGN || stmt->kind == N_INPUT)
+            && (stmt->value == scan->ind || stmt->value == scan->limit))
+            return 0;
+        if (stmt->kind == N_STORE && !recordAccess(scan, stmt->value, stmt->right))
+            return 0;
+        if (stmt->left && !scanAccesses(scan, stmt->left))
+            return 0;
+        if (stmt->kind == N_IF && (!scanBody(scan, stmt->right) || !scanBody(scan, stmt->alt)))
+            return 0;
+    }
+    return 1;
+}
+
+static Node* makeNode(Optimizer* o, NodeKind kind, int value, Node* left, Node* right)
+{
+    Node* n = (Node*)arenaAlloc(o->arena, sizeof(Node));
+
+    ft_memset(n, 0, sizeof(Node));
+    n->kind  = kind;
+    n->value = value;
+    n->left  = left;
+    n->right = right;
+    return n;
+}
+
+static Node* offsetNode(Optimizer* o, Node* base, int offset)
+{
+    if (offset == 0)
+        return base;
+    return makeNode(o, N_ADD, 0, base, makeNode(o, N_NUM, offset, NULL, NULL));
+}
+
+static int hoistWith(Optimizer* o, Node* loop, const Node* ind, Node* limit)
+{
+    BoundsScan scan;
+
+    if (ind->kind != N_VAR || (limit->kind != N_NUM && limit->kind != N_LEN && limit->kind != N_VAR)
+        || (limit->kind == N_VAR && limit->value == ind->value))
+        return 0;
+    ft_memset(&scan, 0, sizeof(scan));
+    scan.ind   = ind->value;
+    scan.limit = limit->kind == N_VAR ? limit->value : -1;
+    for (const Node* s = loop->right; s && !scan.step; s = s->next)
+    {
+        const Node* e = s->left;
+        if (s->kind == N_ASSIGN && s->value == scan.ind && e->kind == N_ADD
+            && ((e->left->kind == N_VAR && e->left->value == scan.ind && isConst(e->right, 1))
+                || (e->right->kind == N_VAR && e->right->value == scan.ind && isConst(e->left, 1))))
+            scan.step = s;
+    }
+    if (!scan.step || !scanBody(&scan, loop->right) || scan.count == 0)
+        return 0;
+
+    Node*  first = makeNode(o, N_VAR, scan.ind, NULL, NULL);
+    Node** tail  = &loop->alt;
+    *tail = makeNode(o, N_GUARD, -1, first, limit);
+    tail  = &(*tail)->next;
+    for (int k = 0; k < scan.count; k++)
+    {
+        const AccessRange* r = &scan.ranges[k];
+        *tail = makeNode(o, N_GUARD, r->slot, offsetNode(o, first, r->low), offsetNode(o, limit, r->high - 1));
+        tail  = &(*tail)->next;
+    }
+    return 1;
+}
+
+static int hoistLoop(Optimizer* o, Node* loop)
+{
+    Node* cond = loop->left;
+
+    if (loop->value >= 0 || cond->kind != N_SUB)
+        return 0;
+    return hoistWith(o, loop, cond->left, cond->right) || hoistWith(o, loop, cond->right, cond->left);
+}
+
+static int hoistBlock(Optimizer* o, Node* stmt)
+{
+    int found = 0;
+
+    for (; stmt; stmt = stmt->next)
+    {
+        if (stmt->kind == N_IF)
+            found += hoistBlock(o, stmt->right) + hoistBlock(o, stmt->alt);
+        else if (stmt->kind == N_WHILE)
+            found += hoistLoop(o, stmt) ? 1 : hoistBlock(o, stmt->right);
+    }
+    return found;
+}
+
+void optimizeProgram(Program* prog, OptStats* out)
+{
+    Optimizer  opt;
+    Optimizer* o = &opt;
+
+    ft_memset(out, 0, sizeof(OptStats));
+    o->stats     = out;
+    o->mode      = prog->mode;
+    o->arena     = &prog->arena;
+    out->before  = countNodes(prog->body);
+    prog->body   = optimizeBlock(o, prog->body);
+    out->after   = countNodes(prog->body);
+    out->loops   = summarizeLoops(prog);
+    out->guarded = hoistBlock(o, prog->body);
+}
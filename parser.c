@@ -0,0 +1,679 @@
+#include "interpreter.h"
+
+typedef struct
+{
+    const char*      inputText;
+    size_t           inputLength;
+    const TokenList* tokens;
+    size_t           current;
+    size_t           word;
+    int              depth;
+    Token            currentToken;
+    Program*         program;
+    int              withSites;
+    size_t           lineOffset;
+    int              line;
+    int              letters[128];
+    int*             symbols;
+    uint32_t         symbolMask;
+    unsigned char*   kinds;
+    int              arrayOperands;
+} Parser;
+
+/*
+** Whether a slot names a variable or an array, fixed where the name is
+** first seen; one name cannot be both.
+*/
+enum
+{
+    SLOT_NEW,
+    SLOT_SCALAR,
+    SLOT_ARRAY
+};
+
+int isOperator(const Node* n)
+{
+    return n->kind >= N_ADD && n->kind <= N_POW;
+}
+
+/* Frees a spine's heap array when an error unwinds past its owner. */
+static void dropSpine(void* arg)
+{
+    Spine* s = (Spine*)arg;
+
+    if (s->ops != s->local)
+        free(s->ops);
+}
+
+void spineCollect(Spine* s, const Node* n)
+{
+    s->ops   = s->local;
+    s->count = 0;
+    s->cap   = SPINE_INLINE;
+    while (isOperator(n))
+    {
+        if (s->count == s->cap)
+        {
+            Node** grown = (Node**)malloc(sizeof(Node*) * (size_t)s->cap * 2);
+            if (!grown)
+                reportError(ERR_NO_MEMORY, "Out of memory");
+            memcpy(grown, s->ops, sizeof(Node*) * (size_t)s->count);
+            if (s->ops != s->local)
+                free(s->ops);
+            else
+                pushCleanup(dropSpine, s);
+            s->ops = grown;
+            s->cap *= 2;
+        }
+        s->ops[s->count++] = (Node*)n;
+        n = n->left;
+    }
+    s->leaf = (Node*)n;
+}
+
+void spineFree(Spine* s)
+{
+    if (s->ops != s->local)
+    {
+        popCleanup();
+        free(s->ops);
+    }
+    s->ops = s->local;
+}
+
+/* Stops the parse at the current token. */
+static void syntaxError(Parser* p, const char* msg)
+{
+    reportErrorAt(ERR_SYNTAX, msg, p->inputText,
+        tokenOffset(p->tokens, p->inputText, p->inputLength, p->current));
+}
+
+/* Parentheses, '^' and nested blocks recurse; this keeps every walker's stack bounded. */
+static void enter(Parser* p)
+{
+    if (++p->depth > MAX_NESTING)
+        syntaxError(p, "Program nested too deeply");
+}
+
+static void  getNextToken(Parser* p);
+static Node* newNode(Parser* p, NodeKind kind);
+
+static Node* parseBlock(Parser* p, TokenType end1, TokenType end2, const char* msg);
+static Node* parseC(Parser* p);
+static Node* parseIf(Parser* p);
+static Node* parseWhile(Parser* p);
+static Node* parseAssignment(Parser* p);
+static Node* parseOutput(Parser* p);
+static Node* parseInput(Parser* p);
+
+static Node* parseExpr(Parser* p);
+static Node* parseTerm(Parser* p);
+static Node* parsePower(Parser* p);
+static Node* parseFactor(Parser* p);
+static Node* parseIndex(Parser* p);
+static Node* parseElement(Parser* p, int slot);
+static void  checkArrayExpr(Parser* p, const Node* n);
+
+void parseProgram(Program* prog, const char* programText, size_t length, int withSites)
+{
+    Parser    parser;
+    Parser*   p = &parser;
+    TokenList tokens;
+
+    ft_memset(prog, 0, sizeof(Program));
+    ft_memset(p, 0, sizeof(Parser));
+    perfPhase(PERF_LEX);
+    tokenize(programText, length, &tokens, &prog->arena);
+    perfPhase(PERF_PARSE);
+    p->program     = prog;
+    p->inputText   = programText;
+    p->inputLength = length;
+    p->tokens      = &tokens;
+    p->current     = (size_t)-1;
+    p->withSites   = withSites;
+    p->line        = 1;
+    for (int i = 0; i < 128; i++)
+        p->letters[i] = -1;
+    getNextToken(p);
+    if (withSites)
+    {
+        char* copy = (char*)arenaAlloc(&prog->arena, length + 1);
+        memcpy(copy, programText, length);
+        copy[length]       = '\0';
+        prog->source       = copy;
+        prog->sourceLength = length;
+    }
+
+    Node*  head = NULL;
+    Node** tail = &head;
+    while (p->currentToken.type != T_DOT)
+    {
+        if (p->currentToken.type == T_END)
+            syntaxError(p, "Expected '.' before end of program");
+        *tail = parseC(p);
+        tail  = &(*tail)->next;
+    }
+    prog->body = head;
+    arenaRelease(&prog->arena, tokens.marks);
+}
+
+void freeProgram(Program* prog)
+{
+    arenaFree(&prog->arena);
+    ft_memset(prog, 0, sizeof(Program));
+}
+
+/* The list ends with T_END, which is never stepped past. */
+static void getNextToken(Parser* p)
+{
+    if (p->current + 1 < p->tokens->count)
+        p->current++;
+    p->currentToken.type = (TokenType)p->tokens->types[p->current];
+    p->currentToken.ch   = p->tokens->chars[p->current];
+    if (p->currentToken.ch == 0 && p->currentToken.type <= T_NUM)
+        p->currentToken.at = p->tokens->words[p->word++];
+}
+
+static Node* newNode(Parser* p, NodeKind kind)
+{
+    Node* n = (Node*)arenaAlloc(&p->program->arena, sizeof(Node));
+    ft_memset(n, 0, sizeof(Node));
+    n->kind = kind;
+    return n;
+}
+
+static uint32_t hashName(const char* name, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+/* Room for one more name in the hash index, kept at most half full. */
+static void growSymbols(Parser* p)
+{
+    Program* prog = p->program;
+    uint32_t cap  = p->symbolMask ? (p->symbolMask + 1) * 2 : 64;
+
+    if (p->symbols && (uint32_t)prog->slots.count * 2 < p->symbolMask + 1)
+        return;
+    p->symbols    = (int*)arenaAlloc(&prog->arena, sizeof(int) * cap);
+    p->symbolMask = cap - 1;
+    for (uint32_t i = 0; i < cap; i++)
+        p->symbols[i] = -1;
+    for (int slot = 0; slot < prog->slots.count; slot++)
+    {
+        const char* name = prog->slots.names[slot];
+        if (name[1] == '\0')
+            continue;
+        uint32_t at = hashName(name, strlen(name)) & p->symbolMask;
+        while (p->symbols[at] >= 0)
+            at = (at + 1) & p->symbolMask;
+        p->symbols[at] = slot;
+    }
+}
+
+static int newSlot(Parser* p, const char* name, size_t len)
+{
+    SlotNames* slots = &p->program->slots;
+
+    if (slots->count == MAX_VARIABLES)
+        syntaxError(p, "Too many variables");
+    if (slots->count == slots->cap)
+    {
+        int cap = slots->cap ? slots->cap * 2 : 32;
+        slots->names = (const char**)arenaGrow(&p->program->arena, slots->names,
+            sizeof(char*) * (size_t)slots->cap, sizeof(char*) * (size_t)cap);
+        p->kinds     = (unsigned char*)arenaGrow(&p->program->arena, p->kinds,
+            (size_t)slots->cap, (size_t)cap);
+        slots->cap   = cap;
+    }
+    p->kinds[slots->count] = SLOT_NEW;
+    char* copy = (char*)arenaAlloc(&p->program->arena, len + 1);
+    memcpy(copy, name, len);
+    copy[len]                  = '\0';
+    slots->names[slots->count] = copy;
+    return slots->count++;
+}
+
+/*
+** The slot of the current identifier. One-letter names, by far the most
+** common, go through a direct table; longer ones through the hash index.
+*/
+static int slotOf(Parser* p)
+{
+    char ch = p->currentToken.ch;
+
+    if (ch != 0)
+    {
+        int* slot = &p->letters[(unsigned char)ch & 127];
+        if (*slot < 0)
+            *slot = newSlot(p, &ch, 1);
+        return *slot;
+    }
+
+    const char* name = p->inputText + p->currentToken.at;
+    size_t      len  = tokenLength(p->inputText, p->inputLength, p->currentToken.at);
+    growSymbols(p);
+    uint32_t at = hashName(name, len) & p->symbolMask;
+    for (; p->symbols[at] >= 0; at = (at + 1) & p->symbolMask)
+    {
+        const char* known = p->program->slots.names[p->symbols[at]];
+        if (strncmp(known, name, len) == 0 && known[len] == '\0')
+            return p->symbols[at];
+    }
+    p->symbols[at] = newSlot(p, name, len);
+    return p->symbols[at];
+}
+
+/* Fixes a new slot's kind and rejects using a known one as the other kind. */
+static int useAs(Parser* p, int slot, int kind)
+{
+    if (p->kinds[slot] == SLOT_NEW)
+        p->kinds[slot] = (unsigned char)kind;
+    else if (p->kinds[slot] != kind)
+        syntaxError(p, kind == SLOT_ARRAY ? "Variable used as an array" : "Array used as a variable");
+    return slot;
+}
+
+/* The token after the current one; the list ends with T_END, which has none. */
+static TokenType peekToken(Parser* p)
+{
+    if (p->current + 1 < p->tokens->count)
+        return (TokenType)p->tokens->types[p->current + 1];
+    return T_END;
+}
+
+/* The whole-array function the current name calls, or N_NUM when it is not a call. */
+static NodeKind functionOf(Parser* p)
+{
+    static const struct
+    {
+        const char* name;
+        NodeKind    kind;
+    } functions[] = { { "len", N_LEN }, { "sum", N_SUM }, { "min", N_MIN }, { "max", N_MAX } };
+
+    if (p->currentToken.ch != 0 || peekToken(p) != T_LPAREN
+        || tokenLength(p->inputText, p->inputLength, p->currentToken.at) != 3)
+        return N_NUM;
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++)
+        if (memcmp(p->inputText + p->currentToken.at, functions[i].name, 3) == 0)
+            return functions[i].kind;
+    return N_NUM;
+}
+
+/* A decimal literal; the tree keeps constants as int, so it must fit one. */
+static int numberOf(Parser* p)
+{
+    if (p->currentToken.ch != 0)
+        return p->currentToken.ch - '0';
+
+    const char* digits = p->inputText + p->currentToken.at;
+    size_t      len    = tokenLength(p->inputText, p->inputLength, p->currentToken.at);
+    int64_t     value  = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!ft_isdigit((unsigned char)digits[i]))
+            syntaxError(p, "Invalid number");
+        value = value * 10 + (digits[i] - '0');
+        if (value > INT32_MAX)
+            syntaxError(p, "Number too large");
+    }
+    return (int)value;
+}
+
+static Node* parseBlock(Parser* p, TokenType end1, TokenType end2, const char* msg)
+{
+    Node*  head = NULL;
+    Node** tail = &head;
+    while (p->currentToken.type != end1 && p->currentToken.type != end2)
+    {
+        if (p->currentToken.type == T_DOT || p->currentToken.type == T_END)
+            syntaxError(p, msg);
+        *tail = parseC(p);
+        tail  = &(*tail)->next;
+    }
+    return head;
+}
+
+/* Statements start in text order, so the line count only ever moves forward. */
+static int currentLine(Parser* p)
+{
+    size_t      offset = tokenOffset(p->tokens, p->inputText, p->inputLength, p->current);
+    const char* at     = p->inputText + p->lineOffset;
+    const char* end    = p->inputText + offset;
+    const char* nl;
+
+    while ((nl = (const char*)memchr(at, '\n', (size_t)(end - at))) != NULL)
+    {
+        p->line++;
+        at = nl + 1;
+    }
+    p->lineOffset = offset;
+    return p->line;
+}
+
+static void addSite(Parser* p, const Node* stmt, int line)
+{
+    Program* prog = p->program;
+
+    if (prog->siteCount >= prog->siteCap)
+    {
+        int cap = prog->siteCap ? prog->siteCap * 2 : 64;
+        prog->sites   = (StmtSite*)arenaGrow(&prog->arena, prog->sites,
+            sizeof(StmtSite) * (size_t)prog->siteCap, sizeof(StmtSite) * (size_t)cap);
+        prog->siteCap = cap;
+    }
+    prog->sites[prog->siteCount].stmt = stmt;
+    prog->sites[prog->siteCount].line = line;
+    prog->siteCount++;
+}
+
+static Node* parseC(Parser* p)
+{
+    int   line = p->withSites ? currentLine(p) : 0;
+    Node* n    = NULL;
+
+    switch (p->currentToken.type)
+    {
+        case T_LBRACKET:
+            getNextToken(p);
+            n = parseIf(p);
+            break;
+
+        case T_LBRACE:
+            getNextToken(p);
+            n = parseWhile(p);
+            break;
+
+        case T_ID:
+            n = parseAssignment(p);
+            break;
+
+        case T_LT:
+            getNextToken(p);
+            n = parseOutput(p);
+            break;
+
+        case T_GT:
+            getNextToken(p);
+            n = parseInput(p);
+            break;
+
+        default:
+            syntaxError(p, "Unexpected token in parseC");
+    }
+    if (p->withSites)
+        addSite(p, n, line);
+    return n;
+}
+
+static Node* parseIf(Parser* p)
+{
+    enter(p);
+    Node* n = newNode(p, N_IF);
+    n->left = parseExpr(p);
+
+    if (p->currentToken.type != T_QUESTION)
+        syntaxError(p, "Missing '?' in IF statement");
+    getNextToken(p);
+
+    n->right = parseBlock(p, T_COLON, T_RBRACKET, "Missing ':' or ']' in IF");
+
+    if (p->currentToken.type == T_COLON)
+    {
+        getNextToken(p);
+        n->alt = parseBlock(p, T_RBRACKET, T_RBRACKET, "Missing ']' in IF");
+    }
+
+    if (p->currentToken.type != T_RBRACKET)
+        syntaxError(p, "Missing ']' in IF");
+    getNextToken(p);
+    p->depth--;
+    return n;
+}
+
+static Node* parseWhile(Parser* p)
+{
+    enter(p);
+    Node* n = newNode(p, N_WHILE);
+    n->value = -1;
+    n->left  = parseExpr(p);
+
+    if (p->currentToken.type != T_QUESTION)
+        syntaxError(p, "Missing '?' in WHILE condition");
+    getNextToken(p);
+
+    n->right = parseBlock(p, T_RBRACE, T_RBRACE, "Missing '}' in WHILE block");
+    getNextToken(p);
+    p->depth--;
+    return n;
+}
+
+/* An assignment to an array name sets every element; see checkArrayExpr. */
+static Node* parseAssignment(Parser* p)
+{
+    int slot = slotOf(p);
+
+    if (peekToken(p) == T_LBRACKET)
+        return parseElement(p, useAs(p, slot, SLOT_ARRAY));
+
+    Node* n = newNode(p, p->kinds[slot] == SLOT_ARRAY ? N_ARRAY_ASSIGN : N_ASSIGN);
+    n->value = n->kind == N_ARRAY_ASSIGN ? slot : useAs(p, slot, SLOT_SCALAR);
+    getNextToken(p);
+
+    if (p->currentToken.type != T_ASSIGN)
+        syntaxError(p, "Missing '=' in assignment");
+    getNextToken(p);
+
+    p->arrayOperands = n->kind == N_ARRAY_ASSIGN;
+    n->left          = parseExpr(p);
+    p->arrayOperands = 0;
+    if (n->kind == N_ARRAY_ASSIGN)
+        checkArrayExpr(p, n->left);
+
+    if (p->currentToken.type != T_SEMI)
+        syntaxError(p, "Missing ';' at the end of assignment");
+    getNextToken(p);
+    return n;
+}
+
+/* name[length]; declares an array, name[index] = expression; stores one element. */
+static Node* parseElement(Parser* p, int slot)
+{
+    Node* index;
+    Node* n;
+
+    getNextToken(p);
+    index = parseIndex(p);
+    if (p->currentToken.type == T_SEMI)
+    {
+        n       = newNode(p, N_DECLARE);
+        n->left = index;
+    }
+    else
+    {
+        if (p->currentToken.type != T_ASSIGN)
+            syntaxError(p, "Missing '=' or ';' after array element");
+        getNextToken(p);
+        n        = newNode(p, N_STORE);
+        n->right = index;
+        n->left  = parseExpr(p);
+        if (p->currentToken.type != T_SEMI)
+            syntaxError(p, "Missing ';' at the end of assignment");
+    }
+    n->value = slot;
+    getNextToken(p);
+    return n;
+}
+
+static int hasArray(const Node* n)
+{
+    for (; n; n = n->left)
+        if (n->kind == N_ARRAY || hasArray(n->right))
+            return 1;
+    return 0;
+}
+
+/*
+** The right side of an array assignment is an array, one operator other
+** than '^' between arrays and numbers, or a number to fill the array with.
+*/
+static void checkArrayExpr(Parser* p, const Node* n)
+{
+    if (n->kind == N_ARRAY || !hasArray(n))
+        return;
+    if (isOperator(n) && n->kind != N_POW
+        && (n->left->kind == N_ARRAY || !hasArray(n->left))
+        && (n->right->kind == N_ARRAY || !hasArray(n->right)))
+        return;
+    syntaxError(p, "Array expression must be one operator between arrays and numbers");
+}
+
+static Node* parseOutput(Parser* p)
+{
+    Node* n = newNode(p, N_OUTPUT);
+    n->left = parseExpr(p);
+    if (p->currentToken.type != T_SEMI)
+        syntaxError(p, "Missing ';' after output expression");
+    getNextToken(p);
+    return n;
+}
+
+static Node* parseInput(Parser* p)
+{
+    if (p->currentToken.type != T_ID)
+        syntaxError(p, "Missing variable ID in input statement");
+
+    Node* n = newNode(p, N_INPUT);
+    n->value = useAs(p, slotOf(p), SLOT_SCALAR);
+    getNextToken(p);
+
+    if (p->currentToken.type != T_SEMI)
+        syntaxError(p, "Missing ';' after input statement");
+    getNextToken(p);
+    return n;
+}
+
+static Node* parseExpr(Parser* p)
+{
+    Node* result = parseTerm(p);
+    while (p->currentToken.type == T_PLUS || p->currentToken.type == T_MINUS)
+    {
+        Node* op = newNode(p, p->currentToken.type == T_PLUS ? N_ADD : N_SUB);
+        getNextToken(p);
+        op->left  = result;
+        op->right = parseTerm(p);
+        result    = op;
+    }
+    return result;
+}
+
+static Node* parseTerm(Parser* p)
+{
+    Node* result = parsePower(p);
+    while (p->currentToken.type == T_STAR || p->currentToken.type == T_SLASH || p->currentToken.type == T_MOD)
+    {
+        NodeKind kind;
+        if (p->currentToken.type == T_STAR)
+            kind = N_MUL;
+        else if (p->currentToken.type == T_SLASH)
+            kind = N_DIV;
+        else
+            kind = N_MOD;
+        Node* op = newNode(p, kind);
+        getNextToken(p);
+        op->left  = result;
+        op->right = parsePower(p);
+        result    = op;
+    }
+    return result;
+}
+
+static Node* parsePower(Parser* p)
+{
+    Node* left = parseFactor(p);
+    if (p->currentToken.type == T_CARET)
+    {
+        Node* op = newNode(p, N_POW);
+        getNextToken(p);
+        enter(p);
+        op->left  = left;
+        op->right = parsePower(p);
+        p->depth--;
+        return op;
+    }
+    return left;
+}
+
+static Node* parseFactor(Parser* p)
+{
+    if (p->currentToken.type == T_LPAREN)
+    {
+        getNextToken(p);
+        enter(p);
+        Node* val = parseExpr(p);
+        if (p->currentToken.type != T_RPAREN)
+            syntaxError(p, "Missing ')' in factor");
+        getNextToken(p);
+        p->depth--;
+        return val;
+    }
+    else if (p->currentToken.type == T_ID)
+    {
+        NodeKind function = functionOf(p);
+        if (function != N_NUM)
+        {
+            Node* n = newNode(p, function);
+            getNextToken(p);
+            getNextToken(p);
+            if (p->currentToken.type != T_ID)
+                syntaxError(p, "Missing array name in function call");
+            n->value = useAs(p, slotOf(p), SLOT_ARRAY);
+            getNextToken(p);
+            if (p->currentToken.type != T_RPAREN)
+                syntaxError(p, "Missing ')' in function call");
+            getNextToken(p);
+            return n;
+        }
+
+        int slot = slotOf(p);
+        if (peekToken(p) == T_LBRACKET)
+        {
+            Node* n = newNode(p, N_INDEX);
+            n->value = useAs(p, slot, SLOT_ARRAY);
+            getNextToken(p);
+            n->left = parseIndex(p);
+            return n;
+        }
+        Node* n = newNode(p, p->arrayOperands && p->kinds[slot] == SLOT_ARRAY ? N_ARRAY : N_VAR);
+        n->value = n->kind == N_ARRAY ? slot : useAs(p, slot, SLOT_SCALAR);
+        getNextToken(p);
+        return n;
+    }
+    else if (p->currentToken.type == T_NUM)
+    {
+        Node* n = newNode(p, N_NUM);
+        n->value = numberOf(p);
+        getNextToken(p);
+        return n;
+    }
+    else
+        syntaxError(p, "Unexpected token in parseFactor");
+    return NULL;
+}
+
+/* [ expression ] after an array name; the current token is the '['. */
+static Node* parseIndex(Parser* p)
+{
+    getNextToken(p);
+    enter(p);
+    Node* index = parseExpr(p);
+    if (p->currentToken.type != T_RBRACKET)
+        syntaxError(p, "Missing ']' after array index");
+    getNextToken(p);
+    p->depth--;
+    return index;
+}
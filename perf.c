@@ -0,0 +1,226 @@
+#include "interpreter.h"
+#include <errno.h>
+#include <time.h>
+
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+# define PERF_SUPPORTED 1
+#endif
+
+/*
+** --perf. Each counter is opened on its own for the calling thread in user
+** mode, so whatever the kernel allows is counted: in a container or VM
+** without a PMU the hardware events fail and the software ones (task clock,
+** page faults) still work; with no perf_event_open at all only the wall
+** clock is left. perfPhase reads every counter at a phase boundary and
+** charges the difference to the phase that just ended. Counters the kernel
+** multiplexed are scaled by the time they actually ran.
+*/
+
+#define PERF_COUNTERS 6
+
+typedef struct
+{
+    const char* name;
+    int         hardware;
+    uint32_t    type;
+    uint64_t    config;
+} CounterDef;
+
+#ifdef PERF_SUPPORTED
+static const CounterDef counterDefs[PERF_COUNTERS] = {
+    { "cycles",        1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions",  1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch-misses", 1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "cache-misses",  1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "task-clock ms", 0, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "page-faults",   0, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+#else
+static const CounterDef counterDefs[PERF_COUNTERS] = {
+    { "cycles", 1, 0, 0 }, { "instructions", 1, 0, 0 }, { "branch-misses", 1, 0, 0 },
+    { "cache-misses", 1, 0, 0 }, { "task-clock ms", 0, 0, 0 }, { "page-faults", 0, 0, 0 },
+};
+#endif
+
+enum { C_CYCLES, C_INSTRUCTIONS, C_BRANCH_MISSES, C_CACHE_MISSES, C_TASK_CLOCK, C_PAGE_FAULTS };
+
+static const char* phaseNames[PERF_PHASES] = { "lex", "parse", "optimize", "compile", "exec" };
+
+struct PerfSession
+{
+    int          fds[PERF_COUNTERS];
+    int          error;
+    int          phase;
+    uint64_t     last[PERF_COUNTERS][3];
+    double       lastTime;
+    double       counts[PERF_PHASES][PERF_COUNTERS];
+    double       ms[PERF_PHASES];
+    int          seen[PERF_PHASES];
+    PerfSession* outer;
+};
+
+static _Thread_local PerfSession* activePerf;
+
+static double wallMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+/* value, time enabled, time running */
+static int readCounter(int fd, uint64_t out[3])
+{
+#ifdef PERF_SUPPORTED
+    return fd >= 0 && read(fd, out, sizeof(uint64_t) * 3) == (ssize_t)(sizeof(uint64_t) * 3);
+#else
+    (void)fd;
+    (void)out;
+    return 0;
+#endif
+}
+
+static int openCounter(const CounterDef* def, int* error)
+{
+#ifdef PERF_SUPPORTED
+    struct perf_event_attr attr;
+
+    ft_memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = def->type;
+    attr.config         = def->config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && !*error)
+        *error = errno;
+    return fd;
+#else
+    (void)def;
+    *error = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Opens the counters and makes the session this thread's; NULL when out of memory. */
+PerfSession* perfBegin(void)
+{
+    PerfSession* perf = (PerfSession*)calloc(1, sizeof(PerfSession));
+
+    if (!perf)
+        return NULL;
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        perf->fds[i] = openCounter(&counterDefs[i], &perf->error);
+        readCounter(perf->fds[i], perf->last[i]);
+    }
+    perf->phase    = -1;
+    perf->lastTime = wallMs();
+    perf->outer    = activePerf;
+    activePerf     = perf;
+    return perf;
+}
+
+/* Ends the current phase and starts another; -1 ends it without one. */
+void perfPhase(int phase)
+{
+    PerfSession* perf = activePerf;
+
+    if (!perf || phase == perf->phase)
+        return;
+    double now = wallMs();
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        uint64_t cur[3];
+        if (!readCounter(perf->fds[i], cur))
+            continue;
+        if (perf->phase >= 0)
+        {
+            double value   = (double)(cur[0] - perf->last[i][0]);
+            double enabled = (double)(cur[1] - perf->last[i][1]);
+            double running = (double)(cur[2] - perf->last[i][2]);
+            if (running > 0 && running < enabled)
+                value *= enabled / running;
+            perf->counts[perf->phase][i] += value;
+        }
+        memcpy(perf->last[i], cur, sizeof(cur));
+    }
+    if (perf->phase >= 0)
+    {
+        perf->ms[perf->phase] += now - perf->lastTime;
+        perf->seen[perf->phase] = 1;
+    }
+    perf->lastTime = now;
+    perf->phase    = phase;
+}
+
+static void printCount(FILE* out, const PerfSession* perf, const double* counts, int counter)
+{
+    if (perf->fds[counter] < 0)
+        fprintf(out, " %14s", "-");
+    else if (counter == C_TASK_CLOCK)
+        fprintf(out, " %14.3f", counts[counter] / 1e6);
+    else
+        fprintf(out, " %14.0f", counts[counter]);
+}
+
+static void printRow(FILE* out, const PerfSession* perf, const char* name, const double* counts, double ms)
+{
+    fprintf(out, "%-9s %10.3f", name, ms);
+    for (int i = 0; i < PERF_COUNTERS; i++)
+        printCount(out, perf, counts, i);
+    if (perf->fds[C_CYCLES] >= 0 && perf->fds[C_INSTRUCTIONS] >= 0 && counts[C_CYCLES] > 0)
+        fprintf(out, " %6.2f", counts[C_INSTRUCTIONS] / counts[C_CYCLES]);
+    else
+        fprintf(out, " %6s", "-");
+    if (perf->fds[C_INSTRUCTIONS] >= 0 && perf->fds[C_BRANCH_MISSES] >= 0 && counts[C_INSTRUCTIONS] > 0)
+        fprintf(out, " %8.2f", counts[C_BRANCH_MISSES] * 1000.0 / counts[C_INSTRUCTIONS]);
+    else
+        fprintf(out, " %8s", "-");
+    fprintf(out, "\n");
+}
+
+/* Closes the last phase, prints a row per phase that ran, and frees the session. */
+void perfEnd(PerfSession* perf, FILE* out)
+{
+    double total[PERF_COUNTERS] = { 0 };
+    double totalMs = 0;
+    int    missing = 0;
+
+    if (!perf)
+        return;
+    perfPhase(-1);
+    activePerf = perf->outer;
+    for (int i = 0; i < PERF_COUNTERS; i++)
+        missing += perf->fds[i] < 0 && counterDefs[i].hardware;
+    if (missing)
+        fprintf(out, "perf: %d hardware counters unavailable (%s)%s\n", missing,
+            strerror(perf->error ? perf->error : ENOENT),
+            perf->fds[C_TASK_CLOCK] >= 0 ? ", software counters only" : "");
+    fprintf(out, "%-9s %10s", "phase", "ms");
+    for (int i = 0; i < PERF_COUNTERS; i++)
+        fprintf(out, " %14s", counterDefs[i].name);
+    fprintf(out, " %6s %8s\n", "IPC", "miss/1k");
+    for (int p = 0; p < PERF_PHASES; p++)
+    {
+        if (!perf->seen[p])
+            continue;
+        printRow(out, perf, phaseNames[p], perf->counts[p], perf->ms[p]);
+        for (int i = 0; i < PERF_COUNTERS; i++)
+            total[i] += perf->counts[p][i];
+        totalMs += perf->ms[p];
+    }
+    printRow(out, perf, "total", total, totalMs);
+#ifdef PERF_SUPPORTED
+    for (int i = 0; i < PERF_COUNTERS; i++)
+        if (perf->fds[i] >= 0)
+            close(perf->fds[i]);
+#endif
+    free(perf);
+}
@@ -0,0 +1,340 @@
+#include "interpreter.h"
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define PROFILE_TSC 1
+#endif
+
+/*
+** --profile. The tree-walker reports every statement it runs with the ticks
+** it took, inclusive of nested blocks; the report subtracts a block's
+** statements from its [ ] or { } to get the time spent on each line itself.
+** Ticks come from the TSC where there is one and are converted to time
+** against the wall clock over the whole run.
+*/
+
+#define PROFILE_LISTING_LINES 1000
+#define PROFILE_TOP           10
+
+struct Profile
+{
+    const Program* prog;
+    int*           index;
+    uint32_t       indexMask;
+    uint64_t*      hits;
+    uint64_t*      ticks;
+    uint64_t*      iterations;
+    uint64_t       overhead;
+    uint64_t       tickCost;
+    uint64_t       startTicks;
+    double         startTime;
+};
+
+static double wallTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+uint64_t profileTicks(void)
+{
+#ifdef PROFILE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static uint32_t hashNode(const Node* stmt)
+{
+    return (uint32_t)(((uintptr_t)stmt * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/*
+** The cost of timing: tickCost is what a measured interval includes of the
+** two tick reads around it, overhead the whole lookup, reads and count for
+** one statement as execProfiled does them. The report takes the first off
+** every statement and the rest off the block around it.
+*/
+static void calibrate(Profile* prof)
+{
+    int site = prof->prog->siteCount;
+
+    prof->overhead = UINT64_MAX;
+    prof->tickCost = UINT64_MAX;
+    for (int round = 0; round < 16; round++)
+    {
+        uint64_t start = profileTicks();
+        for (int i = 0; i < 64; i++)
+        {
+            int      at    = profileSite(prof, NULL);
+            uint64_t ticks = profileTicks();
+            uint64_t spent = profileTicks() - ticks;
+            profileCount(prof, at, spent);
+            if (spent < prof->tickCost)
+                prof->tickCost = spent;
+        }
+        uint64_t spent = (profileTicks() - start) / 64;
+        if (spent < prof->overhead)
+            prof->overhead = spent;
+    }
+    if (prof->tickCost > prof->overhead)
+        prof->tickCost = prof->overhead;
+    prof->hits[site]  = 0;
+    prof->ticks[site] = 0;
+}
+
+/* Counters for every recorded statement, and an index from node to counter. */
+Profile* profileCreate(const Program* prog)
+{
+    Profile* prof = (Profile*)calloc(1, sizeof(Profile));
+    size_t   n    = (size_t)prog->siteCount;
+    uint32_t cap  = 16;
+
+    while (cap < n * 2)
+        cap *= 2;
+    if (prof)
+    {
+        prof->index      = (int*)malloc(sizeof(int) * cap);
+        prof->hits       = (uint64_t*)calloc(n + 1, sizeof(uint64_t));
+        prof->ticks      = (uint64_t*)calloc(n + 1, sizeof(uint64_t));
+        prof->iterations = (uint64_t*)calloc(n + 1, sizeof(uint64_t));
+    }
+    if (!prof || !prof->index || !prof->hits || !prof->ticks || !prof->iterations)
+    {
+        profileFree(prof);
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    }
+    prof->prog      = prog;
+    prof->indexMask = cap - 1;
+    for (uint32_t i = 0; i < cap; i++)
+        prof->index[i] = -1;
+    for (int k = 0; k < prog->siteCount; k++)
+    {
+        uint32_t at = hashNode(prog->sites[k].stmt) & prof->indexMask;
+        while (prof->index[at] >= 0)
+            at = (at + 1) & prof->indexMask;
+        prof->index[at] = k;
+    }
+    calibrate(prof);
+    prof->startTime  = wallTime();
+    prof->startTicks = profileTicks();
+    return prof;
+}
+
+void profileFree(Profile* prof)
+{
+    if (!prof)
+        return;
+    free(prof->index);
+    free(prof->hits);
+    free(prof->ticks);
+    free(prof->iterations);
+    free(prof);
+}
+
+/* The counter of a statement; ones the parser did not record (and NULL) share the last. */
+int profileSite(Profile* prof, const Node* stmt)
+{
+    uint32_t at = hashNode(stmt) & prof->indexMask;
+
+    while (prof->index[at] >= 0)
+    {
+        if (prof->prog->sites[prof->index[at]].stmt == stmt)
+            return prof->index[at];
+        at = (at + 1) & prof->indexMask;
+    }
+    return prof->prog->siteCount;
+}
+
+void profileCount(Profile* prof, int site, uint64_t ticks)
+{
+    prof->hits[site]++;
+    prof->ticks[site] += ticks;
+}
+
+void profileLoop(Profile* prof, const Node* loop, uint64_t iterations)
+{
+    prof->iterations[profileSite(prof, loop)] += iterations;
+}
+
+/* A block's time without the cost of timing it, from its statements' own. */
+static double blockMs(Profile* prof, const Node* stmt, const double* inclusive)
+{
+    double sum = 0;
+
+    for (; stmt; stmt = stmt->next)
+        sum += inclusive[profileSite(prof, stmt)];
+    return sum;
+}
+
+/* Ticks a block's statements took as seen from the block, timing them included. */
+static uint64_t blockTicks(Profile* prof, const Node* stmt)
+{
+    uint64_t sum = 0;
+
+    for (; stmt; stmt = stmt->next)
+    {
+        int site = profileSite(prof, stmt);
+        sum += prof->ticks[site] + prof->hits[site] * (prof->overhead - prof->tickCost);
+    }
+    return sum;
+}
+
+/* Keeps top[] as the indices of the count largest values seen, largest first. */
+static void rank(int* top, int* count, const double* value, int candidate)
+{
+    int at = *count;
+
+    if (at == PROFILE_TOP)
+    {
+        if (value[candidate] <= value[top[PROFILE_TOP - 1]])
+            return;
+        at--;
+    }
+    else
+        (*count)++;
+    while (at > 0 && value[top[at - 1]] < value[candidate])
+    {
+        top[at] = top[at - 1];
+        at--;
+    }
+    top[at] = candidate;
+}
+
+static void printLine(FILE* out, const Program* prog, const char** lineStart, int line)
+{
+    const char* end = prog->source + prog->sourceLength;
+    const char* at  = lineStart[line];
+    const char* nl  = (const char*)memchr(at, '\n', (size_t)(end - at));
+    int         len = (int)((nl ? nl : end) - at);
+
+    while (len > 0 && ft_isspace(at[len - 1]))
+        len--;
+    fprintf(out, "%.*s\n", len, at);
+}
+
+/*
+** Annotated listing: every line with its statement hits and its own time,
+** then the hottest lines and loops. Programs over PROFILE_LISTING_LINES
+** lines get only the summaries.
+*/
+void profileReport(Profile* prof, FILE* out)
+{
+    const Program* prog     = prof->prog;
+    uint64_t       spent    = profileTicks() - prof->startTicks;
+    double         wall     = wallTime() - prof->startTime;
+    double         perTick  = spent ? wall * 1e3 / (double)spent : 0;
+    int            lines    = 1;
+    uint64_t       executed = 0;
+    double         total    = 0;
+
+    for (size_t i = 0; i < prog->sourceLength; i++)
+        lines += prog->source[i] == '\n';
+    if (prog->sourceLength && prog->source[prog->sourceLength - 1] == '\n')
+        lines--;
+
+    const char** lineStart = (const char**)malloc(sizeof(char*) * (size_t)(lines + 1));
+    uint64_t*    lineHits  = (uint64_t*)calloc((size_t)lines + 1, sizeof(uint64_t));
+    double*      lineMs    = (double*)calloc((size_t)lines + 1, sizeof(double));
+    double*      loopMs    = (double*)calloc((size_t)prog->siteCount + 1, sizeof(double));
+    double*      inclusive = (double*)calloc((size_t)prog->siteCount + 1, sizeof(double));
+    if (!lineStart || !lineHits || !lineMs || !loopMs || !inclusive)
+    {
+        free(lineStart);
+        free(lineHits);
+        free(lineMs);
+        free(loopMs);
+        free(inclusive);
+        return;
+    }
+    lineStart[1] = prog->source;
+    int line = 2;
+    for (size_t i = 0; i < prog->sourceLength && line <= lines; i++)
+        if (prog->source[i] == '\n')
+            lineStart[line++] = prog->source + i + 1;
+
+    /* Sites are recorded after the statements nested in them, so those come first. */
+    for (int k = 0; k < prog->siteCount; k++)
+    {
+        const Node* stmt = prog->sites[k].stmt;
+        uint64_t    own  = prof->ticks[k];
+        uint64_t    sub  = prof->hits[k] * prof->tickCost;
+        double      sum  = 0;
+        if (stmt->kind == N_IF)
+        {
+            sub += blockTicks(prof, stmt->right) + blockTicks(prof, stmt->alt);
+            sum  = blockMs(prof, stmt->right, inclusive) + blockMs(prof, stmt->alt, inclusive);
+        }
+        else if (stmt->kind == N_WHILE)
+        {
+            sub += blockTicks(prof, stmt->right);
+            sum  = blockMs(prof, stmt->right, inclusive);
+        }
+        own          = own > sub ? own - sub : 0;
+        inclusive[k] = (double)own * perTick + sum;
+        if (stmt->kind == N_WHILE)
+            loopMs[k] = inclusive[k];
+        lineHits[prog->sites[k].line] += prof->hits[k];
+        lineMs[prog->sites[k].line] += (double)own * perTick;
+        executed += prof->hits[k];
+        total += (double)own * perTick;
+    }
+
+    fprintf(out, "profile: %llu statements in %.3f ms, %.3f ms of it timing them\n",
+        (unsigned long long)executed, wall * 1e3, wall * 1e3 - total);
+    if (total <= 0)
+        total = 1;
+    if (lines <= PROFILE_LISTING_LINES)
+    {
+        fprintf(out, "%6s %12s %10s %6s  %s\n", "line", "hits", "ms", "time", "source");
+        for (line = 1; line <= lines; line++)
+        {
+            if (lineHits[line])
+                fprintf(out, "%6d %12llu %10.3f %5.1f%%  ", line, (unsigned long long)lineHits[line],
+                    lineMs[line], lineMs[line] * 100.0 / total);
+            else
+                fprintf(out, "%6d %12s %10s %6s  ", line, "", "", "");
+            printLine(out, prog, lineStart, line);
+        }
+    }
+
+    int top[PROFILE_TOP];
+    int count = 0;
+    for (line = 1; line <= lines; line++)
+        if (lineHits[line])
+            rank(top, &count, lineMs, line);
+    fprintf(out, "hottest lines:\n");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "%6d %12llu %10.3f %5.1f%%  ", top[i], (unsigned long long)lineHits[top[i]],
+            lineMs[top[i]], lineMs[top[i]] * 100.0 / total);
+        printLine(out, prog, lineStart, top[i]);
+    }
+
+    count = 0;
+    for (int k = 0; k < prog->siteCount; k++)
+        if (prog->sites[k].stmt->kind == N_WHILE && prof->hits[k])
+            rank(top, &count, loopMs, k);
+    if (count)
+        fprintf(out, "hottest loops:\n");
+    for (int i = 0; i < count; i++)
+    {
+        int k = top[i];
+        fprintf(out, "  line %d: %llu runs, %llu iterations, %.3f ms, %.1f%%%s\n",
+            prog->sites[k].line, (unsigned long long)prof->hits[k],
+            (unsigned long long)prof->iterations[k], loopMs[k], loopMs[k] * 100.0 / total,
+            prog->sites[k].stmt->value >= 0 && !prof->iterations[k] ? " (closed form)" : "");
+    }
+    free(lineStart);
+    free(lineHits);
+    free(lineMs);
+    free(loopMs);
+    free(inclusive);
+}
@@ -0,0 +1,369 @@
+#include "interpreter.h"
+#include <stdint.h>
+
+/*
+** Closed-form summaries for counting loops. A while loop qualifies when its
+** body is nothing but assignments, one of them steps an induction variable
+** by a constant (i = i + c), the condition is affine in that variable and
+** every other assignment is
+**   v = v + f(i)   accumulate an affine function of i
+**   v = v * q      scale by a loop-invariant factor
+**   v = f(i)       keep the value of the last iteration
+** where "affine" means coef * i + k + varCoef * w with w not assigned in the
+** loop, so no statement observes another one's update except through i.
+** Everything is evaluated modulo 2^32, exactly like the wrapping int
+** arithmetic of the loop itself, so the trip count is the first j with
+** cond(i0 + j*c) == 0 in that ring. When no such j exists the loop runs
+** forever (or the body would observe something else) and applySummary
+** leaves it to the normal engine. Only NUM_INT32 programs are summarised:
+** the other modes have a different ring or must trap on the first overflow.
+*/
+
+typedef struct
+{
+    uint32_t coef;
+    uint32_t k;
+    int      var;
+    uint32_t varCoef;
+    uint32_t self;
+} Linear;
+
+/*
+** What the loop being analysed assigns, and the variable whose own value is
+** "self". A body that assigns more than the induction variable and
+** SUMMARY_MAX_VARS others cannot be summarised, so a short list does.
+*/
+typedef struct
+{
+    int assigned[SUMMARY_MAX_VARS + 1];
+    int assignedCount;
+    int selfSlot;
+} LoopScan;
+
+static int isAssigned(const LoopScan* scan, int slot)
+{
+    for (int i = 0; i < scan->assignedCount; i++)
+        if (scan->assigned[i] == slot)
+            return 1;
+    return 0;
+}
+
+static int isConstant(const Linear* l)
+{
+    return l->coef == 0 && l->var < 0 && l->self == 0;
+}
+
+/* The leaf operands of linearOf: constants and variables. */
+static int linearLeaf(LoopScan* scan, const Node* n, int ind, Linear* out)
+{
+    ft_memset(out, 0, sizeof(Linear));
+    out->var = -1;
+    if (n->kind == N_NUM)
+    {
+        out->k = (uint32_t)n->value;
+        return 1;
+    }
+    if (n->kind != N_VAR)
+        return 0;
+    if (n->value == ind)
+        out->coef = 1;
+    else if (n->value == scan->selfSlot)
+        out->self = 1;
+    else if (isAssigned(scan, n->value))
+        return 0;
+    else
+    {
+        out->var     = n->value;
+        out->varCoef = 1;
+    }
+    return 1;
+}
+
+/* l op r for op + - or *, failing when the result is not linear. */
+static int linearCombine(NodeKind kind, Linear l, Linear r, Linear* out)
+{
+    ft_memset(out, 0, sizeof(Linear));
+    out->var = -1;
+    if (kind == N_ADD || kind == N_SUB)
+    {
+        if (l.var >= 0 && r.var >= 0 && l.var != r.var)
+            return 0;
+        uint32_t sign = kind == N_SUB ? 0xFFFFFFFFu : 1u;
+        out->coef    = l.coef + sign * r.coef;
+        out->k       = l.k + sign * r.k;
+        out->var     = l.var >= 0 ? l.var : r.var;
+        out->varCoef = l.varCoef + sign * r.varCoef;
+        out->self    = l.self + sign * r.self;
+        return 1;
+    }
+    if (kind != N_MUL)
+        return 0;
+    if (!isConstant(&l))
+    {
+        Linear t = l;
+        l = r;
+        r = t;
+    }
+    if (!isConstant(&l))
+        return 0;
+    out->coef    = r.coef * l.k;
+    out->k       = r.k * l.k;
+    out->var     = r.var;
+    out->varCoef = r.varCoef * l.k;
+    out->self    = r.self * l.k;
+    return 1;
+}
+
+/*
+** Writes n as coef * ind + self * selfSlot + k + varCoef * var, failing on
+** anything non-linear or on a variable the loop assigns. Operator chains
+** are combined bottom-up along their spine.
+*/
+static int linearOf(LoopScan* scan, const Node* n, int ind, Linear* out)
+{
+    Spine  s;
+    Linear r;
+    int    ok;
+
+    spineCollect(&s, n);
+    ok = linearLeaf(scan, s.leaf, ind, out);
+    for (int i = s.count - 1; i >= 0 && ok; i--)
+        ok = linearOf(scan, s.ops[i]->right, ind, &r)
+            && linearCombine(s.ops[i]->kind, *out, r, out);
+    spineFree(&s);
+    return ok;
+}
+
+static void toAffine(const Linear* l, Affine* a)
+{
+    a->coef    = (int)l->coef;
+    a->k       = (int)l->k;
+    a->var     = l->var;
+    a->varCoef = (int)l->varCoef;
+}
+
+/* v = v * q or v = q * v with q loop-invariant. */
+static int scaleOf(LoopScan* scan, const Node* stmt, Linear* q)
+{
+    const Node* e = stmt->left;
+    const Node* other;
+
+    if (e->kind != N_MUL)
+        return 0;
+    if (e->left->kind == N_VAR && e->left->value == stmt->value)
+        other = e->right;
+    else if (e->right->kind == N_VAR && e->right->value == stmt->value)
+        other = e->left;
+    else
+        return 0;
+    return linearOf(scan, other, -1, q) && q->self == 0;
+}
+
+static int usesVar(const Node* n, int slot)
+{
+    for (; n; n = n->left)
+    {
+        if (n->kind == N_VAR && n->value == slot)
+            return 1;
+        if (usesVar(n->right, slot))
+            return 1;
+    }
+    return 0;
+}
+
+static int summarizeWith(LoopScan* scan, const Node* loop, const Node* step, LoopSummary* sum)
+{
+    Linear lin;
+    int    after = 0;
+
+    scan->selfSlot = step->value;
+    if (!linearOf(scan, step->left, -1, &lin) || lin.self != 1 || lin.var >= 0)
+        return 0;
+    ft_memset(sum, 0, sizeof(LoopSummary));
+    sum->ind  = step->value;
+    sum->step = (int)lin.k;
+
+    scan->selfSlot = -1;
+    if (!linearOf(scan, loop->left, sum->ind, &lin))
+        return 0;
+    toAffine(&lin, &sum->cond);
+
+    for (const Node* s = loop->right; s; s = s->next)
+    {
+        if (s == step)
+        {
+            after = 1;
+            continue;
+        }
+        if (sum->count == SUMMARY_MAX_VARS)
+            return 0;
+
+        SumEntry* e = &sum->entries[sum->count];
+        e->slot  = s->value;
+        e->after = after;
+        scan->selfSlot = s->value;
+        int linear     = linearOf(scan, s->left, sum->ind, &lin);
+        if (linear && (lin.self == 0 || lin.self == 1))
+            e->kind = lin.self ? SUM_ACCUM : SUM_LAST;
+        else if (linear && lin.coef == 0 && lin.k == 0 && lin.var < 0)
+        {
+            e->kind = SUM_SCALE;
+            lin.k   = lin.self;
+        }
+        else if (scaleOf(scan, s, &lin))
+            e->kind = SUM_SCALE;
+        else
+            return 0;
+        toAffine(&lin, &e->f);
+        sum->count++;
+    }
+    return 1;
+}
+
+static int summarizeLoop(const Node* loop, LoopSummary* sum)
+{
+    LoopScan  loopScan;
+    LoopScan* scan = &loopScan;
+
+    ft_memset(scan, 0, sizeof(LoopScan));
+    for (const Node* s = loop->right; s; s = s->next)
+    {
+        if (s->kind != N_ASSIGN || isAssigned(scan, s->value)
+            || scan->assignedCount == SUMMARY_MAX_VARS + 1)
+            return 0;
+        scan->assigned[scan->assignedCount++] = s->value;
+    }
+    if (!loop->right)
+        return 0;
+
+    for (const Node* s = loop->right; s; s = s->next)
+        if (usesVar(loop->left, s->value) && summarizeWith(scan, loop, s, sum))
+            return 1;
+    return 0;
+}
+
+static int addSummary(Program* prog, const LoopSummary* sum)
+{
+    if (prog->summaryCount >= prog->summaryCap)
+    {
+        int cap = prog->summaryCap ? prog->summaryCap * 2 : 4;
+        prog->summaries  = (LoopSummary*)arenaGrow(&prog->arena, prog->summaries,
+            sizeof(LoopSummary) * (size_t)prog->summaryCap, sizeof(LoopSummary) * (size_t)cap);
+        prog->summaryCap = cap;
+    }
+    prog->summaries[prog->summaryCount] = *sum;
+    return prog->summaryCount++;
+}
+
+static int summarizeBlock(Program* prog, Node* stmt)
+{
+    LoopSummary sum;
+    int         found = 0;
+
+    for (; stmt; stmt = stmt->next)
+    {
+        if (stmt->kind == N_IF)
+            found += summarizeBlock(prog, stmt->right) + summarizeBlock(prog, stmt->alt);
+        else if (stmt->kind == N_WHILE)
+        {
+            if (summarizeLoop(stmt, &sum))
+            {
+                stmt->value = addSummary(prog, &sum);
+                found++;
+            }
+            else
+                found += summarizeBlock(prog, stmt->right);
+        }
+    }
+    return found;
+}
+
+int summarizeLoops(Program* prog)
+{
+    if (prog->mode != NUM_INT32)
+        return 0;
+    return summarizeBlock(prog, prog->body);
+}
+
+static uint32_t evalAffine(const Affine* a, uint32_t i, const Value* variables)
+{
+    uint32_t v = (uint32_t)a->coef * i + (uint32_t)a->k;
+
+    if (a->var >= 0)
+        v += (uint32_t)a->varCoef * (uint32_t)variables[a->var];
+    return v;
+}
+
+static uint32_t powMod(uint32_t base, uint32_t exp)
+{
+    uint32_t out = 1;
+
+    while (exp)
+    {
+        if (exp & 1)
+            out *= base;
+        base *= base;
+        exp >>= 1;
+    }
+    return out;
+}
+
+/* Smallest j >= 0 with v0 + j * d == 0 (mod 2^32); 0 when there is none. */
+static int tripCount(uint32_t v0, uint32_t d, uint32_t* t)
+{
+    if (v0 == 0)
+    {
+        *t = 0;
+        return 1;
+    }
+    if (d == 0)
+        return 0;
+
+    int      shift = __builtin_ctz(d);
+    uint32_t need  = 0u - v0;
+    if (need & ((1u << shift) - 1))
+        return 0;
+
+    uint32_t odd = d >> shift;
+    uint32_t inv = odd;
+    for (int k = 0; k < 5; k++)
+        inv *= 2 - odd * inv;
+    uint32_t j = (need >> shift) * inv;
+    if (shift)
+        j &= (uint32_t)(((uint64_t)1 << (32 - shift)) - 1);
+    *t = j;
+    return 1;
+}
+
+int applySummary(const LoopSummary* sum, Value* variables)
+{
+    uint32_t i0 = (uint32_t)variables[sum->ind];
+    uint32_t c  = (uint32_t)sum->step;
+    uint32_t t;
+
+    if (!tripCount(evalAffine(&sum->cond, i0, variables), (uint32_t)sum->cond.coef * c, &t))
+        return 0;
+    if (t == 0)
+        return 1;
+
+    uint32_t tri = (uint32_t)(((uint64_t)t * (uint64_t)(t - 1)) / 2);
+    for (int n = 0; n < sum->count; n++)
+    {
+        const SumEntry* e     = &sum->entries[n];
+        uint32_t        first = i0 + (e->after ? c : 0);
+        uint32_t        v     = (uint32_t)variables[e->slot];
+
+        if (e->kind == SUM_ACCUM)
+        {
+            uint32_t base = evalAffine(&e->f, 0, variables);
+            v += t * base + (uint32_t)e->f.coef * (t * first + c * tri);
+        }
+        else if (e->kind == SUM_SCALE)
+            v *= powMod(evalAffine(&e->f, 0, variables), t);
+        else
+            v = evalAffine(&e->f, first + (t - 1) * c, variables);
+        variables[e->slot] = (int32_t)v;
+    }
+    variables[sum->ind] = (int32_t)(i0 + t * c);
+    return 1;
+}
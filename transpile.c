@@ -0,0 +1,604 @@
+#include "interpreter.h"
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+** Ahead-of-time backend: writes the AST out as a standalone C program and
+** hands it to gcc. -fwrapv keeps the interpreter's wraparound, and when
+** both operands of an operator can fail the left one is sequenced first so
+** the reported error matches the interpreter's left-to-right evaluation.
+** The generated code computes in a `num` type chosen by the numeric mode;
+** its helpers mirror numeric.h. Prompts and the end-of-input policy come
+** from the run's InputSource; the program reads its own standard input.
+** Programs with arrays also get arrayPrelude, array.c in plain C loops;
+** a guarded loop is emitted twice as in the bytecode, unchecked behind its
+** guards and checked otherwise.
+*/
+
+static const char* modeHeaders[] = {
+    [NUM_INT32]   = "typedef int num;\n#define NUM_MIN INT_MIN\n#define NUM_FMT \"%d\"\n#define CHECKED 0\n",
+    [NUM_INT64]   = "typedef long long num;\n#define NUM_MIN LLONG_MIN\n#define NUM_FMT \"%lld\"\n#define CHECKED 0\n",
+    [NUM_CHECKED] = "typedef int num;\n#define NUM_MIN INT_MIN\n#define NUM_FMT \"%d\"\n#define CHECKED 1\n",
+};
+
+static const char* prelude =
+    "\n"
+    "static void fail(const char* msg)\n"
+    "{\n"
+    "    fflush(stdout);\n"
+    "    fprintf(stderr, \"Parser Error: %s\\n\", msg);\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n"
+    "static num addNum(num a, num b)\n"
+    "{\n"
+    "    num out;\n"
+    "    if (__builtin_add_overflow(a, b, &out))\n"
+    "        fail(\"Integer overflow\");\n"
+    "    return out;\n"
+    "}\n"
+    "\n"
+    "static num subNum(num a, num b)\n"
+    "{\n"
+    "    num out;\n"
+    "    if (__builtin_sub_overflow(a, b, &out))\n"
+    "        fail(\"Integer overflow\");\n"
+    "    return out;\n"
+    "}\n"
+    "\n"
+    "static num mulNum(num a, num b)\n"
+    "{\n"
+    "    num out;\n"
+    "    if (__builtin_mul_overflow(a, b, &out))\n"
+    "        fail(\"Integer overflow\");\n"
+    "    return out;\n"
+    "}\n"
+    "\n"
+    "static num divNum(num a, num b)\n"
+    "{\n"
+    "    if (b == 0)\n"
+    "        fail(\"Division by zero\");\n"
+    "    if (b == -1)\n"
+    "    {\n"
+    "        if (CHECKED && a == NUM_MIN)\n"
+    "            fail(\"Integer overflow\");\n"
+    "        return -a;\n"
+    "    }\n"
+    "    return a / b;\n"
+    "}\n"
+    "\n"
+    "static num modNum(num a, num b)\n"
+    "{\n"
+    "    if (b == 0)\n"
+    "        fail(\"Modulo by zero\");\n"
+    "    if (b == -1)\n"
+    "    {\n"
+    "        if (CHECKED && a == NUM_MIN)\n"
+    "            fail(\"Integer overflow\");\n"
+    "        return 0;\n"
+    "    }\n"
+    "    return a % b;\n"
+    "}\n"
+    "\n"
+    "static num powNum(num a, num b)\n"
+    "{\n"
+    "    num out = 1;\n"
+    "    if (b < 0)\n"
+    "    {\n"
+    "        if (a == 0)\n"
+    "            fail(\"Division by zero\");\n"
+    "        if (a == 1 || a == -1)\n"
+    "            return (a == -1 && (b & 1)) ? -1 : 1;\n"
+    "        return 0;\n"
+    "    }\n"
+    "    while (b)\n"
+    "    {\n"
+    "        if (b & 1)\n"
+    "            out = CHECKED ? mulNum(out, a) : out * a;\n"
+    "        b >>= 1;\n"
+    "        if (b)\n"
+    "            a = CHECKED ? mulNum(a, a) : a * a;\n"
+    "    }\n"
+    "    return out;\n"
+    "}\n"
+    "\n"
+    "static num readNum(const char* name)\n"
+    "{\n"
+    "    long long val = 0;\n"
+    "    if (PROMPT)\n"
+    "    {\n"
+    "        printf(\"Input for variable '%s': \", name);\n"
+    "        fflush(stdout);\n"
+    "    }\n"
+    "    int got = scanf(\"%lld\", &val);\n"
+    "    if (got == EOF && EOF_READS_ZERO)\n"
+    "        return 0;\n"
+    "    if (got == EOF)\n"
+    "        fail(\"Unexpected end of input\");\n"
+    "    if (got != 1)\n"
+    "        fail(\"Invalid input\");\n"
+    "    if (CHECKED && (val < INT_MIN || val > INT_MAX))\n"
+    "        fail(\"Integer overflow\");\n"
+    "    return (num)val;\n"
+    "}\n"
+    "\n";
+
+static const char* arrayPrelude =
+    "typedef struct\n"
+    "{\n"
+    "    num*      data;\n"
+    "    long long length;\n"
+    "} arr;\n"
+    "\n"
+    "static void arrDeclare(arr* a, num length)\n"
+    "{\n"
+    "    if (length < 0 || (long long)length > INT_MAX)\n"
+    "        fail(\"Invalid array length\");\n"
+    "    num* data = (num*)calloc(length ? (size_t)length : 1, sizeof(num));\n"
+    "    if (!data)\n"
+    "        fail(\"Out of memory\");\n"
+    "    free(a->data);\n"
+    "    a->data   = data;\n"
+    "    a->length = length;\n"
+    "}\n"
+    "\n"
+    "static num* arrAt(arr* a, num index)\n"
+    "{\n"
+    "    if ((unsigned long long)(long long)index >= (unsigned long long)a->length)\n"
+    "        fail(\"Array index out of bounds\");\n"
+    "    return &a->data[index];\n"
+    "}\n"
+    "\n"
+    "static int arrCovers(const arr* a, num low, int lowOffset, num high, int highOffset)\n"
+    "{\n"
+    "    long long lo, hi;\n"
+    "    if (__builtin_add_overflow((long long)low, lowOffset, &lo)\n"
+    "        || __builtin_add_overflow((long long)high, highOffset, &hi))\n"
+    "        return 0;\n"
+    "    return a ? lo >= 0 && hi < a->length : lo <= hi;\n"
+    "}\n"
+    "\n"
+    "static num arrSum(const arr* a)\n"
+    "{\n"
+    "    long long s = 0;\n"
+    "    for (long long i = 0; i < a->length; i++)\n"
+    "        s += a->data[i];\n"
+    "    if (CHECKED && (s < INT_MIN || s > INT_MAX))\n"
+    "        fail(\"Integer overflow\");\n"
+    "    return (num)s;\n"
+    "}\n"
+    "\n"
+    "static num arrExtreme(const arr* a, int max)\n"
+    "{\n"
+    "    if (a->length == 0)\n"
+    "        fail(\"Empty array\");\n"
+    "    num m = a->data[0];\n"
+    "    for (long long i = 1; i < a->length; i++)\n"
+    "        if (max ? a->data[i] > m : a->data[i] < m)\n"
+    "            m = a->data[i];\n"
+    "    return m;\n"
+    "}\n"
+    "\n"
+    "static num applyNum(int op, num a, num b)\n"
+    "{\n"
+    "    switch (op)\n"
+    "    {\n"
+    "        case 0: return CHECKED ? addNum(a, b) : a + b;\n"
+    "        case 1: return CHECKED ? subNum(a, b) : a - b;\n"
+    "        case 2: return CHECKED ? mulNum(a, b) : a * b;\n"
+    "        case 3: return divNum(a, b);\n"
+    "        default: return modNum(a, b);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void arrApply(arr* d, int op, const arr* a, num x, const arr* b, num y)\n"
+    "{\n"
+    "    if ((a && a->length != d->length) || (op >= 0 && b && b->length != d->length))\n"
+    "        fail(\"Array lengths differ\");\n"
+    "    for (long long i = 0; i < d->length; i++)\n"
+    "        d->data[i] = op < 0 ? (a ? a->data[i] : x)\n"
+    "            : applyNum(op, a ? a->data[i] : x, b ? b->data[i] : y);\n"
+    "}\n"
+    "\n";
+
+typedef struct
+{
+    FILE*        out;
+    NumMode      mode;
+    int          tempCount;
+    int          unchecked;
+    const char** names;
+} Transpiler;
+
+static void transpileBlock(const Node* stmt, Transpiler* tp, int indent);
+static void transpileExpr(const Node* n, Transpiler* tp);
+static void transpileChain(const Node* n, Transpiler* tp);
+
+static int canFail(Transpiler* tp, const Node* n)
+{
+    for (; n; n = n->left)
+    {
+        if (n->kind == N_DIV || n->kind == N_MOD || n->kind == N_POW
+            || n->kind == N_INDEX || n->kind == N_MIN || n->kind == N_MAX)
+            return 1;
+        if (tp->mode == NUM_CHECKED && n->kind == N_SUM)
+            return 1;
+        if (tp->mode == NUM_CHECKED && isOperator(n))
+            return 1;
+        if (canFail(tp, n->right))
+            return 1;
+    }
+    return 0;
+}
+
+/* 1 for a variable, 2 for an array; bounds guards only name what the loop uses. */
+static void markSlot(const Node* n, int* used)
+{
+    if (n->kind == N_VAR || n->kind == N_ASSIGN || n->kind == N_INPUT)
+        used[n->value] = 1;
+    else if (n->kind >= N_INDEX && n->kind <= N_ARRAY_ASSIGN)
+        used[n->value] = 2;
+}
+
+/* Statements follow next, expressions their left edge, so neither recurses per item. */
+static void markUsed(const Node* n, int* used)
+{
+    for (; n; n = n->next)
+    {
+        markSlot(n, used);
+        markUsed(n->right, used);
+        markUsed(n->alt, used);
+        for (const Node* e = n->left; e; e = e->left)
+        {
+            markSlot(e, used);
+            markUsed(e->right, used);
+        }
+    }
+}
+
+void transpileProgram(const Program* prog, const InputSource* input, FILE* out)
+{
+    Transpiler  tr;
+    Transpiler* tp = &tr;
+    int*        used = (int*)calloc((size_t)prog->slots.count + 1, sizeof(int));
+    int         arrays = 0;
+
+    if (!used)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    pushCleanup(free, used);
+    markUsed(prog->body, used);
+    tp->names     = prog->slots.names;
+    tp->out       = out;
+    tp->mode      = prog->mode;
+    tp->tempCount = 0;
+    tp->unchecked = 0;
+    for (int i = 0; i < prog->slots.count; i++)
+        arrays |= used[i] == 2;
+
+    fputs("#include <stdio.h>\n#include <stdlib.h>\n#include <limits.h>\n\n", out);
+    fputs(modeHeaders[tp->mode], out);
+    fprintf(out, "#define PROMPT %d\n#define EOF_READS_ZERO %d\n",
+        input->prompt != 0, input->onEof == EOF_ZERO);
+    fputs(prelude, out);
+    if (arrays)
+        fputs(arrayPrelude, out);
+    fprintf(out, "int main(void)\n{\n");
+    for (int i = 0; i < prog->slots.count; i++)
+        if (used[i] == 1)
+            fprintf(out, "    num v_%s = 0;\n", prog->slots.names[i]);
+        else if (used[i] == 2)
+            fprintf(out, "    arr a_%s = { 0, 0 };\n", prog->slots.names[i]);
+    popCleanup();
+    free(used);
+    fprintf(out, "\n");
+    transpileBlock(prog->body, tp, 1);
+    fprintf(out, "    printf(\"Program successfully parsed.\\n\");\n");
+    fprintf(out, "    return 0;\n}\n");
+}
+
+int buildNative(const Program* prog, const InputSource* input, const char* outPath)
+{
+    size_t len   = strlen(outPath);
+    char*  cPath = (char*)malloc(len + 3);
+    int    status;
+
+    if (!cPath)
+        return 0;
+    memcpy(cPath, outPath, len);
+    memcpy(cPath + len, ".c", 3);
+
+    FILE* f = fopen(cPath, "w");
+    if (!f)
+    {
+        free(cPath);
+        return 0;
+    }
+    transpileProgram(prog, input, f);
+    if (fclose(f) != 0)
+    {
+        free(cPath);
+        return 0;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        char* const argv[] = { "gcc", "-O2", "-fwrapv", "-o", (char*)outPath, cPath, NULL };
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    free(cPath);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void transpileLoop(const Node* stmt, Transpiler* tp, int indent)
+{
+    fprintf(tp->out, "while (");
+    transpileExpr(stmt->left, tp);
+    fprintf(tp->out, ")\n%*s{\n", indent * 4, "");
+    transpileBlock(stmt->right, tp, indent + 1);
+    fprintf(tp->out, "%*s}\n", indent * 4, "");
+}
+
+/* Writes a guard bound as its base expression and constant offset. */
+static void transpileBound(const Node* n, Transpiler* tp)
+{
+    int offset = 0;
+
+    if (n->kind == N_ADD)
+    {
+        offset = n->right->value;
+        n      = n->left;
+    }
+    transpileExpr(n, tp);
+    fprintf(tp->out, ", %d", offset);
+}
+
+static void transpileGuarded(const Node* stmt, Transpiler* tp, int indent)
+{
+    fprintf(tp->out, "if (");
+    for (const Node* g = stmt->alt; g; g = g->next)
+    {
+        if (g->value >= 0)
+            fprintf(tp->out, "arrCovers(&a_%s, ", tp->names[g->value]);
+        else
+            fprintf(tp->out, "arrCovers(0, ");
+        transpileBound(g->left, tp);
+        fprintf(tp->out, ", ");
+        transpileBound(g->right, tp);
+        fprintf(tp->out, g->next ? ") && " : ")");
+    }
+    fprintf(tp->out, ")\n%*s{\n%*s", indent * 4, "", (indent + 1) * 4, "");
+    tp->unchecked = 1;
+    transpileLoop(stmt, tp, indent + 1);
+    tp->unchecked = 0;
+    fprintf(tp->out, "%*s}\n%*selse\n%*s{\n%*s", indent * 4, "", indent * 4, "", indent * 4, "",
+        (indent + 1) * 4, "");
+    transpileLoop(stmt, tp, indent + 1);
+    fprintf(tp->out, "%*s}\n", indent * 4, "");
+}
+
+/* A whole-array operand: an array is passed by address, a number as itself. */
+static void transpileOperand(const Node* n, Transpiler* tp)
+{
+    if (n->kind == N_ARRAY)
+        fprintf(tp->out, "&a_%s, 0", tp->names[n->value]);
+    else
+    {
+        fprintf(tp->out, "0, ");
+        transpileExpr(n, tp);
+    }
+}
+
+static void transpileArrayAssign(const Node* stmt, Transpiler* tp)
+{
+    const Node* e = stmt->left;
+
+    fprintf(tp->out, "arrApply(&a_%s, ", tp->names[stmt->value]);
+    if (isOperator(e) && (e->left->kind == N_ARRAY || e->right->kind == N_ARRAY))
+    {
+        fprintf(tp->out, "%d, ", e->kind - N_ADD);
+        transpileOperand(e->left, tp);
+        fprintf(tp->out, ", ");
+        transpileOperand(e->right, tp);
+    }
+    else
+    {
+        fprintf(tp->out, "-1, ");
+        transpileOperand(e, tp);
+        fprintf(tp->out, ", 0, 0");
+    }
+    fprintf(tp->out, ");\n");
+}
+
+static void transpileStatement(const Node* stmt, Transpiler* tp, int indent)
+{
+    fprintf(tp->out, "%*s", indent * 4, "");
+    switch (stmt->kind)
+    {
+        case N_ASSIGN:
+            fprintf(tp->out, "v_%s = ", tp->names[stmt->value]);
+            transpileExpr(stmt->left, tp);
+            fprintf(tp->out, ";\n");
+            break;
+
+        case N_OUTPUT:
+            fprintf(tp->out, "printf(NUM_FMT \"\\n\", ");
+            transpileExpr(stmt->left, tp);
+            fprintf(tp->out, ");\n");
+            break;
+
+        case N_INPUT:
+            fprintf(tp->out, "v_%s = readNum(\"%s\");\n", tp->names[stmt->value], tp->names[stmt->value]);
+            break;
+
+        case N_IF:
+            fprintf(tp->out, "if (");
+            transpileExpr(stmt->left, tp);
+            fprintf(tp->out, ")\n%*s{\n", indent * 4, "");
+            transpileBlock(stmt->right, tp, indent + 1);
+            fprintf(tp->out, "%*s}\n", indent * 4, "");
+            if (stmt->alt)
+            {
+                fprintf(tp->out, "%*selse\n%*s{\n", indent * 4, "", indent * 4, "");
+                transpileBlock(stmt->alt, tp, indent + 1);
+                fprintf(tp->out, "%*s}\n", indent * 4, "");
+            }
+            break;
+
+        case N_WHILE:
+            if (stmt->alt)
+                transpileGuarded(stmt, tp, indent);
+            else
+                transpileLoop(stmt, tp, indent);
+            break;
+
+        case N_DECLARE:
+            fprintf(tp->out, "arrDeclare(&a_%s, ", tp->names[stmt->value]);
+            transpileExpr(stmt->left, tp);
+            fprintf(tp->out, ");\n");
+            break;
+
+        case N_STORE:
+        {
+            /* The index is evaluated before the value, as in the interpreter. */
+            int index = tp->tempCount++;
+            int value = tp->tempCount++;
+            fprintf(tp->out, "{ num t%d = ", index);
+            transpileExpr(stmt->right, tp);
+            fprintf(tp->out, "; num t%d = ", value);
+            transpileExpr(stmt->left, tp);
+            if (tp->unchecked)
+                fprintf(tp->out, "; a_%s.data[t%d] = t%d; }\n", tp->names[stmt->value], index, value);
+            else
+                fprintf(tp->out, "; *arrAt(&a_%s, t%d) = t%d; }\n", tp->names[stmt->value], index, value);
+        }
+        break;
+
+        case N_ARRAY_ASSIGN:
+            transpileArrayAssign(stmt, tp);
+            break;
+
+        default:
+            reportError(ERR_INTERNAL, "Unexpected node in transpileStatement");
+    }
+}
+
+static void transpileBlock(const Node* stmt, Transpiler* tp, int indent)
+{
+    for (; stmt; stmt = stmt->next)
+        transpileStatement(stmt, tp, indent);
+}
+
+/*
+** A left-deep chain becomes one temporary updated operator by operator,
+** which keeps the generated C flat and evaluates in the interpreter's order.
+*/
+static void transpileChain(const Node* n, Transpiler* tp)
+{
+    static const char* ops[]   = { "+", "-", "*" };
+    static const char* calls[] = { "addNum", "subNum", "mulNum", "divNum", "modNum", "powNum" };
+    int                temp    = tp->tempCount++;
+    Spine              s;
+
+    spineCollect(&s, n);
+    fprintf(tp->out, "({ num t%d = ", temp);
+    transpileExpr(s.leaf, tp);
+    for (int i = s.count - 1; i >= 0; i--)
+    {
+        NodeKind kind = s.ops[i]->kind;
+        if (tp->mode != NUM_CHECKED && kind <= N_MUL)
+            fprintf(tp->out, "; t%d = t%d %s ", temp, temp, ops[kind - N_ADD]);
+        else
+            fprintf(tp->out, "; t%d = %s(t%d, ", temp, calls[kind - N_ADD], temp);
+        transpileExpr(s.ops[i]->right, tp);
+        if (tp->mode == NUM_CHECKED || kind > N_MUL)
+            fprintf(tp->out, ")");
+    }
+    fprintf(tp->out, "; t%d; })", temp);
+    spineFree(&s);
+}
+
+static void transpileExpr(const Node* n, Transpiler* tp)
+{
+    static const char* ops[]   = { "+", "-", "*" };
+    static const char* calls[] = { "addNum", "subNum", "mulNum", "divNum", "modNum", "powNum" };
+    int                infix   = tp->mode != NUM_CHECKED && n->kind <= N_MUL;
+
+    if (n->kind == N_NUM)
+    {
+        const char* suffix = tp->mode == NUM_INT64 ? "LL" : "";
+        if (n->value == -2147483647 - 1)
+            fprintf(tp->out, "(-2147483647%s - 1)", suffix);
+        else
+            fprintf(tp->out, "%d%s", n->value, suffix);
+        return;
+    }
+    if (n->kind == N_VAR)
+    {
+        fprintf(tp->out, "v_%s", tp->names[n->value]);
+        return;
+    }
+    if (n->kind == N_INDEX)
+    {
+        if (tp->unchecked)
+            fprintf(tp->out, "a_%s.data[", tp->names[n->value]);
+        else
+            fprintf(tp->out, "(*arrAt(&a_%s, ", tp->names[n->value]);
+        transpileExpr(n->left, tp);
+        fprintf(tp->out, tp->unchecked ? "]" : "))");
+        return;
+    }
+    if (n->kind == N_LEN)
+    {
+        fprintf(tp->out, "((num)a_%s.length)", tp->names[n->value]);
+        return;
+    }
+    if (n->kind == N_SUM || n->kind == N_MIN || n->kind == N_MAX)
+    {
+        if (n->kind == N_SUM)
+            fprintf(tp->out, "arrSum(&a_%s)", tp->names[n->value]);
+        else
+            fprintf(tp->out, "arrExtreme(&a_%s, %d)", tp->names[n->value], n->kind == N_MAX);
+        return;
+    }
+
+    if (isOperator(n->left))
+    {
+        transpileChain(n, tp);
+        return;
+    }
+
+    int sequenced = canFail(tp, n->left) && canFail(tp, n->right);
+    int temp      = tp->tempCount++;
+    if (sequenced)
+    {
+        fprintf(tp->out, "({ num t%d = ", temp);
+        transpileExpr(n->left, tp);
+        fprintf(tp->out, "; ");
+    }
+
+    if (infix)
+        fprintf(tp->out, "(");
+    else
+        fprintf(tp->out, "%s(", calls[n->kind - N_ADD]);
+
+    if (sequenced)
+        fprintf(tp->out, "t%d", temp);
+    else
+        transpileExpr(n->left, tp);
+
+    if (infix)
+        fprintf(tp->out, " %s ", ops[n->kind - N_ADD]);
+    else
+        fprintf(tp->out, ", ");
+    transpileExpr(n->right, tp);
+    fprintf(tp->out, ")");
+
+    if (sequenced)
+        fprintf(tp->out, "; })");
+}
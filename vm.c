@@ -0,0 +1,240 @@
+#include "array.h"
+#include "numeric.h"
+
+/*
+** With GCC/Clang every handler jumps straight to the next one through a label
+** table; elsewhere the same handlers become the cases of a switch loop.
+*/
+#ifdef VM_COMPUTED_GOTO
+# define VM_CASE(op) L_##op:
+# define VM_NEXT()   goto *dispatch[*pc++]
+# define VM_LOOP()   VM_NEXT();
+#else
+# define VM_CASE(op) case op:
+# define VM_NEXT()   break
+# define VM_LOOP()   for (;;) switch (*pc++)
+#endif
+
+/* Binary handlers: WRAP ops cannot fail, CHECK ops go through numFail. */
+#define VM_WRAP(op, fn)                 \
+    VM_CASE(op)                         \
+        sp--;                           \
+        sp[-1] = fn(sp[-1], sp[0]);     \
+        VM_NEXT();
+#define VM_CHECK(op, call)              \
+    VM_CASE(op)                         \
+    {                                   \
+        NumStatus st;                   \
+        sp--;                           \
+        if ((st = (call)) != NUM_OK)    \
+            numFail(st);                \
+    }                                   \
+    VM_NEXT();
+
+void runBytecode(Interp* interp, const Bytecode* bc, const JitCode* jit)
+{
+#ifdef VM_COMPUTED_GOTO
+    static const void* dispatch[OP_COUNT] = {
+        [OP_HALT]    = &&L_OP_HALT,
+        [OP_PUSH]    = &&L_OP_PUSH,
+        [OP_LOAD]    = &&L_OP_LOAD,
+        [OP_STORE]   = &&L_OP_STORE,
+        [OP_ADD]     = &&L_OP_ADD,
+        [OP_SUB]     = &&L_OP_SUB,
+        [OP_MUL]     = &&L_OP_MUL,
+        [OP_DIV]     = &&L_OP_DIV,
+        [OP_MOD]     = &&L_OP_MOD,
+        [OP_POW]     = &&L_OP_POW,
+        [OP_ADD64]   = &&L_OP_ADD64,
+        [OP_SUB64]   = &&L_OP_SUB64,
+        [OP_MUL64]   = &&L_OP_MUL64,
+        [OP_DIV64]   = &&L_OP_DIV64,
+        [OP_MOD64]   = &&L_OP_MOD64,
+        [OP_POW64]   = &&L_OP_POW64,
+        [OP_ADDCHK]  = &&L_OP_ADDCHK,
+        [OP_SUBCHK]  = &&L_OP_SUBCHK,
+        [OP_MULCHK]  = &&L_OP_MULCHK,
+        [OP_DIVCHK]  = &&L_OP_DIVCHK,
+        [OP_MODCHK]  = &&L_OP_MODCHK,
+        [OP_POWCHK]  = &&L_OP_POWCHK,
+        [OP_JZ]      = &&L_OP_JZ,
+        [OP_JNZ]     = &&L_OP_JNZ,
+        [OP_JMP]     = &&L_OP_JMP,
+        [OP_PRINT]   = &&L_OP_PRINT,
+        [OP_READ]    = &&L_OP_READ,
+        [OP_LOOP]    = &&L_OP_LOOP,
+        [OP_SUMMARY] = &&L_OP_SUMMARY,
+        [OP_DECLARE] = &&L_OP_DECLARE,
+        [OP_INDEX]   = &&L_OP_INDEX,
+        [OP_INDEXU]  = &&L_OP_INDEXU,
+        [OP_STOREX]  = &&L_OP_STOREX,
+        [OP_STOREXU] = &&L_OP_STOREXU,
+        [OP_LEN]     = &&L_OP_LEN,
+        [OP_SUM]     = &&L_OP_SUM,
+        [OP_MIN]     = &&L_OP_MIN,
+        [OP_MAX]     = &&L_OP_MAX,
+        [OP_ARRAY]   = &&L_OP_ARRAY,
+        [OP_GUARD]   = &&L_OP_GUARD,
+    };
+#endif
+    const int*   code   = bc->code;
+    const Value* consts = bc->consts;
+    const int*   pc     = code;
+    Value*       stack  = (Value*)malloc(sizeof(Value) * ((size_t)bc->maxStack + 1 + (size_t)bc->slots.count));
+    Value*       sp     = stack;
+    Value*       variables;
+    ArrayTable   arrays;
+    JitFn*       native = (jit && jit->compiled) ? jit->entries : NULL;
+
+    if (!stack)
+        reportError(ERR_NO_MEMORY, "Out of memory");
+    pushCleanup(free, stack);
+    variables = stack + bc->maxStack + 1;
+    ft_memset(variables, 0, sizeof(Value) * (size_t)bc->slots.count);
+    arraysInit(&arrays, bc->slots.count);
+    pushCleanup(arraysFree, &arrays);
+
+    VM_LOOP()
+    {
+        VM_CASE(OP_HALT)
+            goto done;
+
+        VM_CASE(OP_PUSH)
+            *sp++ = consts[*pc++];
+            VM_NEXT();
+
+        VM_CASE(OP_LOAD)
+            *sp++ = variables[*pc++];
+            VM_NEXT();
+
+        VM_CASE(OP_STORE)
+            variables[*pc++] = *--sp;
+            VM_NEXT();
+
+        VM_WRAP(OP_ADD, numAdd32)
+        VM_WRAP(OP_SUB, numSub32)
+        VM_WRAP(OP_MUL, numMul32)
+        VM_CHECK(OP_DIV, numDivide(NUM_INT32, sp[-1], sp[0], 0, &sp[-1]))
+        VM_CHECK(OP_MOD, numDivide(NUM_INT32, sp[-1], sp[0], 1, &sp[-1]))
+        VM_CHECK(OP_POW, numPower(NUM_INT32, sp[-1], sp[0], &sp[-1]))
+
+        VM_WRAP(OP_ADD64, numAdd64)
+        VM_WRAP(OP_SUB64, numSub64)
+        VM_WRAP(OP_MUL64, numMul64)
+        VM_CHECK(OP_DIV64, numDivide(NUM_INT64, sp[-1], sp[0], 0, &sp[-1]))
+        VM_CHECK(OP_MOD64, numDivide(NUM_INT64, sp[-1], sp[0], 1, &sp[-1]))
+        VM_CHECK(OP_POW64, numPower(NUM_INT64, sp[-1], sp[0], &sp[-1]))
+
+        VM_CHECK(OP_ADDCHK, numAddChecked(sp[-1], sp[0], &sp[-1]))
+        VM_CHECK(OP_SUBCHK, numSubChecked(sp[-1], sp[0], &sp[-1]))
+        VM_CHECK(OP_MULCHK, numMulChecked(sp[-1], sp[0], &sp[-1]))
+        VM_CHECK(OP_DIVCHK, numDivide(NUM_CHECKED, sp[-1], sp[0], 0, &sp[-1]))
+        VM_CHECK(OP_MODCHK, numDivide(NUM_CHECKED, sp[-1], sp[0], 1, &sp[-1]))
+        VM_CHECK(OP_POWCHK, numPower(NUM_CHECKED, sp[-1], sp[0], &sp[-1]))
+
+        VM_CASE(OP_JZ)
+            if (*--sp == 0)
+                pc = code + *pc;
+            else
+                pc++;
+            VM_NEXT();
+
+        VM_CASE(OP_JNZ)
+            if (*--sp != 0)
+                pc = code + *pc;
+            else
+                pc++;
+            VM_NEXT();
+
+        VM_CASE(OP_JMP)
+            pc = code + *pc;
+            VM_NEXT();
+
+        VM_CASE(OP_PRINT)
+            printValue(interp, *--sp);
+            VM_NEXT();
+
+        VM_CASE(OP_READ)
+            variables[*pc] = readValue(interp, *pc, bc->mode);
+            pc++;
+            VM_NEXT();
+
+        VM_CASE(OP_LOOP)
+            if (native && native[*pc])
+            {
+                native[*pc](variables, interp);
+                pc = code + bc->loops[*pc].end;
+            }
+            else
+                pc++;
+            VM_NEXT();
+
+        VM_CASE(OP_SUMMARY)
+            if (applySummary(&bc->summaries[pc[0]], variables))
+                pc = code + pc[1];
+            else
+                pc += 2;
+            VM_NEXT();
+
+        VM_CASE(OP_DECLARE)
+            arrayDeclare(&arrays, *pc++, *--sp);
+            VM_NEXT();
+
+        VM_CASE(OP_INDEX)
+            sp[-1] = *arrayElement(&arrays, *pc++, sp[-1]);
+            VM_NEXT();
+
+        VM_CASE(OP_INDEXU)
+            sp[-1] = arrays.items[*pc++].data[sp[-1]];
+            VM_NEXT();
+
+        VM_CASE(OP_STOREX)
+            sp -= 2;
+            *arrayElement(&arrays, *pc++, sp[0]) = sp[1];
+            VM_NEXT();
+
+        VM_CASE(OP_STOREXU)
+            sp -= 2;
+            arrays.items[*pc++].data[sp[0]] = sp[1];
+            VM_NEXT();
+
+        VM_CASE(OP_LEN)
+            *sp++ = (Value)arrays.items[*pc++].length;
+            VM_NEXT();
+
+        VM_CASE(OP_SUM)
+            *sp++ = arrayReduce(&arrays, bc->mode, N_SUM, *pc++);
+            VM_NEXT();
+
+        VM_CASE(OP_MIN)
+            *sp++ = arrayReduce(&arrays, bc->mode, N_MIN, *pc++);
+            VM_NEXT();
+
+        VM_CASE(OP_MAX)
+            *sp++ = arrayReduce(&arrays, bc->mode, N_MAX, *pc++);
+            VM_NEXT();
+
+        VM_CASE(OP_ARRAY)
+        {
+            /* Number operands were pushed left to right. */
+            Value y = (pc[1] >= 0 && pc[3] < 0) ? *--sp : 0;
+            Value x = pc[2] < 0 ? *--sp : 0;
+            arrayApply(&arrays, bc->mode, pc[0], pc[1], pc[2], x, pc[3], y);
+            pc += 4;
+        }
+        VM_NEXT();
+
+        VM_CASE(OP_GUARD)
+            sp -= 2;
+            if (arrayCovers(&arrays, pc[0], sp[0], pc[1], sp[1], pc[2]))
+                pc += 4;
+            else
+                pc = code + pc[3];
+            VM_NEXT();
+    }
+done:
+    popCleanup();
+    arraysFree(&arrays);
+    popCleanup();
+    free(stack);
+}